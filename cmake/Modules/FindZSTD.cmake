@@ -0,0 +1,31 @@
+# Find ZSTD - Zstandard compression library
+#
+# This module defines
+#  ZSTD_FOUND - whether the zstd library was found
+#  ZSTD_LIBRARIES - the zstd library
+#  ZSTD_INCLUDE_DIR - the include path of the zstd library
+#
+
+if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+
+  # Already in cache
+  set (ZSTD_FOUND TRUE)
+
+else (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+
+  find_library (ZSTD_LIBRARIES
+    NAMES
+    zstd
+    PATHS
+  )
+
+  find_path (ZSTD_INCLUDE_DIR
+    NAMES
+    zstd.h zdict.h
+    PATHS
+  )
+
+  include(FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(ZSTD DEFAULT_MSG ZSTD_LIBRARIES ZSTD_INCLUDE_DIR)
+
+endif (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
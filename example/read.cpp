@@ -6,8 +6,8 @@
 #include <boost/iostreams/filter/zlib.hpp>
 #include <boost/iostreams/filter/bzip2.hpp>
 
-#include <smack/blob.hpp>
-#include <smack/snappy.hpp>
+/* the umbrella header registers decoders of every codec, chunks are read whichever codec wrote them */
+#include <smack/smack.hpp>
 
 using namespace ioremap::smack;
 
@@ -16,8 +16,7 @@ class chunk_reader {
 	public:
 		chunk_reader(const std::string &path, bool show_data, const key &key, const int klen) :
 		m_path(path), m_st(path, 128), m_show_data(show_data) {
-			fin_t in;
-			m_st.read_index(in, m_chunks, m_chunks_unsorted, 0);
+			m_st.read_index<fin_t>(m_runs, 0);
 
 			find(key, klen);
 		}
@@ -26,43 +25,46 @@ class chunk_reader {
 		std::string m_path;
 		blob_store m_st;
 		bool m_show_data;
-		std::map<key, chunk, keycomp> m_chunks;
-		std::vector<chunk> m_chunks_unsorted;
+		std::vector<sorted_run> m_runs;
 
 		void find(const key &key, const int klen) {
-			for (std::vector<chunk>::iterator it = m_chunks_unsorted.begin(); it != m_chunks_unsorted.end(); ++it) {
-				find_in_chunk(*it, key, klen);
-			}
+			for (std::vector<sorted_run>::iterator r = m_runs.begin(); r != m_runs.end(); ++r) {
+				std::map<key_id, chunk, keycomp> &chunks = r->chunks();
 
-			if (!m_chunks.size())
-				return;
+				if (klen != 0) {
+					std::map<key_id, chunk, keycomp>::iterator it = chunks.upper_bound(key);
+					if (it == chunks.begin())
+						continue;
 
-			if (klen != 0) {
-				std::map<class key, chunk, keycomp>::iterator it = m_chunks.upper_bound(key);
-				if (it == m_chunks.end()) {
-					find_in_chunk(m_chunks.rbegin()->second, key, klen);
-				} else if (it == m_chunks.begin()) {
-					return;
-				} else {
 					--it;
 					find_in_chunk(it->second, key, klen);
-				}
-			} else {
-				for (std::map<class key, chunk, keycomp>::iterator it = m_chunks.begin(); it != m_chunks.end(); ++it) {
-					find_in_chunk(it->second, key, klen);
+				} else {
+					for (std::map<key_id, chunk, keycomp>::iterator it = chunks.begin(); it != chunks.end(); ++it) {
+						find_in_chunk(it->second, key, klen);
+					}
 				}
 			}
 		}
 
 		void find_in_chunk(chunk &ch, const key &key, const int klen) {
-			cache_t cache;
-			fin_t in;
-			m_st.read_chunk(in, ch, cache);
+			/* values are only decompressed when they are shown */
+			std::vector<class key> keys;
+			std::vector<std::string> data;
+			if (m_show_data) {
+				cache_t cache;
+				m_st.read_chunk<fin_t>(ch, cache);
+				for (cache_t::iterator it = cache.begin(); it != cache.end(); ++it) {
+					keys.push_back(cache_source::cache_index(it));
+					data.push_back(it->second.data);
+				}
+			} else {
+				m_st.read_chunk_keys<fin_t>(ch, keys);
+			}
+
 			bool found = false;
 
-			size_t offset = 0;
-			for (cache_t::iterator it = cache.begin(); it != cache.end(); ++it) {
-				const struct index *idx = it->first.idx();
+			for (size_t i = 0; i < keys.size(); ++i) {
+				const struct index *idx = keys[i].idx();
 
 				if (!klen || !memcmp(key.idx()->id, idx->id, klen)) {
 					if (!found) {
@@ -74,13 +76,12 @@ class chunk_reader {
 						found = true;
 					}
 
-					log(SMACK_LOG_INFO, "%s: ts: %zd, data-offset: %zd/%zd, data-size: %d, data: %s\n",
-						it->first.str(), idx->ts,
-						offset, offset + ch.ctl()->data_offset,	idx->data_size,
-						m_show_data ? it->second.c_str() : "none");
+					log(SMACK_LOG_INFO, "%s: ts: %zd, flags: %x, data-size: %d, data: %s\n",
+						keys[i].str(), idx->ts, idx->flags, idx->data_size,
+						(idx->flags & SMACK_INDEX_FLAGS_REMOVED) ? "removed" :
+						(idx->flags & SMACK_INDEX_FLAGS_VLOG) ? "value-log" :
+							m_show_data ? data[i].c_str() : "none");
 				}
-
-				offset += idx->data_size + sizeof(struct index);
 			}
 		}
 };
@@ -9,6 +9,373 @@
 using namespace ioremap::smack;
 namespace bio = boost::iostreams;
 
+/* compactions and merges of scheduler_blob block until the gate is opened, flushes do not */
+struct scheduler_gate {
+	scheduler_gate() : open(false), background(0), max_background(0), flushes(0) {}
+
+	boost::mutex lock;
+	boost::condition cond;
+	bool open;
+	int background, max_background, flushes;
+
+	void enter_background() {
+		boost::mutex::scoped_lock guard(lock);
+		background++;
+		max_background = std::max(max_background, background);
+		cond.notify_all();
+
+		while (!open)
+			cond.wait(guard);
+
+		background--;
+	}
+
+	/* waits until @pred is true for up to @secs seconds */
+	template <class Pred>
+	bool wait(Pred pred, int secs) {
+		boost::mutex::scoped_lock guard(lock);
+		boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(secs);
+
+		while (!pred(*this)) {
+			if (!cond.timed_wait(guard, deadline))
+				return pred(*this);
+		}
+		return true;
+	}
+};
+
+static scheduler_gate sched_gate;
+
+/* the part of blob job_scheduler needs */
+class scheduler_blob {
+	public:
+		scheduler_blob() : m_flush_queued(false) {}
+
+		bool flush_queued() const { return m_flush_queued; }
+		void set_flush_queued(bool queued) { m_flush_queued = queued; }
+		uint64_t flush_urgency() { return 1; }
+		uint64_t compaction_urgency() { return 1; }
+		bool want_flush() { return false; }
+		key start() { return key(); }
+
+		bool flush() {
+			boost::mutex::scoped_lock guard(sched_gate.lock);
+			sched_gate.flushes++;
+			sched_gate.cond.notify_all();
+			return false;
+		}
+
+		void compact() {
+			sched_gate.enter_background();
+		}
+
+		bool absorb(boost::shared_ptr<scheduler_blob>, boost::shared_ptr<scheduler_blob>) {
+			sched_gate.enter_background();
+			return false;
+		}
+
+	private:
+		boost::atomic<bool> m_flush_queued;
+};
+
+static bool sched_background_started(const scheduler_gate &g) { return g.background > 0; }
+static bool sched_flushed(const scheduler_gate &g) { return g.flushes > 0; }
+
+/*
+ * With the smallest pool (cache_thread_num = 2) compactions and merges are queued and blocked,
+ * write cache flush still has to run and background jobs must not occupy more than half of the threads.
+ */
+static int scheduler_test(int thread_num)
+{
+	typedef boost::shared_ptr<scheduler_blob> sb_t;
+	int err = 0;
+
+	log(SMACK_LOG_INFO, "starting scheduler test: threads: %d\n", thread_num);
+	{
+		job_scheduler<scheduler_blob> sched(thread_num);
+
+		sb_t compacted(new scheduler_blob), merged_dst(new scheduler_blob), merged_src(new scheduler_blob);
+		sb_t compacted_next(new scheduler_blob), flushed(new scheduler_blob);
+
+		sched.notify(compacted, job_compact);
+		sched.merge(merged_dst, merged_src);
+		sched.notify(compacted_next, job_compact);
+
+		if (!sched_gate.wait(sched_background_started, 10)) {
+			log(SMACK_LOG_ERROR, "scheduler: no compaction or merge started\n");
+			err = -EINVAL;
+		}
+
+		sched.notify(flushed, job_flush);
+		if (!sched_gate.wait(sched_flushed, 10)) {
+			log(SMACK_LOG_ERROR, "scheduler: write cache flush is starved by compactions and merges\n");
+			err = -EINVAL;
+		}
+
+		{
+			boost::mutex::scoped_lock guard(sched_gate.lock);
+			if (sched_gate.max_background > thread_num / 2) {
+				log(SMACK_LOG_ERROR, "scheduler: %d compactions and merges ran at once with %d threads\n",
+						sched_gate.max_background, thread_num);
+				err = -EINVAL;
+			}
+
+			sched_gate.open = true;
+			sched_gate.cond.notify_all();
+		}
+
+		sched.wait_for_all();
+	}
+
+	log(SMACK_LOG_INFO, "scheduler test: %s\n", err ? "failed" : "ok");
+	return err;
+}
+
+/* SHA-512 pads the name with at least 17 bytes, so one 128-byte block holds up to 111 bytes, two blocks 239 bytes */
+static const int key_hash_sizes[] = {
+	0, 1, 63, 64, 110, 111, 112, 113, 127, 128, 129, 200, 238, 239, 240, 241, 256, 300,
+};
+
+static std::string key_hash_name(int size, int seed)
+{
+	std::string name(size, '\0');
+	for (int i = 0; i < size; ++i)
+		name[i] = 'a' + (i * 7 + seed) % 26;
+	return name;
+}
+
+/* returns number of names which batch hashing turns into keys different from key(name, hash) */
+static int key_hash_test_batch(struct smack_ctl *sctl, enum key_hash hash)
+{
+	const char *hash_str = (hash == key_hash_fast) ? "fast" : "sha512";
+	int num = sizeof(key_hash_sizes) / sizeof(key_hash_sizes[0]);
+	std::vector<std::string> names;
+	std::vector<key> keys;
+	int errors = 0;
+
+	/* names of the same size share lanes, several of each fill them */
+	for (int seed = 0; seed < 3; ++seed) {
+		for (int i = 0; i < num; ++i)
+			names.push_back(key_hash_name(key_hash_sizes[i], seed));
+	}
+
+	key::hash_batch(names, keys, hash);
+	if (keys.size() != names.size()) {
+		log(SMACK_LOG_ERROR, "key hash: %s: batch returned %zd keys for %zd names\n",
+				hash_str, keys.size(), names.size());
+		return names.size();
+	}
+
+	for (size_t i = 0; i < names.size(); ++i) {
+		key want(names[i], hash);
+		if (keys[i] == want)
+			continue;
+
+		log(SMACK_LOG_ERROR, "key hash: %s: batch: name-size: %zd: %s, want: %s\n",
+				hash_str, names[i].size(), keys[i].str(), want.str());
+		errors++;
+	}
+
+	/* C API hashes names the way storage was initialized, that is SHA-512 by default */
+	if (sctl) {
+		std::vector<const char *> ptrs(names.size());
+		std::vector<int> sizes(names.size());
+		std::vector<struct index> idx(names.size());
+
+		for (size_t i = 0; i < names.size(); ++i) {
+			ptrs[i] = names[i].data();
+			sizes[i] = names[i].size();
+		}
+
+		int err = smack_keys(sctl, &ptrs[0], &sizes[0], names.size(), &idx[0]);
+		for (size_t i = 0; i < names.size(); ++i) {
+			struct index one;
+			memset(&one, 0, sizeof(struct index));
+			int one_err = smack_key(sctl, ptrs[i], sizes[i], &one);
+
+			if (!err && !one_err && (key(&idx[i]) == keys[i]) && (key(&one) == keys[i]))
+				continue;
+
+			log(SMACK_LOG_ERROR, "key hash: %s: name-size: %zd: smack_keys: %d: %s, smack_key: %d: %s, want: %s\n",
+					hash_str, names[i].size(), err, key(&idx[i]).str(), one_err, key(&one).str(), keys[i].str());
+			errors++;
+		}
+	}
+
+	log(SMACK_LOG_INFO, "key hash: %s: names: %zd, errors: %d\n", hash_str, names.size(), errors);
+	return errors;
+}
+
+/* batch hashing has to be bit-identical to key(name) around SHA-512 padding limits */
+static int key_hash_test(struct smack_ctl *sctl)
+{
+	log(SMACK_LOG_INFO, "starting key hash test\n");
+
+	if (key_hash_test_batch(sctl, key_hash_sha512) || key_hash_test_batch(NULL, key_hash_fast))
+		return -EINVAL;
+	return 0;
+}
+
+/* what the verify pass expects to read for given record */
+enum verify_state {
+	verify_live = 0,
+	verify_removed,
+	verify_ttl_expired,
+	verify_expired,
+	verify_expire_later,
+	verify_state_num,
+};
+
+static const char *verify_state_str[verify_state_num] = {
+	"live", "removed", "ttl-expired", "expired", "expire-later",
+};
+
+static const int verify_num = 20000;
+static const int verify_ttl = 3600;
+static const int verify_vlog_min_size = 1024;
+
+/* every third key is short, values of every fifth record go to the value log */
+static key verify_key(int i)
+{
+	std::ostringstream str;
+	str << "verify-" << i;
+
+	if (i % 3)
+		return key(str.str());
+
+	return key((const unsigned char *)str.str().data(), str.str().size());
+}
+
+static std::string verify_data(int i)
+{
+	std::ostringstream str;
+	str << "verify-data-" << i << "-";
+
+	std::string ret = str.str();
+	size_t size = (i % 5) ? ret.size() * 4 : verify_vlog_min_size * 2 + i % 512;
+	while (ret.size() < size)
+		ret += str.str();
+
+	return ret;
+}
+
+static enum verify_state verify_record_state(int i)
+{
+	return (enum verify_state)(i % verify_state_num);
+}
+
+/* writes every record, expired ones with the timestamp already past, then removes the rest of tombstone records */
+static void verify_write(struct smack_ctl *sctl)
+{
+	time_t now = time(NULL);
+
+	for (int i = 0; i < verify_num; ++i) {
+		key k = verify_key(i);
+		std::string d = verify_data(i);
+
+		struct index idx = *k.idx();
+		idx.data_size = d.size();
+		idx.ts = 0;
+
+		switch (verify_record_state(i)) {
+			case verify_ttl_expired:
+				idx.ts = now - verify_ttl - 1;
+				break;
+			case verify_expired:
+				idx.flags |= SMACK_INDEX_FLAGS_EXPIRE;
+				idx.ts = now - 1;
+				break;
+			case verify_expire_later:
+				idx.flags |= SMACK_INDEX_FLAGS_EXPIRE;
+				idx.ts = now + verify_ttl;
+				break;
+			default:
+				break;
+		}
+
+		smack_write(sctl, &idx, d.data());
+	}
+
+	for (int i = 0; i < verify_num; ++i) {
+		if (verify_record_state(i) != verify_removed)
+			continue;
+
+		key k = verify_key(i);
+		struct index idx = *k.idx();
+		smack_remove(sctl, &idx);
+	}
+}
+
+/* returns number of records which do not match */
+static int verify_read(struct smack_ctl *sctl, const char *stage)
+{
+	int errors = 0;
+
+	for (int i = 0; i < verify_num; ++i) {
+		enum verify_state state = verify_record_state(i);
+		bool want = (state == verify_live) || (state == verify_expire_later);
+
+		key k = verify_key(i);
+		struct index idx = *k.idx();
+		char *rdata = NULL;
+
+		int err = smack_read(sctl, &idx, &rdata);
+		if (!err) {
+			std::string want_data = verify_data(i);
+			if (!want || (idx.data_size != want_data.size()) || memcmp(want_data.data(), rdata, want_data.size()))
+				err = -EINVAL;
+
+			free(rdata);
+		}
+
+		if (want == !err)
+			continue;
+
+		log(SMACK_LOG_ERROR, "verify: %s: %s: record: %d, %s: %s\n", stage, k.str(), i, verify_state_str[state],
+				want ? "could not read" : "read data which has to be hidden");
+		errors++;
+	}
+
+	log(SMACK_LOG_INFO, "verify: %s: records: %d, errors: %d\n", stage, verify_num, errors);
+	return errors;
+}
+
+/*
+ * Writes short and full keys, value log values, tombstones, records expired by the ttl
+ * and by their own expiration time, checks them in the write cache, on disk and after reopen.
+ */
+static int verify_test(struct smack_init_ctl ictl, const std::string &path)
+{
+	ictl.path = (char *)path.c_str();
+	ictl.ttl = verify_ttl;
+	ictl.vlog_min_size = verify_vlog_min_size;
+
+	int err;
+	struct smack_ctl *sctl = smack_init(&ictl, &err);
+	if (!sctl)
+		return err;
+
+	log(SMACK_LOG_INFO, "starting verify test: %s\n", path.c_str());
+
+	verify_write(sctl);
+
+	int errors = verify_read(sctl, "write");
+
+	smack_sync(sctl);
+	errors += verify_read(sctl, "sync");
+
+	smack_cleanup(sctl);
+
+	sctl = smack_init(&ictl, &err);
+	if (!sctl)
+		return err;
+
+	errors += verify_read(sctl, "reopen");
+	smack_cleanup(sctl);
+
+	return errors ? -EINVAL : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	std::string path("/tmp/smack/test");
@@ -37,11 +404,29 @@ int main(int argc, char *argv[])
 	ictl.cache_thread_num = 4;
 	ictl.type = argv[1];
 
-	int err;
+	logger::instance()->init(ictl.log, ictl.log_level);
+
+	int err = scheduler_test(2);
+	if (err)
+		return err;
+
+	err = verify_test(ictl, path + "-verify");
+	if (err) {
+		log(SMACK_LOG_ERROR, "verify test failed: %d\n", err);
+		return err;
+	}
+
 	sctl = smack_init(&ictl, &err);
 	if (!sctl)
 		return err;
 
+	err = key_hash_test(sctl);
+	if (err) {
+		log(SMACK_LOG_ERROR, "key hash test failed: %d\n", err);
+		smack_cleanup(sctl);
+		return err;
+	}
+
 	std::string data = "we;lkqrjw34npvqt789340cmq23p490crtm qwpe90xwp oqu;evoeiruqvwoeiruqvbpoeiqnpqvriuevqiouei uropqwie qropeiru qwopeir";
 	std::string key_base = "qweqeqwe-";
 
@@ -78,23 +463,23 @@ int main(int argc, char *argv[])
 				i, smack_total_num(sctl), diff / 1000000., i * 1000000 / diff, diff / i);
 	}
 
-	logger::instance()->init("/dev/stdout", SMACK_LOG_NOTICE);
 	smack_sync(sctl);
-	sleep(100000);
 #endif
 
-#if 0
+	/* every remove_step-th key is removed, the read test expects it to be missing */
+	long remove_step = num / 10000 + 1;
+
 	log(SMACK_LOG_INFO, "starting remove test\n");
-	for (i = 0; i < num; i += num / 10000 + 1) {
+	for (i = 0; i < num; i += remove_step) {
 		std::ostringstream str;
 		str << key_base << i;
 		key key(str.str());
-		s.remove(key);
+
+		struct index idx = *key.idx();
+		smack_remove(sctl, &idx);
 	}
 
-	s.sync();
-	logger::instance()->init("/dev/stdout", SMACK_LOG_INFO);
-#endif
+	smack_sync(sctl);
 
 	//logger::instance()->init("/dev/stdout", SMACK_LOG_NOTICE);
 
@@ -109,6 +494,13 @@ int main(int argc, char *argv[])
 		char *rdata = NULL;
 		try {
 			int err = smack_read(sctl, (struct index *)key.idx(), &rdata);
+			if (i % remove_step == 0) {
+				if (err >= 0) {
+					free(rdata);
+					throw std::runtime_error("removed key is still readable");
+				}
+				continue;
+			}
 			if (err < 0)
 				throw std::runtime_error("no data");
 
@@ -145,5 +537,7 @@ int main(int argc, char *argv[])
 				i, smack_total_num(sctl), diff, i * 1000000 / diff, diff / i);
 	}
 
-	return 0;
+	smack_cleanup(sctl);
+
+	return (i == num) ? 0 : -EINVAL;
 }
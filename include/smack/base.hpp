@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -21,17 +22,47 @@
 #include <boost/shared_array.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/align/aligned_allocator.hpp>
 
 #include <smack/smack.h>
 
 namespace ioremap {
 namespace smack {
 
+/*
+ * Compares zero-padded key IDs as big-endian 64-bit words, which gives the same order as byte comparison.
+ * Key which is a prefix of the other one goes first.
+ */
+static inline int key_id_cmp(const unsigned char *l, int lsize, const unsigned char *r, int rsize)
+{
+	for (int i = 0; i < SMACK_KEY_SIZE; i += sizeof(uint64_t)) {
+		uint64_t lw, rw;
+
+		memcpy(&lw, l + i, sizeof(uint64_t));
+		memcpy(&rw, r + i, sizeof(uint64_t));
+
+		if (lw != rw)
+			return be64toh(lw) < be64toh(rw) ? -1 : 1;
+	}
+
+	return lsize - rsize;
+}
+
+/* hex representation of the first @len bytes of the ID, every thread has a small ring of buffers */
+char *key_id_str(const unsigned char *id, int len);
+
+/* how names are turned into full-size keys, all keys of the storage have to use the same hash */
+enum key_hash {
+	key_hash_sha512 = 0,		/* SHA-512 digest of the name */
+	key_hash_fast,			/* non-cryptographic hash expanded to SMACK_KEY_SIZE bytes */
+};
+
 class key {
 	public:
 		key();
-		key(const std::string &name);
+		key(const std::string &name, enum key_hash hash = key_hash_sha512);
 		key(const key &k);
+		/* keys shorter than SMACK_KEY_SIZE keep their size */
 		key(const unsigned char *id, int size);
 		key(const struct index *);
 
@@ -46,21 +77,85 @@ class key {
 		key &operator =(const key &k);
 
 		const unsigned char *id() const;
+		int size() const;
 		const struct index *idx(void) const;
 
 		void set(const struct index *);
 
+		/* the same as key(name, hash) for every name, but SHA-512 digests of several names are computed at once */
+		static void hash_batch(const std::vector<std::string> &names, std::vector<key> &keys,
+				enum key_hash hash = key_hash_sha512);
+
 	private:
 		struct index idx_;
-		mutable char raw_str[2 * SMACK_KEY_SIZE + 1];
 
 		int cmp(const key &k) const;
 };
 
+/*
+ * Bare 64-byte key ID used by indexes and caches, record metadata is kept apart from it.
+ */
+class key_id {
+	public:
+		key_id() : m_size(SMACK_KEY_SIZE) {
+			memset(m_id, 0, sizeof(m_id));
+		}
+
+		/* @id is zero-padded up to SMACK_KEY_SIZE bytes */
+		key_id(const unsigned char *id, int size) : m_size(size) {
+			memcpy(m_id, id, sizeof(m_id));
+		}
+
+		key_id(const key &k) : m_size(k.size()) {
+			memcpy(m_id, k.id(), sizeof(m_id));
+		}
+
+		const unsigned char *id() const {
+			return (const unsigned char *)m_id;
+		}
+
+		int size() const {
+			return m_size;
+		}
+
+		char *str(int len = 16) const {
+			return key_id_str(id(), len);
+		}
+
+	private:
+		/* words keep the ID aligned for word comparison */
+		uint64_t m_id[SMACK_KEY_SIZE / sizeof(uint64_t)];
+		int m_size;
+};
+
+/* free operators, so full keys compare with key IDs too */
+static inline bool operator <(const key_id &l, const key_id &r) {
+	return key_id_cmp(l.id(), l.size(), r.id(), r.size()) < 0;
+}
+static inline bool operator >(const key_id &l, const key_id &r) {
+	return key_id_cmp(l.id(), l.size(), r.id(), r.size()) > 0;
+}
+static inline bool operator <=(const key_id &l, const key_id &r) {
+	return key_id_cmp(l.id(), l.size(), r.id(), r.size()) <= 0;
+}
+static inline bool operator >=(const key_id &l, const key_id &r) {
+	return key_id_cmp(l.id(), l.size(), r.id(), r.size()) >= 0;
+}
+static inline bool operator ==(const key_id &l, const key_id &r) {
+	return key_id_cmp(l.id(), l.size(), r.id(), r.size()) == 0;
+}
+static inline bool operator !=(const key_id &l, const key_id &r) {
+	return key_id_cmp(l.id(), l.size(), r.id(), r.size()) != 0;
+}
+
 struct keycomp {
 	bool operator() (const key& lhs, const key& rhs) const {
 		return lhs < rhs;
 	}
+
+	bool operator() (const key_id& lhs, const key_id& rhs) const {
+		return lhs < rhs;
+	}
 };
 
 enum smack_log_level {
@@ -106,23 +201,92 @@ class logger {
 
 typedef unsigned int (* bloom_hash_t)(const char *data, int size);
 
+/* blocked filter relies on blocks being cache lines */
+typedef std::vector<char, boost::alignment::aligned_allocator<char, 64> > bloom_data_t;
+
+/* one block of the blocked filter as eight 64-bit lanes processed together */
+typedef uint64_t bloom_line_t __attribute__ ((vector_size(64)));
+
 class bloom {
 	public:
-		bloom(const int bloom_size = 128);
-		bloom(const std::vector<char> &data);
+		/* blocked filter puts all probes of the key into one block of this size */
+		static const int block_size = 64;
+		/* blocked filter sets one bit in every 64-bit word of the block */
+		static const int blocked_probes = 8;
+		/* number of key bytes used by the blocked filter */
+		static const int key_tail = 16;
+
+		/*
+		 * @probes is the number of bits set per key, 0 - single additive hash of the old disk format.
+		 * Blocked filter always sets blocked_probes bits.
+		 */
+		bloom(const int bloom_size = 128, const int probes = 0, const bool blocked = false);
+		bloom(const std::vector<char> &data, const int probes = 0, const bool blocked = false);
 		virtual ~bloom();
 
+		/* drops all keys, blocked filter size is rounded up to the whole blocks */
+		void reset(const int bloom_size, const int probes, const bool blocked);
+
 		void add(const char *data, int size);
 		bool check(const char *data, int size);
 
-		const std::vector<char> &data() const;
+		/* bytes used by the blocked filter: the last bytes of full-size keys, hash of shorter ones */
+		static void tail(const char *data, int size, char *tail);
+		/* adds the key by its tail to the blocked filter */
+		void add_tail(const char *tail);
+
+		int probes() const;
+		bool blocked() const;
+
+		/* number of probes which gives the lowest false positive rate for the given filter size */
+		static int optimal_probes(double bits_per_key);
+
+		const bloom_data_t &data() const;
 		std::string str(void);
 
 	private:
 		std::vector<bloom_hash_t> m_hashes;
-		std::vector<char> m_data;
+		bloom_data_t m_data;
+		int m_probes;
+		bool m_blocked;
 
 		void add_hashes(void);
+
+		/* returns the block of the key tail and sets bits of its probes in @mask */
+		const char *blocked_probe(const char *tail, bloom_line_t &mask) const;
+
+	public:
+		/* 64-bit hash of all bytes */
+		static uint64_t hash(const char *data, int size);
+};
+
+/*
+ * Static xor filter with 8-bit fingerprints (about 10 bits per key, 0.4% false positives).
+ * It is built once over the whole key set and checked with three lookups.
+ */
+class xor_filter {
+	public:
+		/* filter without keys, check() always fails */
+		xor_filter();
+		xor_filter(uint64_t seed, const std::vector<uint8_t> &fingerprints);
+
+		/* 64-bit hash of the key which build() expects */
+		static uint64_t hash(const char *data, int size);
+
+		/* @keys are hashes of all keys, they are sorted and deduplicated; false if construction failed */
+		bool build(std::vector<uint64_t> &keys);
+
+		bool check(const char *data, int size) const;
+
+		uint64_t seed() const;
+		const std::vector<uint8_t> &fingerprints() const;
+
+	private:
+		uint64_t m_seed;
+		uint32_t m_block_length;
+		std::vector<uint8_t> m_fingerprints;
+
+		void positions(uint64_t h, uint32_t pos[3]) const;
 };
 
 } /* namespace smack */
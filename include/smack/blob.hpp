@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <stddef.h>
 #include <unistd.h>
 
 #include <set>
@@ -11,9 +12,15 @@
 
 #include <boost/version.hpp>
 
+#include <boost/atomic.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/ref.hpp>
+#include <boost/scoped_ptr.hpp>
 
+#include <boost/thread.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filtering_streambuf.hpp>
 
@@ -21,13 +28,23 @@
 #include <boost/iostreams/stream.hpp>
 
 #include <smack/base.hpp>
+#include <smack/codec.hpp>
+#include <smack/manifest.hpp>
+#include <smack/vlog.hpp>
 
 namespace ioremap { namespace smack {
 
-typedef std::map<key, std::string, keycomp> cache_t;
+/* write cache entry, key ID is the map key and the record size is the data size */
+struct cache_entry {
+	uint64_t		ts;
+	uint32_t		flags;
+	std::string		data;
+};
+
+typedef std::map<key_id, cache_entry, keycomp> cache_t;
 
 /* index offset within global index file, not within chunk */
-typedef std::map<key, size_t, keycomp> rcache_t;
+typedef std::map<key_id, size_t, keycomp> rcache_t;
 
 namespace bio = boost::iostreams;
 
@@ -38,7 +55,10 @@ namespace bio = boost::iostreams;
 #endif
 
 #define smack_time_diff(s, e) ((e.tv_sec - s.tv_sec) * 1000000 + (e.tv_usec - s.tv_usec))
-#define smack_rcache_mult	10000
+/* sparse index of the full chunk has an entry per smack_rcache_mult / sizeof(struct index) (about 46) records */
+#define smack_rcache_mult	3700
+/* chunk writer compresses this many first bytes of the chunk on their own to decide whether to compress it */
+#define smack_codec_sample_size	(16 * 1024)
 
 struct chunk_ctl {
 	unsigned char		start[SMACK_KEY_SIZE];	/* ID of the first key */
@@ -49,11 +69,117 @@ struct chunk_ctl {
 	uint64_t		uncompressed_data_size;		/* size of uncompressed data stored into this compressed chunk on disk */
 	int			num;			/* number of records in the chunk */
 	int			bloom_size;		/* bloom size in bytes */
+
+	/* version 2 */
+	uint64_t		run;			/* ID of the sorted run this chunk belongs to */
+	uint64_t		seq;			/* runs with larger sequence contain newer data */
+	int			level;			/* compaction level of the run */
+	int			flags;			/* SMACK_CHUNK_FLAGS_* */
+
+	/* version 3 */
+	int			rcache_num;		/* number of sparse index entries stored after the bloom filter */
+
+	/* version 4 */
+	int			bloom_probes;		/* bits set per key in the bloom filter, 0 - single additive hash */
+
+	/* version 5 */
+	int			start_size;		/* sizes of the first and the last keys */
+	int			end_size;
+
+	/* version 8 */
+	uint64_t		keys_size;		/* SMACK_CHUNK_FLAGS_SPLIT: size of the key section on disk */
+
+	/* version 9 */
+	int			codec;			/* SMACK_CODEC_* which compressed the chunk sections */
 } __attribute__ ((packed));
 
-#define SMACK_DISK_FORMAT_VERSION		1
+/* sparse index entry: key at the given offset of the uncompressed chunk data */
+struct chunk_rcache_entry {
+	unsigned char		id[SMACK_KEY_SIZE];
+	uint64_t		offset;
+
+	/* version 5 */
+	int			size;			/* key size */
+} __attribute__ ((packed));
+
+/*
+ * Record header of the chunk with SMACK_CHUNK_FLAGS_PREFIX, it replaces struct index.
+ * Key is stored as the number of bytes shared with the previous key of the chunk
+ * and the rest of its bytes, which follow the header.
+ */
+struct prefix_index {
+	uint8_t			shared;
+	uint8_t			suffix;
+	uint64_t		ts;
+	uint32_t		flags;
+	uint32_t		data_size;
+} __attribute__ ((packed));
+
+/* chunk is a part of compaction output which is not valid until run commit record is written */
+#define SMACK_CHUNK_FLAGS_PENDING		(1<<0)
+/* meta-only record: @run is replaced by run @seq, applied only when @seq is committed */
+#define SMACK_CHUNK_FLAGS_DROP			(1<<1)
+/* meta-only record: compaction output @run is complete */
+#define SMACK_CHUNK_FLAGS_COMMIT		(1<<2)
+/* meta-only record: value log file @run has @seq bytes of garbage */
+#define SMACK_CHUNK_FLAGS_VLOG_GARBAGE		(1<<3)
+/* bloom filter is made of cache line blocks, every key sets bits in one block only */
+#define SMACK_CHUNK_FLAGS_BLOOM_BLOCKED		(1<<4)
+/* records have prefix-compressed keys, see struct prefix_index */
+#define SMACK_CHUNK_FLAGS_PREFIX		(1<<5)
+/* records have varint headers, see record_writer */
+#define SMACK_CHUNK_FLAGS_VARINT		(1<<6)
+/* chunk data (the value section of the split chunk) is stored uncompressed, codec did not save enough on it */
+#define SMACK_CHUNK_FLAGS_RAW			(1<<7)
+/*
+ * record headers and keys are compressed into the key section, which is followed by the value section,
+ * so keys are listed without decompressing values
+ */
+#define SMACK_CHUNK_FLAGS_SPLIT			(1<<8)
+/* key section of the split chunk is stored uncompressed */
+#define SMACK_CHUNK_FLAGS_KEYS_RAW		(1<<9)
+
+/* chunk flags which describe the data layout and are kept when the chunk is copied */
+#define SMACK_CHUNK_FLAGS_LAYOUT		(SMACK_CHUNK_FLAGS_BLOOM_BLOCKED | SMACK_CHUNK_FLAGS_PREFIX | \
+						 SMACK_CHUNK_FLAGS_VARINT | SMACK_CHUNK_FLAGS_RAW | \
+						 SMACK_CHUNK_FLAGS_SPLIT | SMACK_CHUNK_FLAGS_KEYS_RAW)
+
+#define SMACK_DISK_FORMAT_VERSION		9
 #define SMACK_DISK_FORMAT_MAGIC			"SmAcK BaCkEnD"
 
+/* size of the chunk control structure stored by given disk format version */
+static inline size_t chunk_ctl_size(int version)
+{
+	if (version < 2)
+		return offsetof(struct chunk_ctl, run);
+	if (version < 3)
+		return offsetof(struct chunk_ctl, rcache_num);
+	if (version < 4)
+		return offsetof(struct chunk_ctl, bloom_probes);
+	if (version < 5)
+		return offsetof(struct chunk_ctl, start_size);
+	if (version < 8)
+		return offsetof(struct chunk_ctl, keys_size);
+	if (version < 9)
+		return offsetof(struct chunk_ctl, codec);
+
+	return sizeof(struct chunk_ctl);
+}
+
+static inline size_t chunk_rcache_entry_size(int version)
+{
+	if (version < 5)
+		return offsetof(struct chunk_rcache_entry, size);
+
+	return sizeof(struct chunk_rcache_entry);
+}
+
+/* keys of the old disk format do not store their size */
+static inline int chunk_key_size(int size)
+{
+	return size ? size : SMACK_KEY_SIZE;
+}
+
 struct chunk_header {
 	char			magic[16];
 	uint64_t		timestamp;
@@ -61,6 +187,30 @@ struct chunk_header {
 	int			pad[3];
 };
 
+#define SMACK_FILTER_MAGIC			"SmAcK FiLtEr"
+
+/* blob filter file: header followed by the xor filter fingerprints */
+struct filter_header {
+	char			magic[16];
+	uint64_t		seq;			/* all keys of the runs with sequence up to this one are in the filter */
+	uint64_t		seed;
+	uint64_t		size;			/* number of fingerprint bytes */
+} __attribute__ ((packed));
+
+#define SMACK_DICT_MAGIC			"SmAcK DiCt"
+
+/* blob dictionaries file: header followed by @num entries, every entry is followed by its dictionary data */
+struct dict_header {
+	char			magic[16];
+	uint32_t		current;		/* ID of the dictionary new chunks are compressed with, 0 - none */
+	uint32_t		num;
+} __attribute__ ((packed));
+
+struct dict_entry {
+	uint32_t		id;
+	uint32_t		size;
+} __attribute__ ((packed));
+
 class chunk : public bloom {
 	public:
 		chunk(int bloom_size = 128) : bloom(bloom_size)
@@ -70,15 +220,15 @@ class chunk : public bloom {
 		}	
 
 		chunk(struct chunk_ctl &ctl, std::vector<char> &data) :
-		bloom(data)
+		bloom(data, ctl.bloom_probes, ctl.flags & SMACK_CHUNK_FLAGS_BLOOM_BLOCKED)
 		{
 			memcpy(&m_ctl, &ctl, sizeof(struct chunk_ctl));
 			m_ctl.bloom_size = data.size();
-			m_start = key(ctl.start, sizeof(ctl.start));
-			m_end = key(ctl.end, sizeof(ctl.end));
+			m_start = key_id(ctl.start, chunk_key_size(ctl.start_size));
+			m_end = key_id(ctl.end, chunk_key_size(ctl.end_size));
 		}
 
-		chunk(const chunk &ch) : bloom(ch.data()) {
+		chunk(const chunk &ch) : bloom(ch) {
 			m_start = ch.m_start;
 			m_end = ch.m_end;
 			m_ctl = ch.m_ctl;
@@ -90,31 +240,54 @@ class chunk : public bloom {
 			return &m_ctl;
 		}
 
-		const key &start(void) const {
+		const struct chunk_ctl *ctl(void) const {
+			return &m_ctl;
+		}
+
+		const key_id &start(void) const {
 			return m_start;
 		}
 
-		const key &end(void) const {
+		const key_id &end(void) const {
 			return m_end;
 		}
 
 		void set_bounds(const struct index *start, const struct index *end) {
-			m_start.set(start);
-			m_end.set(end);
+			m_start = key_id(key(start));
+			m_end = key_id(key(end));
+
+			memcpy(m_ctl.start, m_start.id(), SMACK_KEY_SIZE);
+			memcpy(m_ctl.end, m_end.id(), SMACK_KEY_SIZE);
+			m_ctl.start_size = m_start.size();
+			m_ctl.end_size = m_end.size();
+		}
+
+		/* filter is rebuilt from scratch with the new size and layout */
+		void reset_bloom(int bloom_size, int probes, bool blocked) {
+			reset(bloom_size, probes, blocked);
 
-			memcpy(m_ctl.start, start->id, SMACK_KEY_SIZE);
-			memcpy(m_ctl.end, end->id, SMACK_KEY_SIZE);
+			m_ctl.bloom_size = data().size();
+			m_ctl.bloom_probes = this->probes();
+
+			m_ctl.flags &= ~SMACK_CHUNK_FLAGS_BLOOM_BLOCKED;
+			if (blocked)
+				m_ctl.flags |= SMACK_CHUNK_FLAGS_BLOOM_BLOCKED;
 		}
 
 		/* this must be (and it is) single-threaded operation */
-		void rcache_add(const key &key, size_t offset) {
+		void rcache_add(const key_id &key, size_t offset) {
 			std::pair<rcache_t::iterator, bool> p = m_rcache.insert(std::make_pair(key, offset));
 
 			if (!p.second)
 				p.first->second = offset;
 		}
 
-		bool rcache_find(const key &key, size_t &data_offset) {
+		/* keys sampled at regular record intervals */
+		const rcache_t &rcache(void) const {
+			return m_rcache;
+		}
+
+		bool rcache_find(const key_id &key, size_t &data_offset) {
 			if (m_rcache.size() == 0) {
 				if (key > m_end)
 					return false;
@@ -146,769 +319,3581 @@ class chunk : public bloom {
 
 	private:
 		struct chunk_ctl m_ctl;
-		key m_start, m_end;
+		key_id m_start, m_end;
 		rcache_t m_rcache;
 };
 
-class blob_store {
+/*
+ * Sorted run: set of non-overlapping chunks written by single flush or compaction.
+ * Runs with larger sequence number contain newer data.
+ */
+class sorted_run {
 	public:
-		blob_store(const std::string &path, int bloom_size) :
-		m_path_base(path),
-		m_bloom_size(bloom_size)
+		sorted_run(uint64_t id = 0, uint64_t seq = 0, int level = 0) :
+		m_id(id), m_seq(seq), m_level(level), m_num(0), m_size(0), m_disk_size(0)
 		{
-			log(SMACK_LOG_NOTICE, "blob-store: %s, bloom-size: %d\n", path.c_str(), bloom_size);
 		}
 
-		/* returns offset of the new chunk written */
-		template <class fout_t>
-		chunk store_chunk(fout_t &out_processor, cache_t &cache, size_t num, size_t max_cache_size) {
-			chunk ch(m_bloom_size);
+		uint64_t id() const {
+			return m_id;
+		}
 
-			size_t data_offset = 0;
-			bio::file_sink dst_data(m_path_base + ".data", std::ios::app);
+		uint64_t seq() const {
+			return m_seq;
+		}
 
-			ch.ctl()->data_offset = bio::seek<bio::file_sink>(dst_data, 0, std::ios_base::end);
+		int level() const {
+			return m_level;
+		}
 
-			const struct index *end_idx = cache.rbegin()->first.idx();
-			{
-				bio::filtering_streambuf<bio::output> out;
-				out.push(out_processor);
-				out.push(dst_data);
+		void add(const chunk &ch) {
+			m_chunks.insert(std::make_pair(ch.start(), ch));
 
-				size_t count = 0;
-				cache_t::iterator it;
-				int step = cache.size();
-				if (max_cache_size)
-					step = std::min<size_t>(cache.size(), num) / max_cache_size + 1;
+			m_num += ch.ctl()->num;
+			m_size += ch.ctl()->uncompressed_data_size;
+			m_disk_size += ch.ctl()->compressed_data_size;
+		}
 
-				int st = 0;
-				for (it = cache.begin(); it != cache.end(); ++it) {
-					struct index *idx = (struct index *)it->first.idx();
-					idx->data_size = it->second.size();
+		/* returns the only chunk which may contain given key or NULL */
+		chunk *find(const key_id &k) {
+			std::map<key_id, chunk, keycomp>::iterator it = m_chunks.upper_bound(k);
+			if (it == m_chunks.begin())
+				return NULL;
 
-					std::string tmp;
-					tmp.reserve(sizeof(struct index) + it->second.size());
-					tmp.assign((char *)idx, sizeof(struct index));
-					tmp += it->second;
+			--it;
+			if (k > it->second.end())
+				return NULL;
 
-					bio::write<bio::filtering_streambuf<bio::output> >(out, tmp.data(), tmp.size());
+			return &it->second;
+		}
 
-					ch.add((char *)idx->id, SMACK_KEY_SIZE);
+		std::map<key_id, chunk, keycomp> &chunks() {
+			return m_chunks;
+		}
 
-					if (++st == step) {
-						key k(idx);
-						ch.rcache_add(k, data_offset);
-						st = 0;
-					}
+		const std::map<key_id, chunk, keycomp> &chunks() const {
+			return m_chunks;
+		}
 
-					data_offset += it->second.size() + sizeof(struct index);
+		bool empty() const {
+			return m_chunks.empty();
+		}
 
-					log(SMACK_LOG_DEBUG, "%s: %s: stored %zd/%zd ts: %zu, data-size: %d\n",
-							m_path_base.c_str(), key(idx).str(), count, num, idx->ts, idx->data_size);
+		const key_id &start() const {
+			return m_chunks.begin()->second.start();
+		}
 
-					if (++count == num) {
-						end_idx = idx;
-						++it;
-						break;
-					}
-				}
-#if 1
-				/*
-				 * XXX XXX XXX XXX XXX
-				 *
-				 * This weird junk is needed because bzip2 somehow does not always flush buffers
-				 * back to disk, and the last record becomes corrupted (partially written).
-				 * 
-				 * This is strange, since if we put read_chunk() right at the end, it will always
-				 * correctly read all records, but with time something breaks.
-				 *
-				 * And I do not yet know why.
-				 *
-				 * zlib works perfectly good as well as large scale bzip2 tests on Ubuntu Lucid
-				 * (hundreds of millions of records)
-				 */
-				std::string tmp;
-				tmp.resize(128);
-				bio::write<bio::filtering_streambuf<bio::output> >(out, tmp.data(), tmp.size());
-#endif
+		/* number of records */
+		size_t num() const {
+			return m_num;
+		}
 
-				ch.set_bounds(cache.begin()->first.idx(), end_idx);
-				cache.erase(cache.begin(), it);
-				out.strict_sync();
+		/* uncompressed data size */
+		uint64_t size() const {
+			return m_size;
+		}
 
-				ch.ctl()->num = count;
-			}
+		uint64_t disk_size() const {
+			return m_disk_size;
+		}
 
-			/*
-			 * XXX
-			 * seek() can return -1
-			 *
-			 * It does not hurt system, but it is really weird, how boost::iostreams flush data to underlying sinks
-			 */
-			size_t data_size = bio::seek<bio::file_sink>(dst_data, 0, std::ios_base::end);
+	private:
+		uint64_t m_id, m_seq;
+		int m_level;
+		size_t m_num;
+		uint64_t m_size, m_disk_size;
+		std::map<key_id, chunk, keycomp> m_chunks;
+};
 
-			ch.ctl()->compressed_data_size = data_size - ch.ctl()->data_offset;
-			ch.ctl()->uncompressed_data_size = data_offset;
+/* newer runs go first */
+struct sorted_run_comp {
+	bool operator() (const sorted_run &lhs, const sorted_run &rhs) const {
+		if (lhs.seq() != rhs.seq())
+			return lhs.seq() > rhs.seq();
 
-			store_chunk_meta(ch);
+		return lhs.id() > rhs.id();
+	}
+};
+
+/* half-open key range [start, end), range without end includes all keys starting from @start */
+struct key_range {
+	key_range() : has_end(false) {}
+
+	bool contains(const key_id &k) const {
+		return (k >= start) && (!has_end || (k < end));
+	}
+
+	key_id start, end;
+	bool has_end;
+};
+
+/*
+ * Sequential stream of records ordered by key.
+ * Sources with higher rank contain newer data and win when the same key
+ * is present in several sources.
+ */
+class record_source {
+	public:
+		record_source(uint64_t rank) : m_rank(rank) {}
+		virtual ~record_source() {}
 
-			log(SMACK_LOG_NOTICE, "%s: store-chunk: start: %s, end: %s, num: %d, file-size: %zd, chunk-data-offset: %zd, "
-					"uncompressed-data-size: %zd, compressed-data-size: %zd, errno: %d\n",
-					m_path_base.c_str(), ch.start().str(), ch.end().str(), ch.ctl()->num,
-					data_size, ch.ctl()->data_offset,
-					ch.ctl()->uncompressed_data_size, ch.ctl()->compressed_data_size, errno);
+		/* moves to the next record, returns false when source is exhausted */
+		virtual bool next() = 0;
 
-			return ch;
+		virtual const key &current() const = 0;
+		virtual const std::string &data() const = 0;
+
+		uint64_t rank() const {
+			return m_rank;
 		}
 
-		template <class fin_t>
-		void read_chunk(fin_t &input_processor, chunk &ch, cache_t &cache) {
-			bio::file_source src_data(m_path_base + ".data");
-			bio::seek<bio::file_source>(src_data, ch.ctl()->data_offset, std::ios_base::beg);
+	private:
+		uint64_t m_rank;
+};
 
-			bio::filtering_streambuf<bio::input> in;
-			in.push(input_processor);
-			in.push(src_data);
+class cache_source : public record_source {
+	public:
+		cache_source(const cache_t &cache, uint64_t rank, const key_range &range = key_range()) : record_source(rank),
+		m_it(cache.lower_bound(range.start)),
+		m_end(range.has_end ? cache.lower_bound(range.end) : cache.end()),
+		m_started(false)
+		{
+		}
 
-			struct timeval start, end;
-			gettimeofday(&start, NULL);
+		virtual bool next() {
+			if (m_started && (m_it != m_end))
+				++m_it;
 
-			log(SMACK_LOG_NOTICE, "%s: read-chunk: start: %s, end: %s, num: %d, compressed-size: %zd, uncompressed-size: %zd\n",
-					m_path_base.c_str(), ch.start().str(), ch.end().str(),
-					ch.ctl()->num, ch.ctl()->compressed_data_size, ch.ctl()->uncompressed_data_size);
+			m_started = true;
+			if (m_it == m_end)
+				return false;
 
-			struct index idx;
+			m_key.set(cache_index(m_it).idx());
+			return true;
+		}
 
-			size_t offset = 0;
-			try {
-				for (int i = 0; i < ch.ctl()->num; ++i) {
-					bio::read<bio::filtering_streambuf<bio::input> >(in, (char *)&idx, sizeof(struct index));
-					std::string tmp;
-					tmp.resize(idx.data_size);
-					bio::read<bio::filtering_streambuf<bio::input> >(in, (char *)tmp.data(), idx.data_size);
+		virtual const key &current() const {
+			return m_key;
+		}
 
-					cache.insert(std::make_pair(key(&idx), tmp));
+		virtual const std::string &data() const {
+			return m_it->second.data;
+		}
 
-					offset += sizeof(struct index) + idx.data_size;
-				}
-			} catch (const bio::bzip2_error &e) {
-				log(SMACK_LOG_ERROR, "%s: %s: bzip error: %s: %d\n", m_path_base.c_str(), key(&idx).str(), e.what(), e.error());
-				throw;
-			}
-			gettimeofday(&end, NULL);
+		/* full record index of the cache entry */
+		static key cache_index(cache_t::const_iterator it) {
+			struct index idx;
 
-			long read_time = smack_time_diff(start, end);
+			memcpy(idx.id, it->first.id(), SMACK_KEY_SIZE);
+			idx.ts = it->second.ts;
+			idx.flags = it->second.flags;
+			idx.data_size = it->second.data.size();
 
-			log(SMACK_LOG_NOTICE, "%s: read-chunk: start: %s, end: %s, num: %d, read-time: %ld usecs\n",
-					m_path_base.c_str(), ch.start().str(), ch.end().str(), ch.ctl()->num, read_time);
+			return key(&idx);
 		}
 
-		template <class fin_t>
-		void read_index(fin_t &in, std::map<key, chunk, keycomp> &chunks, std::vector<chunk> &chunks_unsorted, size_t max_rcache_size) {
-			try {
-				read_chunks<fin_t>(in, chunks, chunks_unsorted, max_rcache_size);
-			} catch (const std::runtime_error &e) {
-				log(SMACK_LOG_ERROR, "%s: read chunks failed: %s\n", m_path_base.c_str(), e.what());
-				throw;
-			}
+	private:
+		cache_t::const_iterator m_it, m_end;
+		key m_key;
+		bool m_started;
+};
+
+/*
+ * K-way merge of sorted record sources.
+ * Only the current record of every source is kept in memory,
+ * duplicate keys are resolved in favour of the source with the highest rank.
+ */
+class record_merger {
+	public:
+		record_merger() : m_current(NULL), m_vlog(NULL) {}
+
+		/* values of records shadowed by newer copies are released in @vlog */
+		void set_vlog(value_log *vlog) {
+			m_vlog = vlog;
 		}
 
-		template <class fin_t>
-		bool chunk_read(fin_t &input_processor, key &read_key, chunk &ch, std::string &ret) {
-			struct timeval start, seek_time, decompress_time;
+		void add(boost::shared_ptr<record_source> src) {
+			m_sources.push_back(src);
 
-			gettimeofday(&start, NULL);
+			if (src->next()) {
+				m_heap.push_back(src.get());
+				std::push_heap(m_heap.begin(), m_heap.end(), source_comp());
+			}
+		}
 
-			if (!ch.check((char *)read_key.id(), SMACK_KEY_SIZE)) {
-				log(SMACK_LOG_DEBUG, "%s: %s: chunk start: %s, end: %s: bloom-check failed\n",
-						m_path_base.c_str(), read_key.str(), ch.start().str(), ch.end().str());
-				return false;
+		bool next() {
+			if (m_current) {
+				advance(m_current);
+				m_current = NULL;
 			}
 
-			size_t data_offset;
-			bool found = ch.rcache_find(read_key, data_offset);
-			if (!found) {
-				log(SMACK_LOG_DEBUG, "%s: %s: chunk start: %s, end: %s: rcache lookup failed\n",
-						m_path_base.c_str(), read_key.str(), ch.start().str(), ch.end().str());
+			if (m_heap.empty())
 				return false;
-			}
 
-			log(SMACK_LOG_NOTICE, "%s: %s: start: %s, end: %s, rcache returned offset: %zd, "
-					"compressed-size: %zd, uncompressed-size: %zd\n",
-					m_path_base.c_str(), read_key.str(), ch.start().str(), ch.end().str(), data_offset,
-					ch.ctl()->compressed_data_size, ch.ctl()->uncompressed_data_size);
+			std::pop_heap(m_heap.begin(), m_heap.end(), source_comp());
+			m_current = m_heap.back();
+			m_heap.pop_back();
 
-			bio::file_source src_data(m_path_base + ".data");
+			/* drop older copies of the same key */
+			while (!m_heap.empty() && (m_heap.front()->current() == m_current->current())) {
+				std::pop_heap(m_heap.begin(), m_heap.end(), source_comp());
+				record_source *src = m_heap.back();
+				m_heap.pop_back();
 
-			/* seeking to the start of the chunk */
-			size_t pos = bio::seek<bio::file_source>(src_data, ch.ctl()->data_offset, std::ios_base::beg);
-			if (pos != ch.ctl()->data_offset) {
-				std::ostringstream str;
-				str << m_path_base << ": " << read_key.str() << ": read: could not seek to: " <<
-					ch.ctl()->data_offset << ", seeked to: " << pos;
-				throw std::out_of_range(str.str());
+				if (m_vlog)
+					m_vlog->release(src->current().idx(), src->data());
+
+				advance(src);
 			}
 
-			gettimeofday(&seek_time, NULL);
+			return true;
+		}
 
-			bio::filtering_streambuf<bio::input> in;
-			in.push(input_processor);
-			in.push(src_data);
-			in.set_auto_close(false);
+		const key &current() const {
+			return m_current->current();
+		}
 
-			struct index idx;
+		const std::string &data() const {
+			return m_current->data();
+		}
 
-			ret.clear();
+	private:
+		struct source_comp {
+			/* heap keeps the smallest key (and the newest source among equal keys) on top */
+			bool operator() (const record_source *lhs, const record_source *rhs) const {
+				if (lhs->current() == rhs->current())
+					return lhs->rank() < rhs->rank();
 
-			size_t offset = 0;
-			while (offset <= data_offset) {
-				bio::read<bio::filtering_streambuf<bio::input> >(in, (char *)&idx, sizeof(struct index));
+				return lhs->current() > rhs->current();
+			}
+		};
 
-				std::string tmp;
-				tmp.resize(idx.data_size);
-				bio::read<bio::filtering_streambuf<bio::input> >(in, (char *)tmp.data(), idx.data_size);
+		std::vector<boost::shared_ptr<record_source> > m_sources;
+		std::vector<record_source *> m_heap;
+		record_source *m_current;
+		value_log *m_vlog;
 
-				key tmp_key(&idx);
-				if (read_key < tmp_key)
-					return false;
+		void advance(record_source *src) {
+			if (src->next()) {
+				m_heap.push_back(src);
+				std::push_heap(m_heap.begin(), m_heap.end(), source_comp());
+			}
+		}
+};
 
-				if (read_key == tmp_key) {
-					ret.swap(tmp);
-					break;
-				}
+/* record header fields which differ from the previous record */
+#define SMACK_RECORD_HAS_TS			(1<<0)
+#define SMACK_RECORD_HAS_FLAGS			(1<<1)
+
+/*
+ * Encodes records of the chunk with SMACK_CHUNK_FLAGS_VARINT:
+ *
+ * byte: SMACK_RECORD_HAS_* fields which follow
+ * varint: key bytes shared with the previous key, varint: number of the key suffix bytes
+ * zigzag varint: timestamp difference with the previous record, if present
+ * varint: flags, if they differ from the previous record
+ * varint: data size
+ * key suffix, data
+ *
+ * The first record of the chunk is compared with the zero timestamp and flags.
+ * Data of the split chunk is stored in its value section instead, in the same order.
+ */
+class record_writer {
+	public:
+		record_writer() {
+			memset(&m_prev, 0, sizeof(struct index));
+			m_prev_size = 0;
+		}
 
-				offset += sizeof(struct index) + idx.data_size;
+		/* appends the header and the key suffix of @idx to @out, data is appended by the caller */
+		void write(const struct index &idx, int key_size, std::string &out) {
+			int shared = 0;
+			while ((shared < key_size) && (shared < m_prev_size) && (idx.id[shared] == m_prev.id[shared]))
+				shared++;
+
+			int fields = 0;
+			if (idx.ts != m_prev.ts)
+				fields |= SMACK_RECORD_HAS_TS;
+			if (idx.flags != m_prev.flags)
+				fields |= SMACK_RECORD_HAS_FLAGS;
+
+			out.push_back((char)fields);
+			varint_put(out, shared);
+			varint_put(out, key_size - shared);
+
+			if (fields & SMACK_RECORD_HAS_TS) {
+				int64_t diff = idx.ts - m_prev.ts;
+				varint_put(out, ((uint64_t)diff << 1) ^ (uint64_t)(diff >> 63));
 			}
+			if (fields & SMACK_RECORD_HAS_FLAGS)
+				varint_put(out, idx.flags);
 
-			gettimeofday(&decompress_time, NULL);
+			varint_put(out, idx.data_size);
+			out.append((char *)idx.id + shared, key_size - shared);
 
-			long seek_diff = smack_time_diff(start, seek_time);
-			long decompress_diff = smack_time_diff(seek_time, decompress_time);
+			m_prev = idx;
+			m_prev_size = key_size;
+		}
 
-			log(SMACK_LOG_NOTICE, "%s: %s: chunk start: %s, end: %s: chunk-read: data-offset: %zd, chunk-start-offset: %zd, "
-					"num: %d, seek-time: %ld, decompress-time: %ld usecs, return-size: %zd\n",
-					m_path_base.c_str(), read_key.str(), ch.start().str(), ch.end().str(),
-					data_offset, ch.ctl()->data_offset, ch.ctl()->num,
-					seek_diff, decompress_diff, ret.size());
+	private:
+		struct index m_prev;
+		int m_prev_size;
 
-			return ret.size() > 0;
+		static void varint_put(std::string &out, uint64_t v) {
+			while (v >= 0x80) {
+				out.push_back((char)(v | 0x80));
+				v >>= 7;
+			}
+			out.push_back((char)v);
 		}
+};
 
-		void forget() {
-			forget_path(m_path_base + ".data");
-			forget_path(m_path_base + ".chunk");
-		}
+/* uncompressed chunk data or its section, which is either streamed or already in memory */
+class record_input {
+	public:
+		record_input() : m_in(NULL), m_data(NULL), m_size(0), m_offset(0) {}
 
-		void truncate() {
-			forget();
+		record_input(bio::filtering_streambuf<bio::input> &in) : m_in(&in), m_data(NULL), m_size(0), m_offset(0) {}
 
-			boost::filesystem::remove(m_path_base + ".data");
-			boost::filesystem::remove(m_path_base + ".chunk");
-		}
+		record_input(const char *data, size_t size) : m_in(NULL), m_data(data), m_size(size), m_offset(0) {}
 
-		/* returns data size on disk and number of elements */
-		void size(size_t &data_size) {
-			data_size = 0;
-			try {
-				data_size = boost::filesystem::file_size(m_path_base + ".data");
-			} catch (...) {
+		/* all read() and skip() return false on short read */
+		bool read(char *data, size_t size) {
+			if (!size)
+				return true;
+
+			if (m_data) {
+				if (size > m_size - m_offset)
+					return false;
+
+				memcpy(data, m_data + m_offset, size);
+				m_offset += size;
+				return true;
 			}
-		}
 
-	private:
-		std::string m_path_base;
-		int m_bloom_size;
+			return bio::read<bio::filtering_streambuf<bio::input> >(*m_in, data, size) == (std::streamsize)size;
+		}
 
-		void forget_path(const std::string &path) {
-			int fd;
+		bool read(std::string &data, size_t size) {
+			if (m_data) {
+				if (size > m_size - m_offset)
+					return false;
 
-			fd = open(path.c_str(), O_RDONLY);
-			if (fd >= 0) {
-				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
-				close(fd);
+				data.assign(m_data + m_offset, size);
+				m_offset += size;
+				return true;
 			}
+
+			data.resize(size);
+			return read((char *)data.data(), size);
 		}
 
-		void store_chunk_meta(chunk &ch) {
-			bio::file_sink chunk(m_path_base + ".chunk", std::ios::app);
-			size_t data_size = bio::seek<bio::file_sink>(chunk, 0, std::ios::end);
-			if (!data_size) {
-				struct chunk_header h;
-				memset(&h, 0, sizeof(struct chunk_header));
+		bool skip(size_t size) {
+			if (m_data) {
+				if (size > m_size - m_offset)
+					return false;
 
-				snprintf(h.magic, sizeof(h.magic), SMACK_DISK_FORMAT_MAGIC);
-				h.version = SMACK_DISK_FORMAT_VERSION;
-				h.timestamp = time(NULL);
+				m_offset += size;
+				return true;
+			}
+
+			char tmp[4096];
+			while (size) {
+				size_t sz = std::min(size, sizeof(tmp));
+				if (!read(tmp, sz))
+					return false;
 
-				bio::write<bio::file_sink>(chunk, (char *)&h, sizeof(struct chunk_header));
+				size -= sz;
 			}
 
-			bio::write<bio::file_sink>(chunk, (char *)ch.ctl(), sizeof(struct chunk_ctl));
-			bio::write<bio::file_sink>(chunk, ch.data().data(), ch.data().size());
+			return true;
 		}
 
-		template <class fin_t>
-		void read_chunks(fin_t &input_processor,
-				 std::map<key, chunk, keycomp> &chunks,
-				 std::vector<chunk> &chunks_unsorted,
-				 size_t max_rcache_size) {
-			size_t offset = 0;
-			bio::file_source ch_src(m_path_base + ".chunk");
-			size_t chunk_size = bio::seek<bio::file_source>(ch_src, 0, std::ios::end);
-			bio::seek<bio::file_source>(ch_src, 0, std::ios::beg);
+	private:
+		bio::filtering_streambuf<bio::input> *m_in;
+		const char *m_data;
+		size_t m_size, m_offset;
+};
 
-			check_chunk_header(ch_src);
+/*
+ * Decodes records of the uncompressed chunk data.
+ * Records of the chunk with SMACK_CHUNK_FLAGS_SPLIT take their values from the separate section.
+ */
+class record_reader {
+	public:
+		record_reader(bio::filtering_streambuf<bio::input> &in, int chunk_flags) :
+		m_keys(in),
+		m_split(false),
+		m_values_wanted(true)
+		{
+			init(chunk_flags);
+		}
 
-			while (offset < chunk_size) {
-				struct chunk_ctl ctl;
+		record_reader(const char *data, size_t size, int chunk_flags) :
+		m_keys(data, size),
+		m_split(false),
+		m_values_wanted(true)
+		{
+			init(chunk_flags);
+		}
+
+		/* values are not read if @values is NULL, data of every record is empty then */
+		record_reader(const char *keys, size_t keys_size, const char *values, size_t values_size, int chunk_flags) :
+		m_keys(keys, keys_size),
+		m_values(values, values_size),
+		m_split(true),
+		m_values_wanted(values != NULL)
+		{
+			init(chunk_flags);
+		}
 
-				bio::read<bio::file_source>(ch_src, (char *)&ctl, sizeof(struct chunk_ctl));
+		/* only record indexes are needed, data is skipped instead of being copied */
+		void skip_values() {
+			m_values_wanted = false;
+		}
 
-				std::vector<char> data(ctl.bloom_size);
-				bio::read<bio::file_source>(ch_src, data.data(), data.size());
+		/* returns false on short read */
+		bool next(std::string &data) {
+			if (m_varint) {
+				m_size = 0;
 
-				chunk ch(ctl, data);
+				unsigned char fields;
+				uint64_t shared, suffix, data_size;
+				if (!m_keys.read((char *)&fields, 1) || !read_varint(shared) || !read_varint(suffix))
+					return false;
 
-				int step = ctl.num;
-				if (max_rcache_size)
-					step = ctl.num / max_rcache_size + 1;
+				if (shared + suffix > SMACK_KEY_SIZE)
+					throw std::runtime_error("chunk record: invalid key size: " +
+							boost::lexical_cast<std::string>(shared + suffix));
 
-				bio::file_source src_data(m_path_base + ".data");
+				if (fields & SMACK_RECORD_HAS_TS) {
+					uint64_t zz;
+					if (!read_varint(zz))
+						return false;
 
-				/* seeking to the start of the chunk */
-				size_t pos = bio::seek<bio::file_source>(src_data, ctl.data_offset, std::ios_base::beg);
-				if (pos != ch.ctl()->data_offset) {
-					std::ostringstream str;
-					str << m_path_base << ": read_chunks: could not seek to: " <<
-						ctl.data_offset << ", seeked to: " << pos;
-					throw std::out_of_range(str.str());
+					m_idx.ts += (zz >> 1) ^ -(zz & 1);
 				}
 
-				bio::filtering_streambuf<bio::input> in;
-				in.push(input_processor);
-				in.push(src_data);
-				in.set_auto_close(false);
+				if (fields & SMACK_RECORD_HAS_FLAGS) {
+					uint64_t flags;
+					if (!read_varint(flags))
+						return false;
 
-				struct index idx;
+					m_idx.flags = flags;
+				}
 
-				if (step < ctl.num) {
-					int st = 0;
-					size_t off = 0;
-					for (int i = 0; i < ch.ctl()->num; ++i) {
-						bio::read<bio::filtering_streambuf<bio::input> >(in, (char *)&idx, sizeof(struct index));
+				if (!read_varint(data_size))
+					return false;
+				m_idx.data_size = data_size;
 
-						log(SMACK_LOG_DEBUG, "%s: %s: ts: %zd, data-size: %d, flags: %x\n",
-								m_path_base.c_str(), key(&idx).str(), idx.ts, idx.data_size, idx.flags);
+				memset(m_idx.id + shared, 0, SMACK_KEY_SIZE - shared);
+				if (!m_keys.read((char *)m_idx.id + shared, suffix))
+					return false;
 
-						std::string tmp;
-						tmp.resize(idx.data_size);
-						bio::read<bio::filtering_streambuf<bio::input> >(in, (char *)tmp.data(), idx.data_size);
+				m_size += 1 + suffix;
+			} else if (m_prefix) {
+				struct prefix_index h;
+				if (!m_keys.read((char *)&h, sizeof(struct prefix_index)))
+					return false;
+
+				if (h.shared + h.suffix > SMACK_KEY_SIZE)
+					throw std::runtime_error("chunk record: invalid key size: " +
+							boost::lexical_cast<std::string>(h.shared + h.suffix));
+
+				/* the rest of the previous key is replaced by this key suffix */
+				memset(m_idx.id + h.shared, 0, SMACK_KEY_SIZE - h.shared);
+				if (!m_keys.read((char *)m_idx.id + h.shared, h.suffix))
+					return false;
+
+				m_idx.ts = h.ts;
+				m_idx.flags = h.flags;
+				m_idx.data_size = h.data_size;
+				m_size = sizeof(struct prefix_index) + h.suffix;
+			} else {
+				if (!m_keys.read((char *)&m_idx, sizeof(struct index)))
+					return false;
+
+				m_size = sizeof(struct index);
+			}
+
+			if (m_values_wanted) {
+				if (!(m_split ? m_values : m_keys).read(data, m_idx.data_size))
+					return false;
+			} else {
+				data.clear();
+				if (!m_split && !m_keys.skip(m_idx.data_size))
+					return false;
+			}
+
+			m_size += m_idx.data_size;
+			return true;
+		}
+
+		const struct index *idx() const {
+			return &m_idx;
+		}
+
+		/* size of the last record in the uncompressed data, the same for split and interleaved layouts */
+		size_t size() const {
+			return m_size;
+		}
+
+	private:
+		record_input m_keys, m_values;
+		bool m_split, m_values_wanted;
+		bool m_prefix, m_varint;
+		struct index m_idx;
+		size_t m_size;
+
+		void init(int chunk_flags) {
+			m_prefix = chunk_flags & SMACK_CHUNK_FLAGS_PREFIX;
+			m_varint = chunk_flags & SMACK_CHUNK_FLAGS_VARINT;
+			m_size = 0;
+
+			memset(&m_idx, 0, sizeof(struct index));
+		}
+
+		/* counts varint bytes into the record size */
+		bool read_varint(uint64_t &v) {
+			v = 0;
+
+			for (int shift = 0; shift < 64; shift += 7) {
+				unsigned char b;
+				if (!m_keys.read((char *)&b, 1))
+					return false;
+
+				m_size++;
+				v |= (uint64_t)(b & 0x7f) << shift;
+				if (!(b & 0x80))
+					return true;
+			}
+
+			throw std::runtime_error("chunk record: invalid varint");
+		}
+};
+
+/* chunk data loaded into memory, buffers are pooled like codec filters */
+struct chunk_buffers {
+	std::string		compressed;
+	std::string		keys;			/* key section of the split chunk */
+	std::string		data;			/* the whole chunk data or the value section of the split chunk */
+};
+
+/* chunk was compressed by the blob codec @fin_t, chunks of other codecs are decoded through codec_decoders() */
+template <class fin_t>
+static inline bool chunk_native(chunk &ch)
+{
+	return !ch.ctl()->codec || (ch.ctl()->codec == codec_traits<fin_t>::id);
+}
+
+/*
+ * Raw chunks and chunks of codecs with the block interface are decoded in memory instead of being streamed,
+ * so are split chunks, which have to be read section by section, and chunks of other codecs.
+ */
+template <class fin_t>
+static inline bool chunk_in_memory(chunk &ch)
+{
+	return (ch.ctl()->flags & (SMACK_CHUNK_FLAGS_RAW | SMACK_CHUNK_FLAGS_SPLIT)) || codec_block((const fin_t *)NULL) ||
+		!chunk_native<fin_t>(ch);
+}
+
+/* decompresses @size bytes of @data with codec @T into @out, codecs which can stop early may stop after @want bytes */
+template <class T>
+static inline void codec_decode(const codec_params &codec, const char *data, size_t size, size_t want, std::string &out)
+{
+	boost::shared_ptr<T> filter = codec_pool<T>::get(codec);
+	if (codec_block((const T *)NULL)) {
+		codec_decompress_partial(*filter, data, size, want, out);
+		return;
+	}
+
+	/* chain is destroyed before its filter goes back to the pool */
+	bio::filtering_streambuf<bio::input> in;
+	in.push(boost::ref(*filter));
+	in.push(bio::array_source(data, size));
+
+	out.clear();
+	char tmp[16384];
+	while (out.size() < want) {
+		std::streamsize sz = bio::read<bio::filtering_streambuf<bio::input> >(in, tmp, sizeof(tmp));
+		if (sz <= 0)
+			break;
+
+		out.append(tmp, sz);
+	}
+}
+
+/* makes chunks compressed by the decompressor @T readable by blobs of every codec */
+template <class T>
+struct codec_registrar {
+	codec_registrar() {
+		codec_decoders()[codec_traits<T>::id] = codec_decode<T>;
+	}
+};
+
+/*
+ * Reads @size bytes of the chunk section from @src and decompresses them into @out.
+ * Codecs which can stop early may only decompress its first @want bytes.
+ * Sections of the chunk written by another codec (@codec_id) are decoded by it.
+ */
+template <class fin_t>
+static inline void chunk_section_load(bio::file_source &src, size_t size, bool raw, int codec_id, const codec_params &codec,
+		chunk_buffers &buf, std::string &out, size_t want)
+{
+	std::string &dst = raw ? out : buf.compressed;
+
+	dst.resize(size);
+	if (dst.size() && (bio::read<bio::file_source>(src, (char *)dst.data(), dst.size()) != (std::streamsize)dst.size()))
+		throw std::runtime_error("chunk: short read");
+
+	if (raw)
+		return;
+
+	if (!codec_id || (codec_id == codec_traits<fin_t>::id)) {
+		codec_decode<fin_t>(codec, buf.compressed.data(), buf.compressed.size(), want, out);
+		return;
+	}
+
+	codec_decoder decode = ((codec_id > 0) && (codec_id < SMACK_CODEC_NUM)) ? codec_decoders()[codec_id] : NULL;
+	if (!decode) {
+		std::ostringstream str;
+		str << "chunk: unsupported codec: " << codec_id;
+		throw std::runtime_error(str.str());
+	}
+
+	decode(codec, buf.compressed.data(), buf.compressed.size(), want, out);
+}
+
+/* reads the value section of the split chunk from @src positioned right after its key section */
+template <class fin_t>
+static inline void chunk_load_values(bio::file_source &src, chunk &ch, const codec_params &codec, chunk_buffers &buf,
+		size_t want = ~(size_t)0)
+{
+	chunk_section_load<fin_t>(src, ch.ctl()->compressed_data_size - ch.ctl()->keys_size,
+			ch.ctl()->flags & SMACK_CHUNK_FLAGS_RAW, ch.ctl()->codec, codec, buf, buf.data, want);
+}
+
+/*
+ * Reads chunk data from @src positioned at its start and decompresses it into @buf.data,
+ * codecs which can stop early may only decompress its first @want bytes.
+ * Split chunk has its key section decompressed into @buf.keys, values are only read if @values is set.
+ */
+template <class fin_t>
+static inline void chunk_load(bio::file_source &src, chunk &ch, const codec_params &codec, chunk_buffers &buf,
+		size_t want = ~(size_t)0, bool values = true)
+{
+	int flags = ch.ctl()->flags;
+
+	if (!(flags & SMACK_CHUNK_FLAGS_SPLIT)) {
+		chunk_section_load<fin_t>(src, ch.ctl()->compressed_data_size, flags & SMACK_CHUNK_FLAGS_RAW,
+				ch.ctl()->codec, codec, buf, buf.data, want);
+		return;
+	}
+
+	/* sections are shorter than the same part of the interleaved data, so @want bounds both of them */
+	chunk_section_load<fin_t>(src, ch.ctl()->keys_size, flags & SMACK_CHUNK_FLAGS_KEYS_RAW, ch.ctl()->codec,
+			codec, buf, buf.keys, want);
+
+	buf.data.clear();
+	if (values)
+		chunk_load_values<fin_t>(src, ch, codec, buf, want);
+}
+
+/*
+ * Streams records of the single chunk from disk.
+ * With @keys_only data of every record is empty, values of the split chunk are not even decompressed.
+ */
+template <class fin_t>
+class chunk_source : public record_source {
+	public:
+		chunk_source(const std::string &path, const codec_params &codec, chunk &ch, uint64_t rank, bool keys_only = false) :
+		record_source(rank),
+		m_path(path),
+		m_src(path),
+		m_num(ch.ctl()->num),
+		m_pos(0)
+		{
+			size_t pos = bio::seek<bio::file_source>(m_src, ch.ctl()->data_offset, std::ios_base::beg);
+			if (pos != ch.ctl()->data_offset) {
+				std::ostringstream str;
+				str << m_path << ": chunk-source: could not seek to: " <<
+					ch.ctl()->data_offset << ", seeked to: " << pos;
+				throw std::out_of_range(str.str());
+			}
+
+			if (ch.ctl()->flags & SMACK_CHUNK_FLAGS_SPLIT) {
+				m_buf = codec_pool<chunk_buffers>::get(codec);
+				chunk_load<fin_t>(m_src, ch, codec, *m_buf, ~(size_t)0, !keys_only);
+
+				m_reader.reset(new record_reader(m_buf->keys.data(), m_buf->keys.size(),
+							keys_only ? NULL : m_buf->data.data(), m_buf->data.size(), ch.ctl()->flags));
+				return;
+			}
+
+			if (chunk_in_memory<fin_t>(ch)) {
+				m_buf = codec_pool<chunk_buffers>::get(codec);
+				chunk_load<fin_t>(m_src, ch, codec, *m_buf);
+
+				m_reader.reset(new record_reader(m_buf->data.data(), m_buf->data.size(), ch.ctl()->flags));
+			} else {
+				m_filter = codec_pool<fin_t>::get(codec);
+				m_in.push(boost::ref(*m_filter));
+				m_in.push(m_src);
+
+				m_reader.reset(new record_reader(m_in, ch.ctl()->flags));
+			}
+
+			if (keys_only)
+				m_reader->skip_values();
+		}
+
+		virtual bool next() {
+			if (m_pos == m_num)
+				return false;
+
+			if (!m_reader->next(m_data)) {
+				std::ostringstream str;
+				str << m_path << ": chunk-source: record: " << m_pos << "/" << m_num << ": short read";
+				throw std::runtime_error(str.str());
+			}
+
+			m_key.set(m_reader->idx());
+			m_pos++;
+			return true;
+		}
+
+		virtual const key &current() const {
+			return m_key;
+		}
+
+		virtual const std::string &data() const {
+			return m_data;
+		}
+
+	private:
+		std::string m_path;
+		bio::file_source m_src;
+		/* chain is destroyed before its filter goes back to the pool */
+		boost::shared_ptr<fin_t> m_filter;
+		boost::shared_ptr<chunk_buffers> m_buf;
+		bio::filtering_streambuf<bio::input> m_in;
+		boost::scoped_ptr<record_reader> m_reader;
+		int m_num, m_pos;
+		key m_key;
+		std::string m_data;
+};
+
+/* streams records of the run within given key range, only one chunk is open at a time */
+template <class fin_t>
+class run_source : public record_source {
+	public:
+		run_source(const std::string &path, const codec_params &codec, sorted_run &r, uint64_t rank,
+				const key_range &range = key_range()) :
+		record_source(rank),
+		m_path(path),
+		m_codec(codec),
+		m_run(r),
+		m_range(range),
+		m_it(r.chunks().upper_bound(range.start))
+		{
+			/* the chunk which starts before the range may still contain its first keys */
+			if (m_it != r.chunks().begin())
+				--m_it;
+		}
+
+		virtual bool next() {
+			while (true) {
+				if (m_src && m_src->next()) {
+					if (m_src->current() < m_range.start)
+						continue;
+
+					if (m_range.has_end && (m_src->current() >= m_range.end)) {
+						m_src.reset();
+						m_it = m_run.chunks().end();
+						return false;
+					}
+
+					return true;
+				}
+
+				m_src.reset();
+				if ((m_it == m_run.chunks().end()) || (m_range.has_end && (m_it->first >= m_range.end)))
+					return false;
+
+				m_src.reset(new chunk_source<fin_t>(m_path, m_codec, m_it->second, rank()));
+				++m_it;
+			}
+		}
+
+		virtual const key &current() const {
+			return m_src->current();
+		}
+
+		virtual const std::string &data() const {
+			return m_src->data();
+		}
+
+	private:
+		std::string m_path;
+		codec_params m_codec;
+		sorted_run &m_run;
+		key_range m_range;
+		std::map<key_id, chunk, keycomp>::iterator m_it;
+		boost::shared_ptr<chunk_source<fin_t> > m_src;
+};
+
+class blob_store {
+	public:
+		/*
+		 * Chunk filters get @bloom_bits_per_key bits per record, or @bloom_size bytes if it is 0.
+		 * Level and minimal gain of @codec are used for new chunks, dictionaries are read from disk.
+		 */
+		blob_store(const std::string &path, int bloom_size, int bloom_bits_per_key = 0,
+				const codec_params &codec = codec_params()) :
+		m_path_base(path),
+		m_bloom_size(bloom_size),
+		m_bloom_bits_per_key(bloom_bits_per_key),
+		m_version(SMACK_DISK_FORMAT_VERSION),
+		m_max_run(0)
+		{
+			m_codec.level = codec.level;
+			m_codec.min_gain = codec.min_gain;
+
+			log(SMACK_LOG_NOTICE, "blob-store: %s, bloom-size: %d, bloom-bits-per-key: %d, codec-level: %d, "
+					"codec-min-gain: %d\n",
+					path.c_str(), bloom_size, bloom_bits_per_key, codec.level, codec.min_gain);
+		}
+
+		/*
+		 * Compresses sorted records of the new chunk in memory, finish() appends it to the data file.
+		 * Only finish() has to be serialized with other appends to the same store.
+		 *
+		 * The first smack_codec_sample_size bytes are compressed on their own, if the codec does not save
+		 * the configured part of them, the whole chunk is stored raw without running the codec.
+		 * Codecs with the block interface compress the whole chunk at once, others are streamed.
+		 *
+		 * Chunks are split: record headers and keys are kept in memory and compressed into the key section
+		 * in finish(), values go through the codec as described above and follow it as the value section.
+		 */
+		template <class fout_t>
+		class chunk_writer {
+			public:
+				chunk_writer(blob_store &st, const sorted_run &r, int flags, size_t num, size_t max_rcache_size) :
+				m_st(st),
+				m_ch(0),
+				m_codec(st.codec()),
+				m_checked(false),
+				m_raw(false),
+				m_num(0),
+				m_st_num(0),
+				m_data_offset(0)
+				{
+					m_step = num;
+					if (max_rcache_size)
+						m_step = num / max_rcache_size + 1;
+
+					m_ch.ctl()->run = r.id();
+					m_ch.ctl()->seq = r.seq();
+					m_ch.ctl()->level = r.level();
+					m_ch.ctl()->flags = flags | SMACK_CHUNK_FLAGS_VARINT | SMACK_CHUNK_FLAGS_SPLIT;
+
+					m_tails.reserve(num * bloom::key_tail);
+				}
+
+				void write(const key &k, const std::string &data) {
+					struct index idx = *k.idx();
+					idx.data_size = data.size();
+					int size = k.size();
+
+					size_t header_size = m_keys.size();
+					m_records.write(idx, size, m_keys);
+					header_size = m_keys.size() - header_size;
+
+					append(data);
+
+					char tail[bloom::key_tail];
+					bloom::tail((char *)idx.id, size, tail);
+					m_tails.append(tail, bloom::key_tail);
+
+					if (m_num == 0)
+						m_first = idx;
+					m_last = idx;
+
+					if (++m_st_num == m_step) {
+						m_ch.rcache_add(k, m_data_offset);
+						m_st_num = 0;
+					}
+
+					/* offsets are the same as if headers were interleaved with values */
+					m_data_offset += header_size + data.size();
+					m_num++;
+
+					log(SMACK_LOG_DEBUG, "%s: %s: stored %zd ts: %zu, data-size: %d\n",
+							m_st.m_path_base.c_str(), k.str(), m_num, idx.ts, idx.data_size);
+				}
+
+				size_t num() const {
+					return m_num;
+				}
+
+				chunk finish() {
+					/* there is nothing to compress if all records are tombstones */
+					if (!m_raw && !m_out && m_plain.empty())
+						m_raw = true;
+
+					if (!m_raw && !m_out) {
+						if (block()) {
+							m_filter = codec_pool<fout_t>::get(m_codec);
+							codec_compress(*m_filter, m_plain.data(), m_plain.size(), m_compressed);
+							m_filter.reset();
+						} else {
+							start_compression();
+							finish_compression();
+						}
+
+						/* chunk smaller than the sample is compressed once and the result is checked instead */
+						if (!m_checked && !gains(m_compressed.size(), m_plain.size())) {
+							m_compressed.swap(m_plain);
+							m_raw = true;
+						}
+					} else if (m_out) {
+						finish_compression();
+					}
+
+					if (m_raw)
+						m_ch.ctl()->flags |= SMACK_CHUNK_FLAGS_RAW;
+
+					/* readers of another codec decode the chunk with this one */
+					m_ch.ctl()->codec = codec_traits<fout_t>::id;
+
+					/* keys are often hashes, which do not compress */
+					std::string keys;
+					compress(m_keys.data(), m_keys.size(), keys);
+					if (!gains(keys.size(), m_keys.size())) {
+						keys.swap(m_keys);
+						m_ch.ctl()->flags |= SMACK_CHUNK_FLAGS_KEYS_RAW;
+					}
+
+					std::string path = m_st.m_path_base + ".data";
+					bio::file_sink dst(path, std::ios::app);
+					m_ch.ctl()->data_offset = bio::seek<bio::file_sink>(dst, 0, std::ios_base::end);
+					bool ok = (bio::write<bio::file_sink>(dst, keys.data(), keys.size()) == (std::streamsize)keys.size()) &&
+						(bio::write<bio::file_sink>(dst, m_compressed.data(), m_compressed.size()) ==
+						 (std::streamsize)m_compressed.size()) &&
+						dst.flush();
+					dst.close();
+
+					/* chunk is not stored, so the data file is cut back to make the next chunk start at its end */
+					if (!ok) {
+						boost::system::error_code ec;
+						boost::filesystem::resize_file(path, m_ch.ctl()->data_offset, ec);
+
+						std::ostringstream str;
+						str << path << ": store-chunk: short write: offset: " << m_ch.ctl()->data_offset <<
+							", size: " << keys.size() + m_compressed.size();
+						throw std::runtime_error(str.str());
+					}
+
+					size_t data_size = m_ch.ctl()->data_offset + keys.size() + m_compressed.size();
+
+					/* filter is sized by the actual number of records */
+					int bloom_size = m_st.m_bloom_size;
+					if (m_st.m_bloom_bits_per_key)
+						bloom_size = (m_num * m_st.m_bloom_bits_per_key + 7) / 8;
+					bloom_size = std::max(bloom_size, 1);
+
+					m_ch.reset_bloom(bloom_size, bloom::blocked_probes, true);
+					for (size_t i = 0; i < m_tails.size(); i += bloom::key_tail)
+						m_ch.add_tail(m_tails.data() + i);
+
+					m_ch.set_bounds(&m_first, &m_last);
+					m_ch.ctl()->num = m_num;
+					m_ch.ctl()->keys_size = keys.size();
+					m_ch.ctl()->compressed_data_size = keys.size() + m_compressed.size();
+					m_ch.ctl()->uncompressed_data_size = m_data_offset;
+
+					m_st.store_chunk_meta(m_ch);
+
+					log(SMACK_LOG_NOTICE, "%s: store-chunk: start: %s, end: %s, num: %d, file-size: %zd, chunk-data-offset: %zd, "
+							"uncompressed-data-size: %zd, compressed-data-size: %zd, keys-size: %zd, flags: %x\n",
+							m_st.m_path_base.c_str(), m_ch.start().str(), m_ch.end().str(), m_ch.ctl()->num,
+							data_size, m_ch.ctl()->data_offset,
+							m_ch.ctl()->uncompressed_data_size, m_ch.ctl()->compressed_data_size,
+							m_ch.ctl()->keys_size, m_ch.ctl()->flags);
+
+					return m_ch;
+				}
+
+			private:
+				blob_store &m_st;
+				chunk m_ch;
+				codec_params m_codec;
+				/* uncompressed bytes which are not passed to the codec yet */
+				std::string m_plain;
+				bool m_checked, m_raw;
+				/* the only key bytes used by the blocked bloom filter */
+				std::string m_tails;
+				record_writer m_records;
+				std::string m_keys;
+				std::string m_compressed;
+				boost::shared_ptr<fout_t> m_filter;
+				boost::shared_ptr<bio::filtering_streambuf<bio::output> > m_out;
+				size_t m_num, m_step, m_st_num;
+				size_t m_data_offset;
+				struct index m_first, m_last;
+
+				void append(const std::string &s) {
+					if (m_raw) {
+						m_compressed.append(s);
+					} else if (m_out) {
+						bio::write<bio::filtering_streambuf<bio::output> >(*m_out, s.data(), s.size());
+					} else {
+						m_plain.append(s);
+						if (!m_checked && (m_plain.size() >= smack_codec_sample_size))
+							check_sample();
+					}
+				}
+
+				static bool block() {
+					return codec_block((const fout_t *)NULL);
+				}
+
+				bool gains(size_t compressed, size_t raw) const {
+					return (m_codec.min_gain < 0) || (compressed * 100 <= raw * (100 - std::min(m_codec.min_gain, 100)));
+				}
+
+				/* the rest of the chunk is expected to compress about as well as its first bytes */
+				void check_sample() {
+					m_checked = true;
+
+					if ((m_codec.min_gain >= 0) && !gains(sample_size(), smack_codec_sample_size)) {
+						m_raw = true;
+						m_compressed.swap(m_plain);
+						return;
+					}
+
+					/* block codec gets the whole chunk in finish() */
+					if (!block()) {
+						start_compression();
+						std::string().swap(m_plain);
+					}
+				}
+
+				/* compressed size of the sample, nothing is compressed into the chunk yet */
+				size_t sample_size() {
+					std::string tmp;
+					compress(m_plain.data(), smack_codec_sample_size, tmp);
+					return tmp.size();
+				}
+
+				/* appends @size bytes of @data compressed on their own to @out */
+				void compress(const char *data, size_t size, std::string &out) {
+					boost::shared_ptr<fout_t> filter = codec_pool<fout_t>::get(m_codec);
+
+					if (block()) {
+						codec_compress(*filter, data, size, out);
+						return;
+					}
+
+					/* closing the chain flushes compressor tail */
+					bio::filtering_streambuf<bio::output> s;
+					s.push(boost::ref(*filter));
+					s.push(bio::back_inserter(out));
+
+					bio::write<bio::filtering_streambuf<bio::output> >(s, data, size);
+					s.strict_sync();
+				}
+
+				void start_compression() {
+					m_filter = codec_pool<fout_t>::get(m_codec);
+
+					m_out.reset(new bio::filtering_streambuf<bio::output>());
+					m_out->push(boost::ref(*m_filter));
+					m_out->push(bio::back_inserter(m_compressed));
+
+					bio::write<bio::filtering_streambuf<bio::output> >(*m_out, m_plain.data(), m_plain.size());
+				}
+
+				void finish_compression() {
+#if 1
+					/*
+					 * XXX XXX XXX XXX XXX
+					 *
+					 * This weird junk is needed because bzip2 somehow does not always flush buffers
+					 * back to disk, and the last record becomes corrupted (partially written).
+					 * 
+					 * This is strange, since if we put read_chunk() right at the end, it will always
+					 * correctly read all records, but with time something breaks.
+					 *
+					 * And I do not yet know why.
+					 *
+					 * zlib works perfectly good as well as large scale bzip2 tests on Ubuntu Lucid
+					 * (hundreds of millions of records)
+					 */
+					std::string tmp;
+					tmp.resize(128);
+					bio::write<bio::filtering_streambuf<bio::output> >(*m_out, tmp.data(), tmp.size());
+#endif
+					m_out->strict_sync();
+
+					/* closing filter chain flushes compressor tail */
+					m_out.reset();
+					m_filter.reset();
+				}
+		};
+
+		template <class fin_t>
+		void read_chunk(chunk &ch, cache_t &cache) {
+			struct timeval start, end;
+			gettimeofday(&start, NULL);
+
+			log(SMACK_LOG_NOTICE, "%s: read-chunk: start: %s, end: %s, num: %d, compressed-size: %zd, uncompressed-size: %zd\n",
+					m_path_base.c_str(), ch.start().str(), ch.end().str(),
+					ch.ctl()->num, ch.ctl()->compressed_data_size, ch.ctl()->uncompressed_data_size);
+
+			chunk_source<fin_t> src(m_path_base + ".data", codec(), ch, 0);
+			try {
+				while (src.next()) {
+					cache_entry e;
+					e.ts = src.current().idx()->ts;
+					e.flags = src.current().idx()->flags;
+					e.data = src.data();
+
+					cache.insert(std::make_pair(key_id(src.current()), e));
+				}
+			} catch (const bio::bzip2_error &e) {
+				log(SMACK_LOG_ERROR, "%s: %s: bzip error: %s: %d\n", m_path_base.c_str(), src.current().str(), e.what(), e.error());
+				throw;
+			}
+			gettimeofday(&end, NULL);
+
+			long read_time = smack_time_diff(start, end);
+
+			log(SMACK_LOG_NOTICE, "%s: read-chunk: start: %s, end: %s, num: %d, read-time: %ld usecs\n",
+					m_path_base.c_str(), ch.start().str(), ch.end().str(), ch.ctl()->num, read_time);
+		}
+
+		/* record indexes of the chunk, values of the split chunk are not decompressed */
+		template <class fin_t>
+		void read_chunk_keys(chunk &ch, std::vector<key> &keys) {
+			chunk_source<fin_t> src(m_path_base + ".data", codec(), ch, 0, true);
+
+			keys.reserve(keys.size() + ch.ctl()->num);
+			while (src.next())
+				keys.push_back(src.current());
+		}
+
+		template <class fin_t>
+		boost::shared_ptr<record_source> open_run(sorted_run &r, uint64_t rank, const key_range &range = key_range()) {
+			return boost::shared_ptr<record_source>(new run_source<fin_t>(m_path_base + ".data", codec(), r, rank, range));
+		}
+
+		/*
+		 * Returns committed runs sorted from the newest to the oldest.
+		 * With @meta_only chunks only have their bounds and counters, filters and sparse indexes are skipped.
+		 */
+		template <class fin_t>
+		void read_index(std::vector<sorted_run> &runs, size_t max_rcache_size, bool meta_only = false) {
+			try {
+				read_chunks<fin_t>(runs, max_rcache_size, meta_only);
+			} catch (const std::runtime_error &e) {
+				log(SMACK_LOG_ERROR, "%s: read chunks failed: %s\n", m_path_base.c_str(), e.what());
+				throw;
+			}
+		}
+
+		template <class fin_t>
+		bool chunk_read(key &read_key, chunk &ch, std::string &ret) {
+			struct timeval start, seek_time, decompress_time;
+
+			gettimeofday(&start, NULL);
+
+			if (!ch.check((char *)read_key.id(), read_key.size())) {
+				log(SMACK_LOG_DEBUG, "%s: %s: chunk start: %s, end: %s: bloom-check failed\n",
+						m_path_base.c_str(), read_key.str(), ch.start().str(), ch.end().str());
+				return false;
+			}
+
+			size_t data_offset;
+			bool found = ch.rcache_find(read_key, data_offset);
+			if (!found) {
+				log(SMACK_LOG_DEBUG, "%s: %s: chunk start: %s, end: %s: rcache lookup failed\n",
+						m_path_base.c_str(), read_key.str(), ch.start().str(), ch.end().str());
+				return false;
+			}
+
+			log(SMACK_LOG_NOTICE, "%s: %s: start: %s, end: %s, rcache returned offset: %zd, "
+					"compressed-size: %zd, uncompressed-size: %zd\n",
+					m_path_base.c_str(), read_key.str(), ch.start().str(), ch.end().str(), data_offset,
+					ch.ctl()->compressed_data_size, ch.ctl()->uncompressed_data_size);
+
+			bio::file_source src_data(m_path_base + ".data");
+
+			/* seeking to the start of the chunk */
+			size_t pos = bio::seek<bio::file_source>(src_data, ch.ctl()->data_offset, std::ios_base::beg);
+			if (pos != ch.ctl()->data_offset) {
+				std::ostringstream str;
+				str << m_path_base << ": " << read_key.str() << ": read: could not seek to: " <<
+					ch.ctl()->data_offset << ", seeked to: " << pos;
+				throw std::out_of_range(str.str());
+			}
+
+			gettimeofday(&seek_time, NULL);
+
+			/* chain is declared after the filter, so it is destroyed before the filter goes back to the pool */
+			boost::shared_ptr<fin_t> input;
+			boost::shared_ptr<chunk_buffers> buf;
+			bio::filtering_streambuf<bio::input> in;
+			boost::scoped_ptr<record_reader> reader;
+
+			codec_params c = codec();
+			bool split = ch.ctl()->flags & SMACK_CHUNK_FLAGS_SPLIT;
+
+			if (chunk_in_memory<fin_t>(ch)) {
+				/* records past the rcache offset have larger keys, so the rest of the chunk is not decompressed */
+				buf = codec_pool<chunk_buffers>::get(c);
+				chunk_load<fin_t>(src_data, ch, c, *buf, data_offset, !split);
+
+				/* values of the split chunk are decompressed only up to the found one */
+				if (split)
+					reader.reset(new record_reader(buf->keys.data(), buf->keys.size(), NULL, 0, ch.ctl()->flags));
+				else
+					reader.reset(new record_reader(buf->data.data(), buf->data.size(), ch.ctl()->flags));
+			} else {
+				input = codec_pool<fin_t>::get(c);
+				in.push(boost::ref(*input));
+				in.push(src_data);
+				in.set_auto_close(false);
+
+				reader.reset(new record_reader(in, ch.ctl()->flags));
+			}
+
+			record_reader &rd = *reader;
+
+			ret.clear();
+
+			found = false;
+			size_t offset = 0, value_offset = 0;
+			while (offset < data_offset) {
+				std::string tmp;
+				if (!rd.next(tmp))
+					break;
+
+				key tmp_key(rd.idx());
+				if (read_key < tmp_key)
+					return false;
+
+				/* found record (including tombstone) updates key's index: timestamp, flags and data size */
+				if (read_key == tmp_key) {
+					read_key.set(rd.idx());
+					ret.swap(tmp);
+					found = true;
+					break;
+				}
+
+				offset += rd.size();
+				value_offset += rd.idx()->data_size;
+			}
+
+			if (found && split && rd.idx()->data_size) {
+				size_t size = rd.idx()->data_size;
+
+				chunk_load_values<fin_t>(src_data, ch, c, *buf, value_offset + size);
+				if (value_offset + size > buf->data.size())
+					throw std::runtime_error(m_path_base + ": " + read_key.str() + ": read: short value section");
+
+				ret.assign(buf->data.data() + value_offset, size);
+			}
+
+			gettimeofday(&decompress_time, NULL);
+
+			long seek_diff = smack_time_diff(start, seek_time);
+			long decompress_diff = smack_time_diff(seek_time, decompress_time);
+
+			log(SMACK_LOG_NOTICE, "%s: %s: chunk start: %s, end: %s: chunk-read: data-offset: %zd, chunk-start-offset: %zd, "
+					"num: %d, seek-time: %ld, decompress-time: %ld usecs, return-size: %zd\n",
+					m_path_base.c_str(), read_key.str(), ch.start().str(), ch.end().str(),
+					data_offset, ch.ctl()->data_offset, ch.ctl()->num,
+					seek_diff, decompress_diff, ret.size());
+
+			return found;
+		}
+
+		void forget() {
+			forget_path(m_path_base + ".data");
+			forget_path(m_path_base + ".chunk");
+		}
+
+		void truncate() {
+			forget();
+
+			boost::filesystem::remove(m_path_base + ".data");
+			boost::filesystem::remove(m_path_base + ".chunk");
+			remove_filter();
+			set_dicts(boost::shared_ptr<codec_dict>(), codec_dicts_t());
+		}
+
+		/* replaces the blob filter file, it is synced since a stale filter would hide existing keys */
+		void store_filter(const xor_filter &f, uint64_t seq) {
+			std::string path = m_path_base + ".filter";
+			std::string tmp = path + ".tmp";
+
+			struct filter_header h;
+			memset(&h, 0, sizeof(struct filter_header));
+
+			snprintf(h.magic, sizeof(h.magic), SMACK_FILTER_MAGIC);
+			h.seq = seq;
+			h.seed = f.seed();
+			h.size = f.fingerprints().size();
+
+			bio::file_sink out(tmp);
+			bio::write<bio::file_sink>(out, (char *)&h, sizeof(struct filter_header));
+			bio::write<bio::file_sink>(out, (char *)f.fingerprints().data(), f.fingerprints().size());
+			out.close();
+
+			sync_path(tmp);
+			boost::filesystem::rename(tmp, path);
+		}
+
+		/* returns false if there is no valid filter file */
+		bool read_filter(boost::shared_ptr<xor_filter> &f, uint64_t &seq) {
+			std::string path = m_path_base + ".filter";
+			if (!boost::filesystem::exists(path))
+				return false;
+
+			bio::file_source in(path);
+
+			struct filter_header h;
+			if ((bio::read<bio::file_source>(in, (char *)&h, sizeof(struct filter_header)) != sizeof(struct filter_header)) ||
+					strncmp(h.magic, SMACK_FILTER_MAGIC, sizeof(h.magic))) {
+				log(SMACK_LOG_ERROR, "%s: filter: invalid header\n", path.c_str());
+				return false;
+			}
+
+			std::vector<uint8_t> fingerprints(h.size);
+			if (h.size && (bio::read<bio::file_source>(in, (char *)fingerprints.data(), h.size) != (std::streamsize)h.size)) {
+				log(SMACK_LOG_ERROR, "%s: filter: short read: size: %llu\n", path.c_str(), (unsigned long long)h.size);
+				return false;
+			}
+
+			f.reset(new xor_filter(h.seed, fingerprints));
+			seq = h.seq;
+			return true;
+		}
+
+		void remove_filter() {
+			boost::filesystem::remove(m_path_base + ".filter");
+		}
+
+		/* codec settings and dictionaries to compress and decompress chunks of this store */
+		codec_params codec() {
+			boost::mutex::scoped_lock guard(m_codec_lock);
+			return m_codec;
+		}
+
+		/* new chunks are compressed with @dict, older ones keep using their dictionaries */
+		void add_dict(boost::shared_ptr<codec_dict> dict) {
+			codec_dicts_t dicts;
+			{
+				boost::mutex::scoped_lock guard(m_codec_lock);
+				if (m_codec.dicts)
+					dicts = *m_codec.dicts;
+			}
+
+			dicts[dict->id] = dict;
+			set_dicts(dict, dicts);
+		}
+
+		/*
+		 * Adds dictionaries of @src chunks which are copied into this store,
+		 * with @current chunks of this store are compressed with the same dictionary as in @src.
+		 */
+		void import_dicts(blob_store &src, bool current) {
+			codec_params sc = src.codec();
+			codec_params c = codec();
+
+			codec_dicts_t dicts;
+			if (c.dicts)
+				dicts = *c.dicts;
+
+			bool changed = current && (sc.dict != c.dict);
+			if (sc.dicts) {
+				for (codec_dicts_t::const_iterator it = sc.dicts->begin(); it != sc.dicts->end(); ++it)
+					changed |= dicts.insert(*it).second;
+			}
+
+			if (changed)
+				set_dicts(current ? sc.dict : c.dict, dicts);
+		}
+
+		/* returns false if there is no valid dictionaries file */
+		bool read_dicts() {
+			std::string path = m_path_base + ".dict";
+			if (!boost::filesystem::exists(path))
+				return false;
+
+			bio::file_source in(path);
+
+			struct dict_header h;
+			if ((bio::read<bio::file_source>(in, (char *)&h, sizeof(struct dict_header)) != sizeof(struct dict_header)) ||
+					strncmp(h.magic, SMACK_DICT_MAGIC, sizeof(h.magic))) {
+				log(SMACK_LOG_ERROR, "%s: dict: invalid header\n", path.c_str());
+				return false;
+			}
+
+			boost::shared_ptr<codec_dicts_t> dicts(new codec_dicts_t);
+			boost::shared_ptr<codec_dict> current;
+
+			for (uint32_t i = 0; i < h.num; ++i) {
+				struct dict_entry e;
+				boost::shared_ptr<codec_dict> d(new codec_dict);
+
+				if (bio::read<bio::file_source>(in, (char *)&e, sizeof(struct dict_entry)) == sizeof(struct dict_entry)) {
+					d->id = e.id;
+					d->data.resize(e.size);
+				}
+
+				if (!d->id || (e.size && (bio::read<bio::file_source>(in, (char *)d->data.data(), e.size) !=
+								(std::streamsize)e.size))) {
+					log(SMACK_LOG_ERROR, "%s: dict: short read: entry: %u/%u\n", path.c_str(), i, h.num);
+					return false;
+				}
+
+				(*dicts)[d->id] = d;
+				if (d->id == h.current)
+					current = d;
+			}
+
+			boost::mutex::scoped_lock guard(m_codec_lock);
+			m_codec.dict = current;
+			m_codec.dicts = dicts;
+
+			log(SMACK_LOG_INFO, "%s: dict: dictionaries: %zd, current: %u\n", path.c_str(), dicts->size(), h.current);
+			return true;
+		}
+
+		/* flushes data and index to disk before the manifest makes this file active */
+		void sync() {
+			sync_path(m_path_base + ".data");
+			sync_path(m_path_base + ".chunk");
+		}
+
+		bool exists() const {
+			return boost::filesystem::exists(m_path_base + ".chunk");
+		}
+
+		/* appends meta-only record which changes set of runs stored in this file */
+		void store_run_marker(int flags, uint64_t run, uint64_t seq) {
+			chunk ch(0);
+
+			ch.ctl()->run = run;
+			ch.ctl()->seq = seq;
+			ch.ctl()->flags = flags;
+
+			store_chunk_meta(ch);
+		}
+
+		/* copies compressed chunk data from another store without recompression, the copy belongs to run @r */
+		chunk copy_chunk(blob_store &src, const chunk &ch, const sorted_run &r) {
+			/* the copy may be compressed with any dictionary of @src */
+			import_dicts(src, false);
+
+			chunk ret(ch);
+			ret.ctl()->run = r.id();
+			ret.ctl()->seq = r.seq();
+			ret.ctl()->level = r.level();
+
+			bio::file_source in(src.m_path_base + ".data");
+			size_t pos = bio::seek<bio::file_source>(in, ch.ctl()->data_offset, std::ios_base::beg);
+			if (pos != ch.ctl()->data_offset) {
+				std::ostringstream str;
+				str << src.m_path_base << ": copy-chunk: could not seek to: " <<
+					ch.ctl()->data_offset << ", seeked to: " << pos;
+				throw std::out_of_range(str.str());
+			}
+
+			bio::file_sink out(m_path_base + ".data", std::ios::app);
+			ret.ctl()->data_offset = bio::seek<bio::file_sink>(out, 0, std::ios_base::end);
+			ret.ctl()->flags &= SMACK_CHUNK_FLAGS_LAYOUT;
+
+			std::vector<char> buf(1024 * 1024);
+			uint64_t size = ch.ctl()->compressed_data_size;
+			while (size) {
+				std::streamsize sz = std::min<uint64_t>(size, buf.size());
+
+				if (bio::read<bio::file_source>(in, buf.data(), sz) != sz) {
+					std::ostringstream str;
+					str << src.m_path_base << ": copy-chunk: short read at: " <<
+						ch.ctl()->data_offset + ch.ctl()->compressed_data_size - size;
+					throw std::runtime_error(str.str());
+				}
+
+				bio::write<bio::file_sink>(out, buf.data(), sz);
+				size -= sz;
+			}
+			out.close();
+
+			store_chunk_meta(ret);
+			return ret;
+		}
+
+		/* stores meta of the chunk as a pending part of run @r, data stays where it is */
+		chunk move_chunk(const chunk &ch, const sorted_run &r) {
+			chunk ret(ch);
+			ret.ctl()->run = r.id();
+			ret.ctl()->seq = r.seq();
+			ret.ctl()->level = r.level();
+			ret.ctl()->flags = (ret.ctl()->flags & SMACK_CHUNK_FLAGS_LAYOUT) | SMACK_CHUNK_FLAGS_PENDING;
+
+			store_chunk_meta(ret);
+			return ret;
+		}
+
+		/* disk format version of the loaded index */
+		int version() const {
+			return m_version;
+		}
+
+		/* the largest run ID or sequence number found in the loaded index */
+		uint64_t max_run() const {
+			return m_max_run;
+		}
+
+		/* value log garbage counters found in the loaded index */
+		const std::map<uint64_t, uint64_t> &vlog_garbage() const {
+			return m_vlog_garbage;
+		}
+
+		/* returns data size on disk and number of elements */
+		void size(size_t &data_size) {
+			data_size = 0;
+			try {
+				data_size = boost::filesystem::file_size(m_path_base + ".data");
+			} catch (...) {
+			}
+		}
+
+	private:
+		std::string m_path_base;
+		int m_bloom_size;
+		int m_bloom_bits_per_key;
+		int m_version;
+		uint64_t m_max_run;
+		std::map<uint64_t, uint64_t> m_vlog_garbage;
+
+		boost::mutex m_codec_lock;
+		codec_params m_codec;
+
+		/*
+		 * Replaces dictionaries file and then the in-memory set.
+		 * It is synced since chunks which are written after it can not be decompressed without it.
+		 */
+		void set_dicts(boost::shared_ptr<codec_dict> current, const codec_dicts_t &dicts) {
+			std::string path = m_path_base + ".dict";
+
+			if (dicts.empty()) {
+				boost::filesystem::remove(path);
+			} else {
+				std::string tmp = path + ".tmp";
+
+				struct dict_header h;
+				memset(&h, 0, sizeof(struct dict_header));
+
+				snprintf(h.magic, sizeof(h.magic), SMACK_DICT_MAGIC);
+				h.current = current ? current->id : 0;
+				h.num = dicts.size();
+
+				bio::file_sink out(tmp);
+				bio::write<bio::file_sink>(out, (char *)&h, sizeof(struct dict_header));
+
+				for (codec_dicts_t::const_iterator it = dicts.begin(); it != dicts.end(); ++it) {
+					struct dict_entry e;
+					e.id = it->first;
+					e.size = it->second->data.size();
+
+					bio::write<bio::file_sink>(out, (char *)&e, sizeof(struct dict_entry));
+					bio::write<bio::file_sink>(out, it->second->data.data(), e.size);
+				}
+				out.close();
+
+				sync_path(tmp);
+				boost::filesystem::rename(tmp, path);
+			}
+
+			boost::mutex::scoped_lock guard(m_codec_lock);
+			m_codec.dict = current;
+			m_codec.dicts.reset(new codec_dicts_t(dicts));
+		}
+
+		void forget_path(const std::string &path) {
+			int fd;
+
+			fd = open(path.c_str(), O_RDONLY);
+			if (fd >= 0) {
+				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+				close(fd);
+			}
+		}
+
+		void sync_path(const std::string &path) {
+			int fd;
+
+			fd = open(path.c_str(), O_RDONLY);
+			if (fd >= 0) {
+				fsync(fd);
+				close(fd);
+			}
+		}
+
+		void store_chunk_meta(chunk &ch) {
+			std::string path = m_path_base + ".chunk";
+			bio::file_sink chunk(path, std::ios::app);
+			size_t data_size = bio::seek<bio::file_sink>(chunk, 0, std::ios::end);
+			bool ok = true;
+			if (!data_size) {
+				struct chunk_header h;
+				memset(&h, 0, sizeof(struct chunk_header));
+
+				snprintf(h.magic, sizeof(h.magic), SMACK_DISK_FORMAT_MAGIC);
+				h.version = SMACK_DISK_FORMAT_VERSION;
+				h.timestamp = time(NULL);
+
+				ok = bio::write<bio::file_sink>(chunk, (char *)&h, sizeof(struct chunk_header)) == sizeof(struct chunk_header);
+				m_version = SMACK_DISK_FORMAT_VERSION;
+			}
+
+			/* old format files are only read and fully rewritten by the blob, never appended */
+			if (m_version != SMACK_DISK_FORMAT_VERSION) {
+				log(SMACK_LOG_ERROR, "%s: can not append chunk to disk format version %d\n", m_path_base.c_str(), m_version);
+				throw std::runtime_error("smack disk format version mismatch on append");
+			}
+
+			ch.ctl()->rcache_num = ch.rcache().size();
+
+			std::vector<struct chunk_rcache_entry> rcache(ch.rcache().size());
+			size_t pos = 0;
+			for (rcache_t::const_iterator it = ch.rcache().begin(); it != ch.rcache().end(); ++it, ++pos) {
+				memcpy(rcache[pos].id, it->first.id(), SMACK_KEY_SIZE);
+				rcache[pos].offset = it->second;
+				rcache[pos].size = it->first.size();
+			}
+
+			std::streamsize rcache_size = rcache.size() * sizeof(struct chunk_rcache_entry);
+			ok = ok && (bio::write<bio::file_sink>(chunk, (char *)ch.ctl(), sizeof(struct chunk_ctl)) == sizeof(struct chunk_ctl)) &&
+				(bio::write<bio::file_sink>(chunk, ch.data().data(), ch.data().size()) == (std::streamsize)ch.data().size()) &&
+				(bio::write<bio::file_sink>(chunk, (char *)rcache.data(), rcache_size) == rcache_size) &&
+				chunk.flush();
+			chunk.close();
+
+			/* torn chunk meta would hide every chunk appended after it */
+			if (!ok) {
+				boost::system::error_code ec;
+				boost::filesystem::resize_file(path, data_size, ec);
+
+				std::ostringstream str;
+				str << path << ": store-chunk-meta: short write: offset: " << data_size;
+				throw std::runtime_error(str.str());
+			}
+		}
+
+		template <class fin_t>
+		void read_chunks(std::vector<sorted_run> &ret, size_t max_rcache_size, bool meta_only) {
+			bio::file_source ch_src(m_path_base + ".chunk");
+			size_t chunk_size = bio::seek<bio::file_source>(ch_src, 0, std::ios::end);
+			bio::seek<bio::file_source>(ch_src, 0, std::ios::beg);
+
+			check_chunk_header(ch_src);
+
+			size_t offset = sizeof(struct chunk_header);
+			size_t ctl_size = chunk_ctl_size(m_version);
+			size_t rcache_entry_size = chunk_rcache_entry_size(m_version);
+
+			m_vlog_garbage.clear();
+			read_dicts();
+
+			std::map<uint64_t, sorted_run> runs;
+			std::set<uint64_t> committed, pending;
+			std::vector<std::pair<uint64_t, uint64_t> > drops;
+			uint64_t chunk_num = 0;
+
+			while (offset + ctl_size <= chunk_size) {
+				struct chunk_ctl ctl;
+				memset(&ctl, 0, sizeof(struct chunk_ctl));
+
+				bio::read<bio::file_source>(ch_src, (char *)&ctl, ctl_size);
+				offset += ctl_size + ctl.bloom_size + ctl.rcache_num * rcache_entry_size;
+				chunk_num++;
+
+				/* the latest counter wins */
+				if (ctl.flags & SMACK_CHUNK_FLAGS_VLOG_GARBAGE) {
+					m_vlog_garbage[ctl.run] = ctl.seq;
+					continue;
+				}
+
+				/* old format does not have runs, every chunk is a separate run ordered by its position */
+				if (m_version < 2) {
+					ctl.run = chunk_num;
+					ctl.seq = chunk_num;
+				}
+
+				/* run IDs referenced by markers must never be reused */
+				m_max_run = std::max<uint64_t>(m_max_run, std::max<uint64_t>(ctl.run, ctl.seq));
+
+				if (ctl.flags & SMACK_CHUNK_FLAGS_DROP) {
+					drops.push_back(std::make_pair((uint64_t)ctl.run, (uint64_t)ctl.seq));
+					continue;
+				}
+
+				if (ctl.flags & SMACK_CHUNK_FLAGS_COMMIT) {
+					committed.insert(ctl.run);
+					continue;
+				}
+
+				size_t rcache_size = (m_version >= 3) ? ctl.rcache_num * rcache_entry_size : 0;
+
+				std::vector<char> data;
+				if (meta_only) {
+					bio::seek<bio::file_source>(ch_src, ctl.bloom_size + rcache_size, std::ios_base::cur);
+				} else {
+					data.resize(ctl.bloom_size);
+					bio::read<bio::file_source>(ch_src, data.data(), data.size());
+				}
+
+				chunk ch(ctl, data);
+
+				/* sparse index is stored since version 3, older chunks have to be decompressed to build it */
+				if (!meta_only && (m_version >= 3)) {
+					std::vector<char> rcache(ctl.rcache_num * rcache_entry_size);
+					bio::read<bio::file_source>(ch_src, rcache.data(), rcache.size());
+
+					for (size_t i = 0; i < rcache.size(); i += rcache_entry_size) {
+						struct chunk_rcache_entry e;
+						memset(&e, 0, sizeof(struct chunk_rcache_entry));
+						memcpy(&e, &rcache[i], rcache_entry_size);
+
+						ch.rcache_add(key_id(e.id, chunk_key_size(e.size)), e.offset);
+					}
+				}
+
+				int step = ctl.num;
+				if (max_rcache_size)
+					step = ctl.num / max_rcache_size + 1;
+
+				if (!meta_only && (m_version < 3) && (step < ctl.num)) {
+					chunk_source<fin_t> src(m_path_base + ".data", codec(), ch, 0, true);
+
+					int st = 0;
+					size_t off = 0;
+					while (src.next()) {
+						const struct index *idx = src.current().idx();
+
+						log(SMACK_LOG_DEBUG, "%s: %s: ts: %zd, data-size: %d, flags: %x\n",
+								m_path_base.c_str(), src.current().str(), idx->ts, idx->data_size, idx->flags);
+
+						if (++st == step) {
+							ch.rcache_add(src.current(), off);
+							st = 0;
+						}
+
+						off += sizeof(struct index) + idx->data_size;	/* old format has no prefix compression */
+					}
+				}
+
+				log(SMACK_LOG_NOTICE, "%s: read_chunks: %zd: data-offset: %zd, "
+						"compressed-size: %zd, uncompressed-size: %zd, "
+						"num: %d, bloom-size: %d, bloom-probes: %d, start: %s, end: %s, run: %zd, seq: %zd, level: %d, flags: %x, "
+						"codec: %d\n",
+						m_path_base.c_str(), chunk_num, ctl.data_offset,
+						ctl.compressed_data_size, ctl.uncompressed_data_size,
+						ctl.num, ctl.bloom_size, ctl.bloom_probes, ch.start().str(), ch.end().str(),
+						ctl.run, ctl.seq, ctl.level, ctl.flags, ctl.codec);
+
+				if (ctl.flags & SMACK_CHUNK_FLAGS_PENDING)
+					pending.insert(ctl.run);
+
+				std::map<uint64_t, sorted_run>::iterator it = runs.find(ctl.run);
+				if (it == runs.end())
+					it = runs.insert(std::make_pair((uint64_t)ctl.run, sorted_run(ctl.run, ctl.seq, ctl.level))).first;
+
+				it->second.add(ch);
+			}
+
+			/* runs replaced by committed compaction output */
+			for (std::vector<std::pair<uint64_t, uint64_t> >::iterator it = drops.begin(); it != drops.end(); ++it) {
+				if (committed.find(it->second) != committed.end())
+					runs.erase(it->first);
+			}
+
+			/* compaction output which was not committed */
+			for (std::set<uint64_t>::iterator it = pending.begin(); it != pending.end(); ++it) {
+				if (committed.find(*it) == committed.end()) {
+					log(SMACK_LOG_NOTICE, "%s: read_chunks: dropping uncommitted run %zd\n", m_path_base.c_str(), *it);
+					runs.erase(*it);
+				}
+			}
+
+			for (std::map<uint64_t, sorted_run>::iterator it = runs.begin(); it != runs.end(); ++it)
+				ret.push_back(it->second);
+
+			std::sort(ret.begin(), ret.end(), sorted_run_comp());
+		}
+
+		void check_chunk_header(bio::file_source &ch_src) {
+			struct chunk_header h;
+			bio::read<bio::file_source>(ch_src, (char *)&h, sizeof(struct chunk_header));
+			if (memcmp(h.magic, SMACK_DISK_FORMAT_MAGIC, sizeof(SMACK_DISK_FORMAT_MAGIC))) {
+				log(SMACK_LOG_ERROR, "%s: smack disk format magic mismatch\n", m_path_base.c_str());
+				throw std::runtime_error("smack disk format magic mismatch");
+			}
+			if (h.version > SMACK_DISK_FORMAT_VERSION) {
+				log(SMACK_LOG_ERROR, "%s: smack disk format version mismatch: stored: %d, current: %d, please upgrade\n",
+						m_path_base.c_str(), h.version, SMACK_DISK_FORMAT_VERSION);
+				throw std::runtime_error("smack disk format version mismatch");
+			}
+
+			m_version = h.version;
+		}
+};
+
+enum compaction_style {
+	compaction_leveled = 0,
+	compaction_tiered,
+};
+
+/* tuning knobs which are not passed as separate smack/blob constructor parameters */
+struct config {
+	config() :
+	compaction(compaction_leveled),
+	level0_runs(4),
+	level_base_size(16 * 1024 * 1024),
+	level_multiplier(10),
+	tier_size_ratio(200),
+	ttl(0),
+	subcompactions(4),
+	split_size(10 * 1024 * 1024),
+	split_write_rate(0),
+	split_read_rate(0),
+	merge_size(0),
+	vlog_min_size(0),
+	vlog_file_size(64 * 1024 * 1024),
+	vlog_gc_ratio(50),
+	lazy_open(false),
+	bloom_bits_per_key(10),
+	compression_level(0),
+	compression_min_gain(12),
+	dict_size(0)
+	{
+	}
+
+	int			compaction;		/* compaction_leveled or compaction_tiered */
+	int			level0_runs;		/* number of flushed runs which triggers compaction */
+	uint64_t		level_base_size;	/* leveled: uncompressed data size of the level 1 */
+	int			level_multiplier;	/* leveled: size ratio of the adjacent levels */
+	int			tier_size_ratio;	/* tiered: older run is merged if its size is within this percent of newer runs */
+	uint64_t		ttl;			/* seconds since record ts after which it expires, 0 - never */
+	int			subcompactions;		/* maximum number of threads merging disjoint key ranges of one compaction */
+	uint64_t		split_size;		/* blob data file size which triggers split */
+	uint64_t		split_write_rate;	/* written bytes per second which trigger split, 0 - disabled */
+	uint64_t		split_read_rate;	/* reads per second which trigger split, 0 - disabled */
+	uint64_t		merge_size;		/* adjacent idle blobs are merged while their total data size is below it, 0 - never */
+	uint64_t		vlog_min_size;		/* values of at least this size are stored in the value log, 0 - never */
+	uint64_t		vlog_file_size;		/* value log file which reached this size is not appended anymore */
+	int			vlog_gc_ratio;		/* percent of garbage in the value log file which triggers its collection */
+	bool			lazy_open;		/* blob index is read in background or on the first access instead of at startup */
+	int			bloom_bits_per_key;	/* chunk bloom filter bits per record, 0 - fixed bloom_size bytes per chunk */
+	int			compression_level;	/* passed to codecs which support levels, 0 - codec default */
+	int			compression_min_gain;	/* chunk is stored uncompressed unless codec saves this percent of it, negative - never */
+	uint64_t		dict_size;		/* compression dictionary trained by full compaction, 0 - none */
+};
+
+template <class fout_t, class fin_t>
+class blob {
+	public:
+		blob(const std::string &path, int bloom_size, size_t max_cache_size, const config &cfg = config(),
+				boost::shared_ptr<manifest> mf = boost::shared_ptr<manifest>()) :
+		m_wcache_bytes(0),
+		m_flush_queued(false),
+		m_stat_written(0),
+		m_stat_reads(0),
+		m_stat_time(time(NULL)),
+		m_path(path),
+		m_name(boost::filesystem::path(path).filename().string()),
+		m_cache_size(max_cache_size),
+		m_bloom_size(bloom_size),
+		m_cfg(cfg),
+		m_manifest(mf),
+		m_chunk_idx(0),
+		m_split_src(NULL),
+		m_next_run(1),
+		m_want_resort(false),
+		m_split_incoming(false),
+		m_have_start(false),
+		m_have_index(false),
+		m_loaded(false),
+		m_filter_seq(0),
+		m_dyn_num(0),
+		m_dyn_max(0)
+		{
+			int num = 2;
+
+			codec_params codec;
+			codec.level = m_cfg.compression_level;
+			codec.min_gain = m_cfg.compression_min_gain;
+
+			for (int i = 0; i < num; ++i) {
+				std::string prefix = path + "." + boost::lexical_cast<std::string>(i);
+				m_files.push_back(boost::shared_ptr<blob_store>(new blob_store(prefix, m_bloom_size, m_cfg.bloom_bits_per_key,
+								codec)));
+			}
+
+			struct manifest_entry e;
+			if (m_manifest && m_manifest->find(m_name, e)) {
+				if ((e.gen < 0) || (e.gen >= num))
+					throw std::runtime_error(path + ": manifest: invalid generation: " +
+							boost::lexical_cast<std::string>(e.gen));
+
+				m_chunk_idx = e.gen;
+				m_start = key_id(e.start, e.start_size);
+				m_have_start = true;
+				m_split_incoming = e.state & SMACK_BLOB_STATE_SPLIT;
+				m_have_index = m_files[m_chunk_idx]->exists();
+
+				log(SMACK_LOG_NOTICE, "%s: manifest: idx: %d, state: %x, start: %s\n",
+						path.c_str(), m_chunk_idx, e.state, m_start.str());
+			} else {
+				legacy_generation();
+			}
+
+			if (m_cfg.lazy_open && m_have_index && !m_have_start) {
+				/* only chunk bounds are needed for the start key, the rest is loaded on the first access */
+				m_files[m_chunk_idx]->read_index<fin_t>(m_runs, 0, true);
+				update_runs();
+				m_runs.clear();
+			} else if (!m_cfg.lazy_open || !m_have_index) {
+				load();
+			}
+		}
+
+		/* reads the disk index and opens the value log unless it is already done */
+		void load() {
+			boost::mutex::scoped_lock load_guard(m_load_lock);
+			if (m_loaded)
+				return;
+
+			std::vector<sorted_run> runs;
+			boost::shared_ptr<value_log> vlog(new value_log(m_path, m_cfg.vlog_file_size));
+			boost::shared_ptr<blob_store> st = m_files[m_chunk_idx];
+
+			/* empty blob has nothing to hide, blob without filter file waits for full compaction */
+			boost::shared_ptr<xor_filter> filter(new xor_filter());
+			uint64_t filter_seq = 0;
+
+			if (m_have_index) {
+				st->read_index<fin_t>(runs, 0);
+				vlog->set_garbage(st->vlog_garbage());
+
+				if (!st->read_filter(filter, filter_seq))
+					filter.reset();
+
+				log(SMACK_LOG_INFO, "%s: read-index: idx: %d, version: %d, runs: %zd, filter-seq: %llu\n",
+						m_path.c_str(), m_chunk_idx, st->version(), runs.size(), (unsigned long long)filter_seq);
+			}
+
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			m_vlog = vlog;
+			m_runs.swap(runs);
+			set_filter(filter, filter_seq);
+
+			/* old disk format is converted by full compaction before anything is appended */
+			if (m_have_index && (st->version() < SMACK_DISK_FORMAT_VERSION))
+				m_want_resort = true;
+
+			update_runs();
+			m_loaded = true;
+		}
+
+		bool write(const key &key, const char *data, size_t size) {
+			struct index idx = *key.idx();
+			idx.flags &= ~SMACK_INDEX_FLAGS_REMOVED;
+
+			/* records without timestamp live for ttl seconds since they were written */
+			if (m_cfg.ttl && !(idx.flags & SMACK_INDEX_FLAGS_EXPIRE) && !idx.ts)
+				idx.ts = time(NULL);
+
+			boost::mutex::scoped_lock guard(m_write_lock);
+			if (m_merged_into) {
+				boost::shared_ptr<blob<fout_t, fin_t> > dst = m_merged_into;
+				guard.unlock();
+
+				return dst->write(key, data, size);
+			}
+
+			m_stat_written += size + sizeof(struct index);
+			return cache_insert(&idx, std::string(data, size));
+		}
+
+		std::string read(key &key) {
+			load();
+
+			boost::mutex::scoped_lock guard(m_write_lock);
+			if (m_merged_into) {
+				boost::shared_ptr<blob<fout_t, fin_t> > dst = m_merged_into;
+				guard.unlock();
+
+				return dst->read(key);
+			}
+
+			m_stat_reads++;
+
+			/*
+			 * First, check write cache and the cache which is being flushed right now
+			 * If something is found, return it from cache unless it is a tombstone
+			 */
+			cache_t *caches[] = { &m_wcache, &m_imm };
+			for (size_t i = 0; i < sizeof(caches) / sizeof(caches[0]); ++i) {
+				cache_t::iterator it = caches[i]->find(key);
+				if (it == caches[i]->end())
+					continue;
+
+				key = cache_source::cache_index(it);
+				if (record_dead(key.idx(), time(NULL))) {
+					std::ostringstream str;
+					str << key.str() << ": blob::read::in-removed-cache";
+					throw std::out_of_range(str.str());
+				}
+
+				return it->second.data;
+			}
+
+			/*
+			 * that's a tricky place
+			 * we lock m_disk_lock to prevent modification of disk indexes
+			 * while doing lookup, but we have to lock it under m_write_lock
+			 * to prevent race where flushed cache is already dropped,
+			 * but its run is not yet visible in the disk index
+			 */
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			guard.unlock();
+
+			std::string ret;
+
+			/* tombstone or expired record hides older runs */
+			if (disk_read(key, ret)) {
+				if (!record_dead(key.idx(), time(NULL))) {
+					if (key.idx()->flags & SMACK_INDEX_FLAGS_VLOG) {
+						m_vlog->read(value_log::pointer(ret), ret);
+
+						struct index idx = *key.idx();
+						idx.flags &= ~SMACK_INDEX_FLAGS_VLOG;
+						idx.data_size = ret.size();
+						key.set(&idx);
+					}
+
+					return ret;
+				}
+			} else if (m_split_src) {
+				/* older records of the key stay in the split source until its compaction moves them here */
+				blob<fout_t, fin_t> *src = m_split_src;
+				disk_guard.unlock();
+
+				try {
+					return src->read(key);
+				} catch (const std::out_of_range &) {
+					/* split could complete after our lookup, then records are ours already */
+					if (split_incoming())
+						throw;
+				}
+
+				return read(key);
+			}
+
+			std::ostringstream str;
+			str << key.str() << ": read: no data";
+			throw std::out_of_range(str.str());
+		}
+
+		/*
+		 * Finds the newest on-disk record of the key including tombstones, value log pointer is not resolved.
+		 * Must be called with m_disk_lock held.
+		 */
+		bool disk_read(key &key, std::string &ret) {
+			/* runs covered by the blob filters are skipped without looking at their chunks */
+			bool in_filter = !m_filter || m_filter->check((char *)key.id(), key.size());
+			bool in_dyn = in_filter || m_dyn_filter.check((char *)key.id(), key.size());
+
+			/* newer runs shadow older ones, each run has at most one chunk which may host the key */
+			for (std::vector<sorted_run>::iterator r = m_runs.begin(); r != m_runs.end(); ++r) {
+				if (!in_filter) {
+					if (m_dyn_runs.find(r->id()) != m_dyn_runs.end()) {
+						if (!in_dyn)
+							continue;
+					} else if (r->seq() <= m_filter_seq) {
+						continue;
+					}
+				}
+
+				chunk *ch = r->find(key);
+				if (!ch)
+					continue;
+
+				log(SMACK_LOG_DEBUG, "%s: read key: run: %zd, level: %d, chunk start: %s, end: %s\n",
+						key.str(), r->id(), r->level(), ch->start().str(), ch->end().str());
+
+				if (current_bstore()->template chunk_read<fin_t>(key, *ch, ret))
+					return true;
+			}
+
+			return false;
+		}
+
+		/* removal is a tombstone record which goes to disk like any other write */
+		bool remove(const key &key) {
+			struct index idx = *key.idx();
+			idx.flags |= SMACK_INDEX_FLAGS_REMOVED;
+			idx.data_size = 0;
+
+			boost::mutex::scoped_lock guard(m_write_lock);
+			if (m_merged_into) {
+				boost::shared_ptr<blob<fout_t, fin_t> > dst = m_merged_into;
+				guard.unlock();
+
+				return dst->remove(key);
+			}
+
+			m_stat_written += sizeof(struct index);
+			return cache_insert(&idx, std::string());
+		}
+
+		std::string lookup(key &) {
+			return std::string();
+		}
+
+		key_id &start() {
+			return m_start;
+		}
+
+		/*
+		 * Writes write cache into the new level 0 run.
+		 * Returns true if blob needs compaction afterwards.
+		 */
+		bool flush() {
+			load();
+
+			boost::mutex::scoped_lock flush_guard(m_flush_lock);
+
+			{
+				/* old disk format can not be appended, the whole blob is rewritten by compaction */
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				if (m_want_resort)
+					return true;
+			}
+
+			/* m_imm stays readable until its run is added to the disk index */
+			boost::mutex::scoped_lock write_guard(m_write_lock);
+			m_imm.swap(m_wcache);
+			m_wcache_bytes = 0;
+			write_guard.unlock();
+
+			boost::mutex::scoped_lock append_guard(m_append_lock);
+
+			if (m_imm.size())
+				write_cache_to_chunks(m_imm);
+
+			append_guard.unlock();
+
+			write_guard.lock();
+			m_imm.clear();
+			write_guard.unlock();
+
+			return compaction_urgency() > 0;
+		}
+
+		/* background compaction: split and old format conversion, run merges and data file garbage collection */
+		void compact() {
+			load();
+
+			boost::mutex::scoped_lock compact_guard(m_compact_lock);
+
+			bool resort;
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				resort = m_split_dst || m_want_resort;
+			}
+
+			if (resort) {
+				chunks_resort();
+				return;
+			}
+
+			while (true) {
+				std::vector<sorted_run> inputs;
+				size_t first, last;
+				int level;
+				bool bottom, full;
+
+				{
+					boost::mutex::scoped_lock disk_guard(m_disk_lock);
+					if (!pick_runs(first, last, level))
+						break;
+
+					inputs.assign(m_runs.begin() + first, m_runs.begin() + last);
+					bottom = (last == m_runs.size()) && !m_split_incoming;
+					full = bottom && (first == 0);
+				}
+
+				if (inputs.size() == 1)
+					promote_run(inputs[0], level);
+				else
+					merge_runs(inputs, level, bottom, full);
+			}
+
+			/* compaction leaves replaced runs in the data file, rewrite it when most of it is garbage */
+			uint64_t live = 0;
+			size_t data_size;
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				for (std::vector<sorted_run>::iterator it = m_runs.begin(); it != m_runs.end(); ++it)
+					live += it->disk_size();
+
+				current_bstore()->size(data_size);
+			}
+
+			if ((data_size > 1024 * 1024) && (data_size > live * 2))
+				relocate();
+
+			uint64_t gen;
+			while (m_vlog->pick_gc(m_cfg.vlog_gc_ratio, gen))
+				collect_vlog(gen);
+		}
+
+		/* amount of data waiting in the write cache */
+		uint64_t flush_urgency() {
+			boost::mutex::scoped_lock guard(m_write_lock);
+			return m_wcache_bytes;
+		}
+
+		bool want_flush() {
+			boost::mutex::scoped_lock guard(m_write_lock);
+			return m_wcache.size() >= m_cache_size;
+		}
+
+		/*
+		 * Set by the job scheduler while flush of this blob is queued and not started yet,
+		 * so notifications after every write over the cache limit do not take the scheduler lock.
+		 */
+		bool flush_queued() const {
+			return m_flush_queued.load();
+		}
+
+		void set_flush_queued(bool queued) {
+			m_flush_queued.store(queued);
+		}
+
+		/* 0 if there is nothing to compact, pending split and format conversion go first */
+		uint64_t compaction_urgency() {
+			load();
+
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+
+			if (m_split_dst || m_want_resort)
+				return ~0ULL;
+
+			size_t first, last;
+			int level;
+			if (!pick_runs(first, last, level))
+				return 0;
+
+			return m_runs.size();
+		}
+
+		/* returns current number of records and data size on disk */
+		void disk_stat(size_t &num, size_t &data_size, bool &have_split) {
+			load();
+
+			size_t cached;
+			{
+				boost::mutex::scoped_lock guard(m_write_lock);
+				cached = m_wcache.size() + m_imm.size();
+			}
+
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+
+			have_split = false;
+			if (m_split_dst)
+				have_split = true;
+
+			num = this->num() + cached;
+			current_bstore()->size(data_size);
+			data_size += m_vlog->size();
+		}
+
+		/* lazily opened blob has not read its index yet */
+		bool loaded() {
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			return m_loaded;
+		}
+
+		/* blob was absorbed by its neighbour and only forwards requests to it */
+		bool merged() {
+			boost::mutex::scoped_lock guard(m_write_lock);
+			return m_merged_into.get() != NULL;
+		}
+
+		/* write bytes and reads per second since the previous call */
+		void load_stat(uint64_t &write_rate, uint64_t &read_rate) {
+			boost::mutex::scoped_lock guard(m_write_lock);
+
+			time_t now = time(NULL);
+			time_t diff = std::max<time_t>(now - m_stat_time, 1);
+
+			write_rate = m_stat_written / diff;
+			read_rate = m_stat_reads / diff;
+
+			m_stat_written = 0;
+			m_stat_reads = 0;
+			m_stat_time = now;
+		}
+
+		/*
+		 * Finds the key which divides records of the blob into two halves.
+		 * Keys sampled by chunk read caches are spread evenly over records, so they are used as weighted points.
+		 * Returns false if there is no key which leaves data on both sides.
+		 */
+		bool split_key(key_id &k) {
+			load();
+
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+
+			std::vector<std::pair<key_id, uint64_t> > samples;
+			uint64_t total = 0;
+
+			for (std::vector<sorted_run>::iterator r = m_runs.begin(); r != m_runs.end(); ++r) {
+				for (std::map<key_id, chunk, keycomp>::iterator it = r->chunks().begin(); it != r->chunks().end(); ++it) {
+					const chunk &ch = it->second;
+					uint64_t weight = std::max<uint64_t>(ch.ctl()->num / (ch.rcache().size() + 1), 1);
+
+					samples.push_back(std::make_pair(ch.start(), weight));
+					for (rcache_t::const_iterator rc = ch.rcache().begin(); rc != ch.rcache().end(); ++rc)
+						samples.push_back(std::make_pair(rc->first, weight));
+
+					total += weight * (ch.rcache().size() + 1);
+				}
+			}
+
+			std::sort(samples.begin(), samples.end(), sample_comp());
+
+			uint64_t sum = 0;
+			for (size_t i = 0; i < samples.size(); ++i) {
+				sum += samples[i].second;
+				if (sum * 2 >= total) {
+					k = samples[i].first;
+					return k > m_start;
+				}
+			}
+
+			return false;
+		}
+
+		/* records starting from @k will be moved to @dst by the next compaction */
+		bool set_split_dst(boost::shared_ptr<blob<fout_t, fin_t> > dst, const key_id &k) {
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			if (m_split_dst || m_split_incoming)
+				return false;
+
+			boost::mutex::scoped_lock dst_disk_guard(dst->m_disk_lock);
+			dst->m_split_incoming = true;
+			dst->m_split_src = this;
+
+			m_split_dst = dst;
+			m_split_dst->start() = k;
+			m_split_dst->m_have_start = true;
+
+			/* interrupted split is restarted from the manifest */
+			m_split_dst->write_manifest();
+			return true;
+		}
+
+		/* records current generation, state and start key of the blob in the manifest */
+		void store_manifest() {
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			write_manifest();
+		}
+
+		/* blob waits for the upper part of its predecessor, which has not yet been split */
+		bool split_incoming() {
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			return m_split_incoming;
+		}
+
+		/*
+		 * Moves all data of the adjacent blob @src, which follows this one, into this blob.
+		 * Runs are copied without recompression and become level 0 runs, they are compacted in as usual.
+		 * Requests which still reach @src afterwards are forwarded to @self, which must point to this blob.
+		 *
+		 * Returns false if either blob is in the middle of split or format conversion, or was merged already.
+		 */
+		bool absorb(boost::shared_ptr<blob<fout_t, fin_t> > self, boost::shared_ptr<blob<fout_t, fin_t> > src) {
+			load();
+			src->load();
+
+			boost::mutex::scoped_lock compact_guard(m_compact_lock);
+			boost::mutex::scoped_lock src_compact_guard(src->m_compact_lock);
+			boost::mutex::scoped_lock src_flush_guard(src->m_flush_lock);
+
+			/* merges are serialized by compaction locks of their blobs */
+			if (merged() || src->merged())
+				return false;
+
+			std::vector<sorted_run> runs;
+			boost::shared_ptr<blob_store> src_st;
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				boost::mutex::scoped_lock src_disk_guard(src->m_disk_lock);
+
+				if (m_split_dst || m_want_resort || m_split_incoming ||
+						src->m_split_dst || src->m_want_resort || src->m_split_incoming)
+					return false;
+
+				runs = src->m_runs;
+				src_st = src->current_bstore();
+			}
+
+			boost::mutex::scoped_lock append_guard(m_append_lock);
+			boost::shared_ptr<blob_store> st = current_bstore();
+
+			std::vector<sorted_run> moved;
+			if (src->m_vlog->empty()) {
+				/* the oldest runs get the smallest new IDs, so moved runs keep their order */
+				for (std::vector<sorted_run>::reverse_iterator it = runs.rbegin(); it != runs.rend(); ++it) {
+					uint64_t id;
+					{
+						boost::mutex::scoped_lock disk_guard(m_disk_lock);
+						id = m_next_run++;
+					}
+
+					sorted_run r(id, id, 0);
+					for (std::map<key_id, chunk, keycomp>::iterator ch = it->chunks().begin(); ch != it->chunks().end(); ++ch)
+						r.add(st->copy_chunk(*src_st, ch->second, r));
+
+					moved.push_back(r);
+				}
+			} else if (!runs.empty()) {
+				/* chunks point into the value log of @src, so its runs are merged and values are moved into ours */
+				boost::mutex lock;
+				std::vector<subcompaction> subs(1);
+				{
+					boost::mutex::scoped_lock disk_guard(m_disk_lock);
+					uint64_t id = m_next_run++;
+
+					subs[0].out = sorted_run(id, id, 0);
+				}
+				subs[0].st = st;
+				subs[0].append_lock = &lock;
+				subs[0].vlog_src = src->m_vlog.get();
+				subs[0].vlog = m_vlog.get();
+
+				src->merge_subcompactions(NULL, src_st, runs, subs, 0, false);
+				if (!subs[0].out.empty())
+					moved.push_back(subs[0].out);
+			}
+
+			st->sync();
+
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				m_runs.insert(m_runs.end(), moved.begin(), moved.end());
+				std::sort(m_runs.begin(), m_runs.end(), sorted_run_comp());
+			}
+
+			append_guard.unlock();
+
+			{
+				boost::mutex::scoped_lock src_write_guard(src->m_write_lock);
+				boost::mutex::scoped_lock write_guard(m_write_lock);
+
+				for (cache_t::iterator it = src->m_wcache.begin(); it != src->m_wcache.end(); ++it)
+					cache_insert(it->first, it->second);
+
+				src->m_wcache.clear();
+				src->m_wcache_bytes = 0;
+				src->m_merged_into = self;
+			}
+
+			boost::mutex::scoped_lock src_disk_guard(src->m_disk_lock);
+			if (src->m_manifest)
+				src->m_manifest->remove(src->m_name);
+
+			src->m_runs.clear();
+			for (size_t i = 0; i < src->m_files.size(); ++i)
+				src->m_files[i]->truncate();
+			src->m_vlog->remove_all();
+
+			log(SMACK_LOG_NOTICE, "%s: %s: blob merged: %s: runs: %zd\n",
+					m_path.c_str(), m_start.str(), src->m_path.c_str(), moved.size());
+			return true;
+		}
+
+		void set_want_resort(bool want_resort) {
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+
+			m_want_resort = want_resort;
+		}
+
+	private:
+		key_id m_start;
+		boost::mutex m_write_lock;
+		boost::mutex m_disk_lock;
+		boost::mutex m_flush_lock;
+		boost::mutex m_append_lock;
+		boost::mutex m_compact_lock;
+		boost::condition m_cond;
+		cache_t m_wcache;
+		/* write cache which is being flushed to disk */
+		cache_t m_imm;
+		uint64_t m_wcache_bytes;
+		boost::atomic<bool> m_flush_queued;
+
+		/* load since the last load_stat() call */
+		uint64_t m_stat_written, m_stat_reads;
+		time_t m_stat_time;
+
+		/* all requests go to this blob after it absorbed our data */
+		boost::shared_ptr<blob<fout_t, fin_t> > m_merged_into;
+		std::string m_path;
+		/* blob name in the manifest */
+		std::string m_name;
+		size_t m_cache_size;
+		size_t m_bloom_size;
+		config m_cfg;
+		boost::shared_ptr<manifest> m_manifest;
+		int m_chunk_idx;
+		boost::shared_ptr<blob<fout_t, fin_t> > m_split_dst;
+		/* blob which still holds our records while m_split_incoming is set, it outlives the split */
+		blob<fout_t, fin_t> *m_split_src;
+
+		std::vector<boost::shared_ptr<blob_store> > m_files;
+
+		/* large values of the records stored in m_files */
+		boost::shared_ptr<value_log> m_vlog;
+
+		/* sorted runs from the newest to the oldest */
+		std::vector<sorted_run> m_runs;
+		uint64_t m_next_run;
+
+		bool m_want_resort;
+
+		/*
+		 * Split source has not yet attached its part of the data as our oldest run,
+		 * tombstones must be kept since they may hide records in that run.
+		 */
+		bool m_split_incoming;
+
+		/* start key comes from the manifest and does not depend on the data */
+		bool m_have_start;
+
+		/* lazily opened blob reads its index on the first access */
+		bool m_have_index, m_loaded;
+		boost::mutex m_load_lock;
+
+		/*
+		 * All keys of the runs with sequence up to m_filter_seq are in m_filter.
+		 * Keys of the runs listed in m_dyn_runs are in either m_filter or m_dyn_filter.
+		 * Other runs are checked chunk by chunk.
+		 */
+		boost::shared_ptr<xor_filter> m_filter;
+		uint64_t m_filter_seq;
+		bloom m_dyn_filter;
+		size_t m_dyn_num, m_dyn_max;
+		std::set<uint64_t> m_dyn_runs;
+
+		size_t num() {
+			size_t num = 0;
+			for (std::vector<sorted_run>::iterator it = m_runs.begin(); it != m_runs.end(); ++it)
+				num += it->num();
+
+			return num;
+		}
+
+		boost::shared_ptr<blob_store> current_bstore(void) {
+			return m_files[m_chunk_idx];
+		}
+
+		/* must be called with m_disk_lock held, replaces the blob filter and empties the dynamic one */
+		void set_filter(boost::shared_ptr<xor_filter> filter, uint64_t seq) {
+			m_filter = filter;
+			m_filter_seq = seq;
+
+			m_dyn_runs.clear();
+			m_dyn_num = 0;
+			m_dyn_max = 0;
+
+			if (filter) {
+				int bits = m_cfg.bloom_bits_per_key ? m_cfg.bloom_bits_per_key : 10;
+
+				/* runs flushed between compactions, or a quarter of the filter keys */
+				m_dyn_max = std::max<size_t>(m_cache_size * m_cfg.level0_runs * 2, filter->fingerprints().size() / 5);
+				m_dyn_filter.reset(m_dyn_max * bits / 8, 0, true);
+			} else {
+				m_dyn_filter.reset(0, 0, true);
+			}
+		}
+
+		/* must be called with m_disk_lock held, keys of the new run @r go to the dynamic filter while it has room */
+		void filter_add_run(const sorted_run &r, const cache_t &cache) {
+			if (!m_filter || (m_dyn_num + cache.size() > m_dyn_max))
+				return;
+
+			for (cache_t::const_iterator it = cache.begin(); it != cache.end(); ++it)
+				m_dyn_filter.add((char *)it->first.id(), it->first.size());
+
+			m_dyn_num += cache.size();
+			m_dyn_runs.insert(r.id());
+		}
+
+		/* must be called with m_disk_lock held, true if all keys of @r are in the blob filters */
+		bool filter_covers(const sorted_run &r) {
+			if (!m_filter)
+				return false;
+
+			return (m_dyn_runs.find(r.id()) != m_dyn_runs.end()) || (r.seq() <= m_filter_seq);
+		}
+
+		/* must be called with m_disk_lock held */
+		void write_manifest() {
+			if (m_manifest)
+				m_manifest->update(m_name, m_chunk_idx, m_split_incoming ? SMACK_BLOB_STATE_SPLIT : 0, m_start);
+		}
+
+		/* blobs written before the manifest existed use the generation with the newest data file */
+		void legacy_generation() {
+			time_t mtime = 0;
+			ssize_t size = 0;
+			int idx = -1;
+
+			for (size_t i = 0; i < m_files.size(); ++i) {
+				struct stat st;
+				int err;
+
+				std::string prefix = m_path + "." + boost::lexical_cast<std::string>(i);
+
+				err = stat((prefix + ".data").c_str(), &st);
+				if (err == 0) {
+					log(SMACK_LOG_NOTICE, "%s: old-idx: %d, old-mtime: %ld, old-size: %zd, mtime: %ld, size: %zd\n",
+							prefix.c_str(), idx, mtime, size, st.st_mtime, st.st_size);
+					if (st.st_mtime > mtime) {
+						mtime = st.st_mtime;
+						size = st.st_size;
+						idx = i;
+					} else if (st.st_mtime == mtime) {
+						if (st.st_size > size) {
+							idx = i;
+							mtime = st.st_mtime;
+							size = st.st_size;
+						}
+					}
+				}
+			}
+
+			if (idx != -1)
+				m_chunk_idx = idx;
+			m_have_index = (idx != -1);
+		}
+
+		struct sample_comp {
+			bool operator() (const std::pair<key_id, uint64_t> &lhs, const std::pair<key_id, uint64_t> &rhs) const {
+				return lhs.first < rhs.first;
+			}
+		};
+
+		/* record is a tombstone or it has expired, it does not have data visible to reads */
+		bool record_dead(const struct index *idx, time_t now) {
+			if (idx->flags & SMACK_INDEX_FLAGS_REMOVED)
+				return true;
+
+			if (idx->flags & SMACK_INDEX_FLAGS_EXPIRE)
+				return idx->ts <= (uint64_t)now;
+
+			return m_cfg.ttl && idx->ts && (idx->ts + m_cfg.ttl <= (uint64_t)now);
+		}
+
+		/* must be called with m_write_lock held, replaces both data and index (timestamp, flags) of the key */
+		bool cache_insert(const struct index *idx, const std::string &data) {
+			cache_entry e;
+			e.ts = idx->ts;
+			e.flags = idx->flags;
+			e.data = data;
+
+			return cache_insert(key_id(key(idx)), e);
+		}
+
+		bool cache_insert(const key_id &k, const cache_entry &e) {
+			cache_t::iterator it = m_wcache.lower_bound(k);
+			if ((it != m_wcache.end()) && (it->first == k)) {
+				m_wcache_bytes -= it->second.data.size() + sizeof(struct index);
+				m_wcache.erase(it++);
+			}
+
+			m_wcache.insert(it, std::make_pair(k, e));
+			m_wcache_bytes += e.data.size() + sizeof(struct index);
+
+			return m_wcache.size() >= m_cache_size;
+		}
+
+		/* recalculates blob start key and the next run ID after runs were loaded from disk */
+		void update_runs() {
+			m_next_run = std::max(m_next_run, current_bstore()->max_run() + 1);
+
+			if (m_have_start)
+				return;
+
+			for (std::vector<sorted_run>::iterator it = m_runs.begin(); it != m_runs.end(); ++it) {
+
+				if (!it->empty() && ((it == m_runs.begin()) || (it->start() < m_start)))
+					m_start = it->start();
+			}
+		}
+
+		/* writes @num records starting from @it into the new chunk, @it is moved past the last written record */
+		void write_chunk(boost::shared_ptr<blob_store> st, sorted_run &r, cache_t::const_iterator &it, size_t num) {
+			blob_store::chunk_writer<fout_t> writer(*st, r, 0, num, m_cache_size * sizeof(struct index) / smack_rcache_mult);
+
+			for (; writer.num() < num; ++it)
+				write_record(writer, cache_source::cache_index(it), it->second.data, m_vlog.get(), m_vlog.get());
+
+			r.add(writer.finish());
+		}
+
+		/*
+		 * Large values go to the value log @to, chunk only gets the pointer.
+		 * Values which live in the other value log @from are moved into @to.
+		 */
+		void write_record(blob_store::chunk_writer<fout_t> &writer, const key &k, const std::string &data,
+				value_log *from, value_log *to) {
+			const struct index *idx = k.idx();
+
+			if (idx->flags & SMACK_INDEX_FLAGS_VLOG) {
+				if (from == to) {
+					writer.write(k, data);
+					return;
+				}
+
+				std::string value;
+				from->read(value_log::pointer(data), value);
+				from->release(idx, data);
+
+				struct index tmp = *idx;
+				tmp.flags &= ~SMACK_INDEX_FLAGS_VLOG;
+
+				write_record(writer, key(&tmp), value, to, to);
+				return;
+			}
+
+			if (!m_cfg.vlog_min_size || (data.size() < m_cfg.vlog_min_size) || (idx->flags & SMACK_INDEX_FLAGS_REMOVED)) {
+				writer.write(k, data);
+				return;
+			}
+
+			struct vlog_ptr ptr = to->append(*idx, data);
+
+			struct index tmp = *idx;
+			tmp.flags |= SMACK_INDEX_FLAGS_VLOG;
+
+			writer.write(key(&tmp), std::string((char *)&ptr, sizeof(struct vlog_ptr)));
+		}
+
+		/* garbage counters of the value log go to the index, must be called with m_append_lock held */
+		void store_vlog_garbage(boost::shared_ptr<blob_store> st, bool all) {
+			std::map<uint64_t, uint64_t> garbage = m_vlog->garbage(all);
+
+			for (std::map<uint64_t, uint64_t>::iterator it = garbage.begin(); it != garbage.end(); ++it)
+				st->store_run_marker(SMACK_CHUNK_FLAGS_VLOG_GARBAGE, it->first, it->second);
+		}
+
+		/* true if the newest record of the key points to the value at @offset of the value log file @gen */
+		bool vlog_live(key &k, uint64_t gen, uint64_t offset) {
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+
+			std::string data;
+			if (!disk_read(k, data) || !(k.idx()->flags & SMACK_INDEX_FLAGS_VLOG) || record_dead(k.idx(), time(NULL)))
+				return false;
+
+			struct vlog_ptr ptr = value_log::pointer(data);
+			return (ptr.gen == gen) && (ptr.offset == offset);
+		}
+
+		/*
+		 * Live values of the value log file are written again through the write cache,
+		 * so their new pointers shadow the old ones, then the file is removed.
+		 * Flushes are blocked while a batch is checked, otherwise a newer write could reach disk
+		 * between the liveness check and the insertion of the old value.
+		 */
+		void collect_vlog(uint64_t gen) {
+			value_log::reader rd(*m_vlog, gen);
+			size_t total = 0, moved = 0;
+			bool more = true;
+
+			while (more) {
+				{
+					boost::mutex::scoped_lock flush_guard(m_flush_lock);
+
+					size_t batch = 0;
+					while ((batch < m_cache_size) && (more = rd.next())) {
+						total++;
+
+						key k(rd.idx());
+						if (!vlog_live(k, gen, rd.offset()))
+							continue;
+
+						boost::mutex::scoped_lock write_guard(m_write_lock);
+
+						/* newer write has arrived meanwhile */
+						if (m_wcache.find(k) != m_wcache.end())
+							continue;
+
+						cache_insert(rd.idx(), rd.data());
+						batch++;
+					}
+
+					moved += batch;
+				}
+
+				flush();
+			}
+
+			/* moved values and the runs which point to them have to be durable before their old copies are removed */
+			m_vlog->sync();
+			{
+				boost::shared_ptr<blob_store> st;
+				{
+					boost::mutex::scoped_lock disk_guard(m_disk_lock);
+					st = current_bstore();
+				}
+
+				st->sync();
+			}
+
+			/* readers resolve pointers under m_disk_lock */
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				m_vlog->remove(gen);
+			}
+
+			log(SMACK_LOG_NOTICE, "%s: %s: value log collected: gen: %zd, records: %zd, moved: %zd\n",
+					m_path.c_str(), m_start.str(), gen, total, moved);
+		}
+
+		/* flushed write cache becomes the newest level 0 run, must be called with m_append_lock held */
+		void write_cache_to_chunks(const cache_t &cache) {
+			boost::shared_ptr<blob_store> st;
+			sorted_run r;
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				uint64_t id = m_next_run++;
+
+				r = sorted_run(id, id, 0);
+				st = current_bstore();
+			}
+
+			cache_t::const_iterator it = cache.begin();
+			size_t left = cache.size();
+			while (left) {
+				size_t size = m_cache_size;
+				if (left < m_cache_size * 1.5)
+					size = left;
+
+				write_chunk(st, r, it, size);
+				left -= size;
+			}
+
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			m_runs.insert(m_runs.begin(), r);
+			filter_add_run(r, cache);
+		}
 
-						if (++st == step) {
-							ch.rcache_add(key(&idx), off);
-							st = 0;
-						}
+		uint64_t level_target_size(int level) const {
+			uint64_t size = m_cfg.level_base_size;
+			for (int i = 1; i < level; ++i)
+				size *= m_cfg.level_multiplier;
 
-						off += sizeof(struct index) + idx.data_size;
-					}
-				}
+			return size;
+		}
 
-				log(SMACK_LOG_NOTICE, "%s: read_chunks: %zd: data-offset: %zd, "
-						"compressed-size: %zd, uncompressed-size: %zd, "
-						"num: %d, bloom-size: %d, start: %s, end: %s\n",
-						m_path_base.c_str(), chunks.size(), ctl.data_offset,
-						ctl.compressed_data_size, ctl.uncompressed_data_size,
-						ctl.num, ctl.bloom_size, ch.start().str(), ch.end().str());
+		/*
+		 * Leveled compaction: level 0 holds flushed runs, every other level holds single run
+		 * which is merged into the next level when it outgrows its target size.
+		 *
+		 * Selects contiguous range [first, last) of runs to be merged into run at @level,
+		 * single run range is only moved to @level, since there is nothing to merge it with.
+		 */
+		bool pick_leveled(size_t &first, size_t &last, int &level) const {
+			size_t l0 = 0;
+			while ((l0 < m_runs.size()) && (m_runs[l0].level() == 0))
+				l0++;
+
+			if ((int)l0 >= m_cfg.level0_runs) {
+				first = 0;
+				last = l0;
+				level = 1;
+
+				if ((last < m_runs.size()) && (m_runs[last].level() == 1))
+					last++;
 
-				if ((chunks.size() == 0) || (ch.start() >= chunks.rbegin()->second.end()))
-					chunks.insert(std::make_pair(ch.start(), ch));
-				else
-					chunks_unsorted.push_back(ch);
+				return true;
+			}
+
+			for (size_t i = l0; i < m_runs.size(); ++i) {
+				const sorted_run &r = m_runs[i];
+
+				if (r.size() <= level_target_size(r.level()))
+					continue;
+
+				first = i;
+				last = i + 1;
+				level = r.level() + 1;
+
+				if ((last < m_runs.size()) && (m_runs[last].level() == level))
+					last++;
 
-				offset += sizeof(struct chunk_ctl) + ctl.bloom_size;
+				return true;
 			}
+
+			return false;
 		}
 
-		void check_chunk_header(bio::file_source &ch_src) {
-			struct chunk_header h;
-			bio::read<bio::file_source>(ch_src, (char *)&h, sizeof(struct chunk_header));
-			if (memcmp(h.magic, SMACK_DISK_FORMAT_MAGIC, sizeof(SMACK_DISK_FORMAT_MAGIC))) {
-				log(SMACK_LOG_ERROR, "%s: smack disk format magic mismatch\n", m_path_base.c_str());
-				throw std::runtime_error("smack disk format magic mismatch");
+		/*
+		 * Size-tiered compaction: the newest runs are merged together with the older ones
+		 * while the older run is not much larger than the already selected runs.
+		 */
+		bool pick_tiered(size_t &first, size_t &last, int &level) const {
+			for (size_t i = 0; i < m_runs.size(); ++i) {
+				uint64_t size = m_runs[i].size();
+				size_t j = i + 1;
+				level = m_runs[i].level();
+
+				while ((j < m_runs.size()) && (m_runs[j].size() * 100 <= size * m_cfg.tier_size_ratio)) {
+					size += m_runs[j].size();
+					level = std::max(level, m_runs[j].level());
+					j++;
+				}
+
+				if ((int)(j - i) >= m_cfg.level0_runs) {
+					first = i;
+					last = j;
+					level++;
+					return true;
+				}
 			}
-			if (h.version != SMACK_DISK_FORMAT_VERSION) {
-				log(SMACK_LOG_ERROR, "%s: smack disk format version mismatch: stored: %d, current: %d, please convert\n",
-						m_path_base.c_str(), h.version, SMACK_DISK_FORMAT_VERSION);
-				throw std::runtime_error("smack disk format version mismatch");
+
+			/* too many runs of very different sizes, merge everything */
+			if ((int)m_runs.size() >= m_cfg.level0_runs * 4) {
+				first = 0;
+				last = m_runs.size();
+				level = m_runs.back().level() + 1;
+				return true;
 			}
+
+			return false;
 		}
-};
 
-template <class fout_t, class fin_t>
-class blob {
-	public:
-		blob(const std::string &path, int bloom_size, size_t max_cache_size) :
-		m_path(path),
-		m_cache_size(max_cache_size),
-		m_bloom_size(bloom_size),
-		m_chunk_idx(0),
-		m_want_rcache(false),
-		m_want_resort(false)
-		{
-			time_t mtime = 0;
-			ssize_t size = 0;
-			int idx = -1;
-			int num = 2;
+		/* must be called with m_disk_lock held, does not change the runs */
+		bool pick_runs(size_t &first, size_t &last, int &level) const {
+			if (m_cfg.compaction == compaction_tiered)
+				return pick_tiered(first, last, level);
 
-			for (int i = 0; i < num; ++i) {
-				struct stat st;
-				int err;
+			return pick_leveled(first, last, level);
+		}
 
-				std::string prefix = path + "." + boost::lexical_cast<std::string>(i);
+		/* part of the compaction which merges records of the single key range */
+		struct subcompaction {
+			subcompaction() : append_lock(NULL), vlog_src(NULL), vlog(NULL), want_keys(false),
+				sample_stride(0), sample_bytes(0) {}
+
+			key_range range;
+			boost::shared_ptr<blob_store> st;
+			boost::mutex *append_lock;
+			sorted_run out;
+
+			/* value logs of the input and output records */
+			value_log *vlog_src, *vlog;
+
+			/* hashes of the written keys for the blob filter */
+			bool want_keys;
+			std::vector<uint64_t> keys;
+
+			/* data of a record is sampled for the dictionary every @sample_stride bytes, 0 - never */
+			uint64_t sample_stride, sample_bytes;
+			std::vector<std::string> samples;
+
+			std::string error;
+		};
+
+		/*
+		 * Splits key space into up to m_cfg.subcompactions disjoint ranges at chunk boundaries of the runs,
+		 * so that every range gets roughly the same number of input chunks.
+		 * @split, if present, is always a range boundary.
+		 */
+		std::vector<key_range> split_ranges(std::vector<sorted_run> &runs, const key_id *split) {
+			std::vector<key_id> bounds;
+			for (std::vector<sorted_run>::iterator r = runs.begin(); r != runs.end(); ++r) {
+				for (std::map<key_id, chunk, keycomp>::iterator ch = r->chunks().begin(); ch != r->chunks().end(); ++ch)
+					bounds.push_back(ch->first);
+			}
 
-				err = stat((prefix + ".data").c_str(), &st);
-				if (err == 0) {
-					log(SMACK_LOG_NOTICE, "%s: old-idx: %d, old-mtime: %ld, old-size: %zd, mtime: %ld, size: %zd\n",
-							prefix.c_str(), idx, mtime, size, st.st_mtime, st.st_size);
-					if (st.st_mtime > mtime) {
-						mtime = st.st_mtime;
-						size = st.st_size;
-						idx = i;
-					} else if (st.st_mtime == mtime) {
-						if (st.st_size > size) {
-							idx = i;
-							mtime = st.st_mtime;
-							size = st.st_size;
-						}
-					}
-				}
+			std::sort(bounds.begin(), bounds.end(), keycomp());
+			bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
 
-				m_files.push_back(boost::shared_ptr<blob_store>(new blob_store(prefix, m_bloom_size)));
-			}
+			/* every range should have at least a couple of chunks to be worth a thread */
+			size_t num = std::min<size_t>(std::max(m_cfg.subcompactions, 1), std::max<size_t>(bounds.size() / 2, 1));
 
-			if (idx != -1) {
-				m_chunk_idx = idx;
-				fin_t in;
-				m_files[idx]->read_index<fin_t>(in, m_chunks, m_chunks_unsorted, 0);
+			std::vector<key_id> points;
+			for (size_t i = 1; i < num; ++i)
+				points.push_back(bounds[i * bounds.size() / num]);
 
-				log(SMACK_LOG_INFO, "%s: read-index: idx: %d, sorted: %zd, unsorted: %zd, num: %zd\n",
-						m_path.c_str(), idx, m_chunks.size(), m_chunks_unsorted.size(), this->num());
-			}
+			if (split)
+				points.push_back(*split);
 
-			if (m_chunks.size()) {
-				m_start = m_chunks.begin()->second.start();
+			std::sort(points.begin(), points.end(), keycomp());
+			points.erase(std::unique(points.begin(), points.end()), points.end());
+
+			std::vector<key_range> ranges(points.size() + 1);
+			for (size_t i = 0; i < points.size(); ++i) {
+				ranges[i].end = points[i];
+				ranges[i].has_end = true;
+				ranges[i + 1].start = points[i];
 			}
+
+			return ranges;
 		}
 
-		bool write(const key &key, const char *data, size_t size) {
-			boost::lock_guard<boost::mutex> guard(m_write_lock);
+		void run_subcompaction(const cache_t *cache, boost::shared_ptr<blob_store> src, std::vector<sorted_run> &runs,
+				subcompaction &sub, int flags, bool drop_removed) {
+			try {
+				record_merger merger;
+				merger.set_vlog(sub.vlog_src);
 
-			m_remove_cache.erase(key);
+				/* write cache is the newest data */
+				if (cache)
+					merger.add(boost::shared_ptr<record_source>(new cache_source(*cache, ~0ULL, sub.range)));
 
-			std::pair<typename cache_t::iterator, bool> ret =
-				m_wcache.insert(std::make_pair(key, std::string(data, size)));
-			if (!ret.second)
-				ret.first->second = std::string(data, size);
+				for (size_t i = 0; i < runs.size(); ++i)
+					merger.add(src->open_run<fin_t>(runs[i], runs.size() - i, sub.range));
 
-			return m_wcache.size() >= m_cache_size;
+				write_merged(merger, sub, flags, drop_removed);
+			} catch (const std::exception &e) {
+				sub.error = e.what();
+			}
 		}
 
-		std::string read(key &key) {
-			boost::mutex::scoped_lock guard(m_write_lock);
+		/* merges @runs (newest first) and optional @cache, every subcompaction runs in its own thread */
+		void merge_subcompactions(const cache_t *cache, boost::shared_ptr<blob_store> src, std::vector<sorted_run> &runs,
+				std::vector<subcompaction> &subs, int flags, bool drop_removed) {
+			boost::thread_group group;
 
-			/*
-			 * First, check remove cache
-			 * Write operation updates it first, so if something is here,
-			 * we remove object and do not write anything above
-			 */
-			if (m_remove_cache.find(key) != m_remove_cache.end()) {
-				std::ostringstream str;
-				str << key.str() << ": blob::read::in-removed-cache";
-				throw std::out_of_range(str.str());
+			for (size_t i = 1; i < subs.size(); ++i)
+				group.create_thread(boost::bind(&blob::run_subcompaction, this, cache, src,
+							boost::ref(runs), boost::ref(subs[i]), flags, drop_removed));
+
+			run_subcompaction(cache, src, runs, subs[0], flags, drop_removed);
+			group.join_all();
+
+			for (size_t i = 0; i < subs.size(); ++i) {
+				if (!subs[i].error.empty()) {
+					std::ostringstream str;
+					str << m_path << ": subcompaction " << i << "/" << subs.size() << " failed: " << subs[i].error;
+					throw std::runtime_error(str.str());
+				}
 			}
+		}
 
-			/*
-			 * Second, check write cache
-			 * If something is found, return it from cache
-			 */
-			cache_t::iterator it = m_wcache.find(key);
-			if (it != m_wcache.end()) {
-				struct index *idx = (struct index *)key.idx();
-				idx->data_size = it->second.size();
-				return it->second;
+		/* builds the filter over keys collected by subcompactions, NULL if it could not be built */
+		boost::shared_ptr<xor_filter> build_filter(std::vector<subcompaction> &subs, const blob_store *st) {
+			std::vector<uint64_t> keys;
+			for (size_t i = 0; i < subs.size(); ++i) {
+				if (subs[i].st.get() == st) {
+					keys.insert(keys.end(), subs[i].keys.begin(), subs[i].keys.end());
+					std::vector<uint64_t>().swap(subs[i].keys);
+				}
 			}
 
-			/*
-			 * that's a tricky place
-			 * we lock m_disk_lock to prevent modification of disk indexes
-			 * while doing lookup, but we have to lock it under m_wcache_lock
-			 * to prevent race where m_wcache can be switched with temporal map,
-			 * but not yet written to disk index
-			 */
-			boost::mutex::scoped_lock disk_guard(m_disk_lock);
-			guard.unlock();
+			boost::shared_ptr<xor_filter> filter(new xor_filter());
+			if (!filter->build(keys)) {
+				log(SMACK_LOG_ERROR, "%s: %s: could not build blob filter: keys: %zd\n",
+						m_path.c_str(), m_start.str(), keys.size());
+				filter.reset();
+			} else {
+				log(SMACK_LOG_INFO, "%s: %s: blob filter built: keys: %zd, size: %zd\n",
+						m_path.c_str(), m_start.str(), keys.size(), filter->fingerprints().size());
+			}
 
-			std::string ret;
-			bool found = false;
+			return filter;
+		}
 
-			if (m_chunks.size()) {
-				std::map<class key, chunk, keycomp>::iterator it = m_chunks.upper_bound(key);
-				if (it == m_chunks.begin()) {
-					fin_t in;
-					found = current_bstore()->chunk_read(in, key, it->second, ret);
-				} else {
-					--it;
+		/* dictionary samples are taken evenly from about @in_size bytes, their total size is a hundred dictionaries */
+		uint64_t sample_stride(uint64_t in_size) {
+			if (!m_cfg.dict_size)
+				return 0;
 
-					fin_t in;
-					found = current_bstore()->chunk_read(in, key, it->second, ret);
-					if (!found && (key > it->second.end())) {
-						++it;
+			return std::max<uint64_t>(in_size / (m_cfg.dict_size * 100), 1);
+		}
 
-						if (it != m_chunks.end()) {
-							fin_t in;
-							found = current_bstore()->chunk_read(in, key, it->second, ret);
-						}
-					}
-				}
+		void sample(subcompaction &sub, const struct index *idx, const std::string &data) {
+			if (!sub.sample_stride || (idx->flags & SMACK_INDEX_FLAGS_VLOG) || data.empty())
+				return;
 
-				if (found)
-					return ret;
+			sub.sample_bytes += data.size();
+			if (sub.sample_bytes >= sub.sample_stride) {
+				sub.sample_bytes = 0;
+				sub.samples.push_back(data);
 			}
+		}
 
-			if (!found) {
-				for (std::vector<chunk>::reverse_iterator it = m_chunks_unsorted.rbegin(); it != m_chunks_unsorted.rend(); ++it) {
-					log(SMACK_LOG_NOTICE, "%s: read key: unsorted chunk: start: %s, end: %s\n",
-							key.str(), it->start().str(), it->end().str());
-					if (key < it->start())
-						continue;
-					if (key > it->end())
-						continue;
+		/* trains the new dictionary of @st over samples collected by subcompactions, it is used by new chunks */
+		void train_dict(std::vector<subcompaction> &subs, blob_store *st) {
+			if (!m_cfg.dict_size)
+				return;
 
-					fin_t in;
-					found = current_bstore()->chunk_read(in, key, *it, ret);
-					if (found)
-						return ret;
+			std::vector<std::string> samples;
+			for (size_t i = 0; i < subs.size(); ++i) {
+				if (subs[i].st.get() == st) {
+					samples.insert(samples.end(), subs[i].samples.begin(), subs[i].samples.end());
+					std::vector<std::string>().swap(subs[i].samples);
 				}
 			}
 
-			std::ostringstream str;
-			str << key.str() << ": read: no data";
-			throw std::out_of_range(str.str());
-		}
+			boost::shared_ptr<codec_dict> dict(new codec_dict);
+			if (!codec_train(fout_t(), samples, m_cfg.dict_size, *dict))
+				return;
 
-		bool remove(const key &key) {
-			boost::mutex::scoped_lock guard(m_write_lock);
-			m_remove_cache.insert(key);
-			m_wcache.erase(key);
+			st->add_dict(dict);
 
-			return m_remove_cache.size() > m_cache_size;
+			log(SMACK_LOG_INFO, "%s: %s: dictionary trained: id: %u, size: %zd, samples: %zd\n",
+					m_path.c_str(), m_start.str(), dict->id, dict->data.size(), samples.size());
 		}
 
-		std::string lookup(key &) {
-			return std::string();
-		}
+		/*
+		 * Merges contiguous range of runs into the new run which replaces them.
+		 * Flushes may add new level 0 runs meanwhile, they only go in front of the merged range.
+		 *
+		 * When all runs are merged (@full) the blob filter is rebuilt over the merged keys,
+		 * and if the data file has no dictionary yet it is trained. Dictionary is retrained
+		 * when the data file is rewritten, chunks of the older ones stay in this file till then.
+		 */
+		void merge_runs(std::vector<sorted_run> &inputs, int level, bool bottom, bool full) {
+			boost::shared_ptr<blob_store> st;
+			uint64_t seq = 0;
+			uint64_t in_size = 0;
+
+			for (size_t i = 0; i < inputs.size(); ++i) {
+				seq = std::max(seq, inputs[i].seq());
+				in_size += inputs[i].size();
+			}
 
-		key &start() {
-			return m_start;
-		}
+			/* merged run takes place of the newest input to keep runs order */
+			sorted_run out;
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				out = sorted_run(m_next_run++, seq, level);
+				st = current_bstore();
+			}
 
-		bool write_cache() {
-			boost::mutex::scoped_lock write_guard(m_write_lock);
+			uint64_t stride = (full && !st->codec().dict) ? sample_stride(in_size) : 0;
+
+			std::vector<key_range> ranges = split_ranges(inputs, NULL);
+			std::vector<subcompaction> subs(ranges.size());
+			for (size_t i = 0; i < subs.size(); ++i) {
+				subs[i].range = ranges[i];
+				subs[i].st = st;
+				subs[i].append_lock = &m_append_lock;
+				subs[i].out = out;
+				subs[i].vlog_src = m_vlog.get();
+				subs[i].vlog = m_vlog.get();
+				subs[i].want_keys = full;
+				subs[i].sample_stride = stride;
+			}
 
-			cache_t tmp;
-			m_wcache.swap(tmp);
-			write_guard.unlock();
+			/* tombstones and expired records have nothing left to hide when the oldest run is merged */
+			merge_subcompactions(NULL, st, inputs, subs, SMACK_CHUNK_FLAGS_PENDING, bottom);
 
-			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			for (size_t i = 0; i < subs.size(); ++i)
+				stitch(out, subs[i].out);
 
-			if ((m_chunks_unsorted.size() > 50) || m_split_dst || m_want_resort) {
-				m_want_resort = false;
-				m_want_rcache = false;
+			boost::shared_ptr<xor_filter> filter;
+			if (full)
+				filter = build_filter(subs, st.get());
+			if (stride)
+				train_dict(subs, st.get());
 
-				chunks_resort(tmp);
+			boost::mutex::scoped_lock append_guard(m_append_lock);
+			for (size_t i = 0; i < inputs.size(); ++i)
+				st->store_run_marker(SMACK_CHUNK_FLAGS_DROP, inputs[i].id(), out.id());
+			st->store_run_marker(SMACK_CHUNK_FLAGS_COMMIT, out.id(), out.seq());
+			store_vlog_garbage(st, false);
 
-				if (m_split_dst) {
-					write_guard.lock();
-					/*
-					 * check if someone added data into wcache while we processed data on disk
-					 * write cache lock is still being held
-					 */
-					cache_t::iterator wcache_split_it = m_wcache.lower_bound(m_split_dst->start());
-					for (cache_t::iterator it = wcache_split_it; it != m_wcache.end(); ++it)
-						m_split_dst->write(it->first, it->second.data(), it->second.size());
+			/* older filter still covers the merged run if we crash before the new one is stored */
+			if (filter)
+				st->store_filter(*filter, out.seq());
 
-					m_wcache.erase(wcache_split_it, m_wcache.end());
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
 
-					m_split_dst.reset();
-				}
-			} else {
-				if (m_want_rcache) {
-					fin_t in;
+			size_t first = 0;
+			while ((first < m_runs.size()) && (m_runs[first].id() != inputs[0].id()))
+				first++;
 
-					m_chunks.clear();
-					m_chunks_unsorted.clear();
-					current_bstore()->read_index(in, m_chunks, m_chunks_unsorted,
-							m_cache_size * sizeof(key) / smack_rcache_mult);
-					m_want_rcache = false;
-				}
-				
-				if (tmp.size())
-					write_cache_to_chunks(tmp, false);
-			}
+			/* merged run has no keys which are not in its inputs */
+			bool covered = true;
+			for (size_t i = 0; i < inputs.size(); ++i)
+				covered = covered && filter_covers(inputs[i]);
 
-			return m_wcache.size() >= m_cache_size;
-		}
+			m_runs.erase(m_runs.begin() + first, m_runs.begin() + first + inputs.size());
+			if (!out.empty())
+				m_runs.insert(m_runs.begin() + first, out);
 
-		/* returns current number of records and data size on disk */
-		void disk_stat(size_t &num, size_t &data_size, bool &have_split) {
-			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			if (filter)
+				set_filter(filter, out.seq());
+			else if (covered && !filter_covers(out))
+				m_dyn_runs.insert(out.id());
 
-			have_split = false;
-			if (m_split_dst)
-				have_split = true;
+			for (size_t i = 0; i < inputs.size(); ++i)
+				m_dyn_runs.erase(inputs[i].id());
 
-			num = this->num() + m_wcache.size();
-			current_bstore()->size(data_size);
+			log(SMACK_LOG_NOTICE, "%s: %s: runs merged: %zd runs [%zd, %zd) -> run: %zd, level: %d, "
+					"size: %zd -> %zd, num: %zd, subcompactions: %zd\n",
+					m_path.c_str(), m_start.str(), inputs.size(), first, first + inputs.size(), out.id(), level,
+					in_size, out.size(), out.num(), subs.size());
 		}
 
-		void set_split_dst(boost::shared_ptr<blob<fout_t, fin_t> > dst) {
+		/*
+		 * Moves the run to @level without rewriting its data: chunk meta is stored again as the new run,
+		 * which replaces the old one with the same drop and commit markers as the merged runs,
+		 * so the level survives reopen.
+		 */
+		void promote_run(const sorted_run &in, int level) {
+			boost::shared_ptr<blob_store> st;
+			sorted_run out;
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				out = sorted_run(m_next_run++, in.seq(), level);
+				st = current_bstore();
+			}
+
+			{
+				boost::mutex::scoped_lock append_guard(m_append_lock);
+
+				for (std::map<key_id, chunk, keycomp>::const_iterator it = in.chunks().begin(); it != in.chunks().end(); ++it)
+					out.add(st->move_chunk(it->second, out));
+
+				st->store_run_marker(SMACK_CHUNK_FLAGS_DROP, in.id(), out.id());
+				st->store_run_marker(SMACK_CHUNK_FLAGS_COMMIT, out.id(), out.seq());
+			}
+
 			boost::mutex::scoped_lock disk_guard(m_disk_lock);
-			if (m_split_dst)
-				return;
 
-			m_split_dst = dst;
-			m_split_dst->start().set(m_last_average_key.idx());
+			for (size_t i = 0; i < m_runs.size(); ++i) {
+				if (m_runs[i].id() == in.id()) {
+					m_runs[i] = out;
+					break;
+				}
+			}
+
+			if (m_dyn_runs.erase(in.id()))
+				m_dyn_runs.insert(out.id());
+
+			log(SMACK_LOG_NOTICE, "%s: %s: run promoted: run: %zd -> %zd, level: %d -> %d, size: %zd\n",
+					m_path.c_str(), m_start.str(), in.id(), out.id(), in.level(), level, out.size());
 		}
 
-		size_t have_unsorted_chunks() {
-			return m_chunks_unsorted.size();
+		/* adds chunks written by subcompaction to the run */
+		void stitch(sorted_run &out, sorted_run &part) {
+			for (std::map<key_id, chunk, keycomp>::iterator ch = part.chunks().begin(); ch != part.chunks().end(); ++ch)
+				out.add(ch->second);
 		}
 
-		void set_want_rcache(bool want_rcache) {
-			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+		/* chunks are compressed without any lock, only appending them to the data file is serialized */
+		void write_merged(record_merger &merger, subcompaction &sub, int flags, bool drop_removed) {
+			size_t max_rcache_size = m_cache_size * sizeof(struct index) / smack_rcache_mult;
+			boost::shared_ptr<blob_store::chunk_writer<fout_t> > writer;
+			time_t now = time(NULL);
 
-			m_want_rcache = want_rcache;
-		}
+			while (merger.next()) {
+				const struct index *idx = merger.current().idx();
+				bool dead = record_dead(idx, now);
 
-		void set_want_resort(bool want_resort) {
-			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				if (dead && drop_removed) {
+					sub.vlog_src->release(idx, merger.data());
+					continue;
+				}
 
-			m_want_resort = want_resort;
+				if (!writer)
+					writer.reset(new blob_store::chunk_writer<fout_t>(*sub.st, sub.out, flags,
+								m_cache_size, max_rcache_size));
+
+				/* expired record still has to hide older copies, but its data is not needed anymore */
+				if (dead && !(idx->flags & SMACK_INDEX_FLAGS_REMOVED)) {
+					struct index tomb = *idx;
+					tomb.flags |= SMACK_INDEX_FLAGS_REMOVED;
+					tomb.flags &= ~SMACK_INDEX_FLAGS_VLOG;
+					tomb.data_size = 0;
+
+					sub.vlog_src->release(idx, merger.data());
+					writer->write(key(&tomb), std::string());
+				} else {
+					write_record(*writer, merger.current(), merger.data(), sub.vlog_src, sub.vlog);
+					sample(sub, idx, merger.data());
+				}
+
+				if (sub.want_keys)
+					sub.keys.push_back(xor_filter::hash((char *)idx->id, SMACK_INDEX_KEY_SIZE(idx->flags)));
+
+				if (writer->num() == m_cache_size) {
+					boost::mutex::scoped_lock append_guard(*sub.append_lock);
+					sub.out.add(writer->finish());
+					writer.reset();
+				}
+			}
+
+			if (writer) {
+				boost::mutex::scoped_lock append_guard(*sub.append_lock);
+				sub.out.add(writer->finish());
+			}
 		}
 
-	private:
-		key m_start;
-		boost::mutex m_write_lock;
-		boost::mutex m_disk_lock;
-		boost::condition m_cond;
-		cache_t m_wcache;
-		std::set<key, keycomp> m_remove_cache;
-		std::string m_path;
-		size_t m_cache_size;
-		size_t m_bloom_size;
-		int m_chunk_idx;
-		boost::shared_ptr<blob<fout_t, fin_t> > m_split_dst;
+		/* copies live runs into the alternate data file and drops the old one */
+		void relocate() {
+			boost::mutex::scoped_lock append_guard(m_append_lock);
 
-		std::vector<boost::shared_ptr<blob_store> > m_files;
-		std::map<key, chunk, keycomp> m_chunks;
-		std::vector<chunk> m_chunks_unsorted;
+			boost::shared_ptr<blob_store> src;
+			std::vector<sorted_run> runs;
+			boost::shared_ptr<xor_filter> filter;
+			uint64_t filter_seq;
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				src = current_bstore();
+				runs = m_runs;
+				filter = m_filter;
+				filter_seq = m_filter_seq;
+			}
 
-		key m_last_average_key;
-		bool m_want_rcache, m_want_resort;
+			int idx = (m_chunk_idx + 1) % m_files.size();
+			boost::shared_ptr<blob_store> dst = m_files[idx];
+			dst->truncate();
+			dst->import_dicts(*src, true);
 
-		size_t num() {
-			size_t num = 0;
-			for (std::map<key, chunk, keycomp>::iterator it = m_chunks.begin(); it != m_chunks.end(); ++it)
-				num += it->second.ctl()->num;
+			/* runs keep their sequence numbers, so the filter is valid for the new file too */
+			if (filter && filter_seq)
+				dst->store_filter(*filter, filter_seq);
 
-			for (std::vector<chunk>::iterator it = m_chunks_unsorted.begin(); it != m_chunks_unsorted.end(); ++it)
-				num += it->ctl()->num;
+			for (std::vector<sorted_run>::iterator it = runs.begin(); it != runs.end(); ++it) {
+				sorted_run r(it->id(), it->seq(), it->level());
 
-			return num;
-		}
+				for (std::map<key_id, chunk, keycomp>::iterator ch = it->chunks().begin(); ch != it->chunks().end(); ++ch)
+					r.add(dst->copy_chunk(*src, ch->second, r));
 
-		boost::shared_ptr<blob_store> current_bstore(void) {
-			return m_files[m_chunk_idx];
+				*it = r;
+			}
+
+			store_vlog_garbage(dst, true);
+			dst->sync();
+
+			boost::mutex::scoped_lock disk_guard(m_disk_lock);
+			m_runs.swap(runs);
+			m_chunk_idx = idx;
+
+			/* new generation becomes active at the next start, the old one is not needed anymore */
+			write_manifest();
+			src->truncate();
+
+			size_t data_size;
+			current_bstore()->size(data_size);
+			log(SMACK_LOG_NOTICE, "%s: %s: runs relocated: idx: %d, runs: %zd, data-size: %zd\n",
+					m_path.c_str(), m_start.str(), m_chunk_idx, m_runs.size(), data_size);
 		}
 
-		void write_chunk(cache_t &cache, size_t num, bool sorted) {
-			int average = cache.size() / 2;
-			for (cache_t::iterator it = cache.begin(); it != cache.end(); ++it) {
-				if (--average == 0) {
-					m_last_average_key = it->first;
-					break;
+		/*
+		 * Merges write cache with all runs into the single run in the alternate data file.
+		 * Runs are streamed record by record, so memory usage does not depend on blob size.
+		 *
+		 * Split part goes to the new blob, so flushes of this blob wait until the whole data is moved.
+		 */
+		void chunks_resort() {
+			/* split part is added to the index of the new blob, which must be loaded before */
+			{
+				boost::shared_ptr<blob<fout_t, fin_t> > split_dst;
+				{
+					boost::mutex::scoped_lock disk_guard(m_disk_lock);
+					split_dst = m_split_dst;
 				}
+
+				if (split_dst)
+					split_dst->load();
 			}
 
-			fout_t out;
-			chunk ch = current_bstore()->store_chunk(out, cache, num, m_cache_size * sizeof(key) / smack_rcache_mult);
-			if (sorted) {
-				m_chunks.insert(std::make_pair(ch.start(), ch));
-			} else {
-				m_chunks_unsorted.push_back(ch);
+			boost::mutex::scoped_lock flush_guard(m_flush_lock);
+
+			boost::mutex::scoped_lock write_guard(m_write_lock);
+			m_imm.swap(m_wcache);
+			m_wcache_bytes = 0;
+			write_guard.unlock();
+
+			boost::mutex::scoped_lock append_guard(m_append_lock);
+
+			boost::shared_ptr<blob_store> src;
+			boost::shared_ptr<blob<fout_t, fin_t> > split_dst;
+			std::vector<sorted_run> runs;
+			sorted_run out;
+			int level = 1;
+			bool drop_removed;
+
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
+				src = current_bstore();
+				split_dst = m_split_dst;
+				runs = m_runs;
+				drop_removed = !m_split_incoming;
+
+				for (size_t i = 0; i < runs.size(); ++i)
+					level = std::max(level, runs[i].level());
+
+				uint64_t id = m_next_run++;
+				out = sorted_run(id, id, level);
 			}
-		}
 
-		void write_cache_to_chunks(cache_t &cache, bool sorted) {
-			while (cache.size()) {
-				size_t size = m_cache_size;
-				if (cache.size() < m_cache_size * 1.5)
-					size = cache.size();
+			int idx = (m_chunk_idx + 1) % m_files.size();
+			boost::shared_ptr<blob_store> dst = m_files[idx];
+
+			/* truncate new data files, everything is recompressed with the current dictionary till the new one is trained */
+			dst->truncate();
+
+			codec_params src_codec = src->codec();
+			if (m_cfg.dict_size && src_codec.dict)
+				dst->add_dict(src_codec.dict);
 
-				write_chunk(cache, size, sorted);
+			uint64_t in_size = 0;
+			for (size_t i = 0; i < runs.size(); ++i)
+				in_size += runs[i].size();
+
+			/* split destination data file must not be appended by its own flush while we write into it */
+			boost::scoped_ptr<boost::mutex::scoped_lock> split_guard;
+
+			/* split part becomes the oldest run of the destination blob, it may already have newer writes */
+			sorted_run split_out;
+			if (split_dst) {
+				split_guard.reset(new boost::mutex::scoped_lock(split_dst->m_append_lock));
+
+				boost::mutex::scoped_lock dst_disk_guard(split_dst->m_disk_lock);
+				split_out = sorted_run(split_dst->m_next_run++, 0, level);
 			}
-		}
 
-		void chunks_resort(cache_t &cache) {
-			for (std::vector<chunk>::reverse_iterator it = m_chunks_unsorted.rbegin(); it != m_chunks_unsorted.rend(); ++it) {
-				fin_t in;
-				current_bstore()->read_chunk(in, *it, cache);
+			/* both output files are exclusively ours, locks only serialize subcompactions */
+			boost::mutex dst_lock, split_lock;
+
+			/* split key is a range boundary, so every range goes either to this blob or to the new one */
+			std::vector<key_range> ranges = split_ranges(runs, split_dst ? &split_dst->start() : NULL);
+			std::vector<subcompaction> subs(ranges.size());
+			for (size_t i = 0; i < subs.size(); ++i) {
+				subs[i].range = ranges[i];
+
+				subs[i].vlog_src = m_vlog.get();
+
+				if (split_dst && (ranges[i].start >= split_dst->start())) {
+					subs[i].st = split_dst->current_bstore();
+					subs[i].append_lock = &split_lock;
+					subs[i].out = split_out;
+					subs[i].vlog = split_dst->m_vlog.get();
+				} else {
+					subs[i].st = dst;
+					subs[i].append_lock = &dst_lock;
+					subs[i].out = out;
+					subs[i].vlog = m_vlog.get();
+					subs[i].want_keys = true;
+					subs[i].sample_stride = sample_stride(in_size);
+				}
 			}
-			m_chunks_unsorted.erase(m_chunks_unsorted.begin(), m_chunks_unsorted.end());
 
-			/* always resort all chunks and try to drop old copy from page cache */
-			for (std::map<key, chunk, keycomp>::iterator it = m_chunks.begin(); it != m_chunks.end(); ++it) {
-				fin_t in;
-				current_bstore()->read_chunk(in, it->second, cache);
+			/* everything is merged, removed and expired keys are not present in any older run */
+			merge_subcompactions(&m_imm, src, runs, subs, 0, drop_removed);
+
+			for (size_t i = 0; i < subs.size(); ++i) {
+				if (subs[i].st == dst)
+					stitch(out, subs[i].out);
+				else
+					stitch(split_out, subs[i].out);
 			}
 
-			m_chunks.erase(m_chunks.begin(), m_chunks.end());
-			current_bstore()->forget();
+			store_vlog_garbage(dst, true);
 
-			boost::shared_ptr<blob_store> src = current_bstore();
+			boost::shared_ptr<xor_filter> filter = build_filter(subs, dst.get());
+			if (filter)
+				dst->store_filter(*filter, out.seq());
+			train_dict(subs, dst.get());
 
-			if (++m_chunk_idx >= (int)m_files.size())
-				m_chunk_idx = 0;
+			dst->sync();
+			if (split_dst)
+				split_dst->current_bstore()->sync();
 
-			/* truncate new data files */
-			current_bstore()->truncate();
+			{
+				boost::mutex::scoped_lock disk_guard(m_disk_lock);
 
-			/* split cache if m_split_dst is set, this will cut part of the cache which is >= than m_split_dst->start() */
-			if (m_split_dst)
-				split(m_split_dst->start(), cache);
+				m_runs.clear();
+				if (!out.empty())
+					m_runs.push_back(out);
 
-			write_cache_to_chunks(cache, true);
+				m_chunk_idx = idx;
+				m_want_resort = false;
+				m_split_dst.reset();
+				set_filter(filter, out.seq());
 
-			size_t data_size;
-			current_bstore()->size(data_size);
-			log(SMACK_LOG_NOTICE, "%s: %s: chunks resorted: idx: %d, chunks: %zd, data-size: %zd, split: %s\n",
-					m_path.c_str(), m_start.str(), m_chunk_idx, m_chunks.size(),
-					data_size, m_split_dst ? m_split_dst->start().str() : "none");
-		}
+				/*
+				 * New generation becomes active at the next start, the old one is not needed anymore.
+				 * If we crash before the split destination is updated, split is restarted and moves nothing.
+				 */
+				write_manifest();
+				src->truncate();
 
-		void split(const key &key, cache_t &cache) {
-			size_t orig_size = cache.size();
+				if (split_dst) {
+					boost::mutex::scoped_lock dst_disk_guard(split_dst->m_disk_lock);
 
-			cache_t::iterator split_it = cache.lower_bound(key);
-			for (cache_t::iterator it = split_it; it != cache.end(); ++it)
-				m_split_dst->write(it->first, it->second.data(), it->second.size());
+					if (!split_out.empty()) {
+						split_dst->m_runs.push_back(split_out);
+						std::sort(split_dst->m_runs.begin(), split_dst->m_runs.end(), sorted_run_comp());
 
-			cache.erase(split_it, cache.end());
+						/* split part has the oldest sequence number, which would be hidden by any filter */
+						split_dst->set_filter(boost::shared_ptr<xor_filter>(), 0);
+						split_dst->current_bstore()->remove_filter();
+					}
+					split_dst->m_split_incoming = false;
+					split_dst->m_split_src = NULL;
+					split_dst->write_manifest();
 
-			log(SMACK_LOG_NOTICE, "%s: split to new blob: %zd entries, old blob: %zd entries\n",
-					key.str(), orig_size - cache.size(), cache.size());
-		}
+					log(SMACK_LOG_NOTICE, "%s: split to new blob: %zd entries, old blob: %zd entries\n",
+							split_dst->start().str(), split_out.num(), this->num());
+				}
+
+				size_t data_size;
+				current_bstore()->size(data_size);
+				log(SMACK_LOG_NOTICE, "%s: %s: chunks resorted: idx: %d, runs: %zd, data-size: %zd, split: %s\n",
+						m_path.c_str(), m_start.str(), m_chunk_idx, m_runs.size(),
+						data_size, split_dst ? split_dst->start().str() : "none");
+			}
+
+			split_guard.reset();
+			append_guard.unlock();
+
+			write_guard.lock();
+			m_imm.clear();
+
+			if (split_dst) {
+				/* someone could add data for the new blob into write cache while we processed data on disk */
+				cache_t::iterator wcache_split_it = m_wcache.lower_bound(split_dst->start());
+				for (cache_t::iterator it = wcache_split_it; it != m_wcache.end(); ++it) {
+					m_wcache_bytes -= it->second.data.size() + sizeof(struct index);
 
+					boost::mutex::scoped_lock dst_guard(split_dst->m_write_lock);
+					split_dst->cache_insert(it->first, it->second);
+				}
+
+				m_wcache.erase(wcache_split_it, m_wcache.end());
+			}
+		}
 };
 
 }}
@@ -0,0 +1,180 @@
+#ifndef __SMACK_CODEC_HPP
+#define __SMACK_CODEC_HPP
+
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <smack/base.hpp>
+
+namespace ioremap { namespace smack {
+
+/*
+ * Compression dictionary trained from blob records.
+ * Codec keeps its prepared form of the dictionary in @state, it is built on the first use.
+ */
+struct codec_dict {
+	codec_dict() : id(0) {}
+
+	uint32_t		id;
+	std::string		data;
+
+	boost::mutex		lock;
+	boost::shared_ptr<void>	cstate, dstate;
+};
+
+typedef std::map<uint32_t, boost::shared_ptr<codec_dict> > codec_dicts_t;
+
+/* settings of the blob store codec, codecs without levels or dictionaries ignore them */
+struct codec_params {
+	codec_params() : level(0), min_gain(12) {}
+
+	int					level;		/* 0 - codec default */
+	int					min_gain;	/* percent of the chunk size codec has to save, negative - always compress */
+	boost::shared_ptr<codec_dict>		dict;		/* new chunks are compressed with it, if set */
+	boost::shared_ptr<const codec_dicts_t>	dicts;		/* every dictionary chunks of the store may use */
+};
+
+/*
+ * Codec which compressed the chunk, stored in its control structure.
+ * Chunks written before codec IDs were stored have SMACK_CODEC_UNKNOWN and are decoded with the blob codec.
+ */
+#define SMACK_CODEC_UNKNOWN			0
+#define SMACK_CODEC_ZLIB			1
+#define SMACK_CODEC_BZIP2			2
+#define SMACK_CODEC_SNAPPY			3
+#define SMACK_CODEC_LZ4				4
+#define SMACK_CODEC_ZSTD			5
+#define SMACK_CODEC_NUM				6
+
+/* ID of the codec filter type, compressor and decompressor of the same format share it */
+template <class T>
+struct codec_traits {
+	static const int id = SMACK_CODEC_UNKNOWN;
+};
+
+#define SMACK_CODEC_TRAITS(type, codec_id) \
+	template <> struct codec_traits<type> { static const int id = codec_id; }
+
+/* decompresses the whole chunk section, @out holds at least its first @want bytes */
+typedef void (*codec_decoder)(const codec_params &, const char *data, size_t size, size_t want, std::string &out);
+
+/* decoders of the codecs known to the program indexed by codec ID, chunks of other codecs are decoded with them */
+inline codec_decoder *codec_decoders()
+{
+	static codec_decoder decoders[SMACK_CODEC_NUM];
+	return decoders;
+}
+
+/* codecs which support settings overload this in their namespace */
+template <class T>
+inline void codec_setup(T &, const codec_params &)
+{
+}
+
+/* codecs which support dictionaries overload this, false if there is no dictionary */
+template <class T>
+inline bool codec_train(const T &, const std::vector<std::string> &, size_t, codec_dict &)
+{
+	return false;
+}
+
+/*
+ * Codecs which compress the whole chunk at once overload these in their namespace,
+ * chunks are then written and read without filter chains and their intermediate buffers.
+ * Block output has to be readable by the stream filter and vice versa.
+ * codec_block() is called with a null pointer of the filter type.
+ */
+template <class T>
+inline bool codec_block(const T *)
+{
+	return false;
+}
+
+/* appends compressed @size bytes of @data to @out */
+template <class T>
+inline void codec_compress(T &, const char *, size_t, std::string &)
+{
+	throw std::runtime_error("codec does not support block compression");
+}
+
+/* replaces @out with the decompressed data, throws on corrupted input */
+template <class T>
+inline void codec_decompress(T &, const char *, size_t, std::string &)
+{
+	throw std::runtime_error("codec does not support block decompression");
+}
+
+/*
+ * Codecs which can stop early overload this, @out holds at least the first @want bytes of the data then.
+ * Point reads only need records up to the one they look for.
+ */
+template <class T>
+inline void codec_decompress_partial(T &t, const char *data, size_t size, size_t, std::string &out)
+{
+	codec_decompress(t, data, size, out);
+}
+
+/*
+ * Per-thread cache of codec filters, constructing one allocates its buffers and codec context.
+ * Filters are pushed into chains with boost::ref(), closing the chain resets them for the next user.
+ */
+template <class T>
+class codec_pool {
+	public:
+		/* filter goes back to the pool of the thread which drops the last reference */
+		static boost::shared_ptr<T> get(const codec_params &p) {
+			free_list *l = list();
+
+			T *t;
+			if (l->filters.empty()) {
+				t = new T();
+			} else {
+				t = l->filters.back();
+				l->filters.pop_back();
+			}
+
+			boost::shared_ptr<T> ret(t, put);
+			codec_setup(*t, p);
+			return ret;
+		}
+
+	private:
+		/* merge keeps a filter per input run open */
+		static const size_t max_free = 16;
+
+		struct free_list {
+			std::vector<T *> filters;
+
+			~free_list() {
+				for (size_t i = 0; i < filters.size(); ++i)
+					delete filters[i];
+			}
+		};
+
+		static free_list *list() {
+			static boost::thread_specific_ptr<free_list> lists;
+
+			if (!lists.get())
+				lists.reset(new free_list);
+			return lists.get();
+		}
+
+		static void put(T *t) {
+			free_list *l = list();
+
+			if (l->filters.size() < max_free)
+				l->filters.push_back(t);
+			else
+				delete t;
+		}
+};
+
+}}
+
+#endif /* __SMACK_CODEC_HPP */
@@ -94,6 +94,89 @@ LZ4_uncompress_unknownOutputSize() :
 */
 
 
+int LZ4_decompress_safe (const char* source, char* dest, int isize, int maxOutputSize);
+int LZ4_decompress_safe_partial (const char* source, char* dest, int isize, int targetOutputSize, int maxOutputSize);
+
+/*
+LZ4_decompress_safe() :
+	isize  : is the input size, therefore the compressed size
+	maxOutputSize : is the size of the destination buffer (which must be already allocated)
+	return : the number of bytes decoded in the destination buffer (necessarily <= maxOutputSize)
+			 If the source stream is malformed or does not fit the destination buffer, the function returns a negative result
+			 It never reads outside of the input buffer nor writes outside of the output one, whatever the input is
+	note   : LZ4_uncompress_unknownOutputSize() is the older name of this function
+
+LZ4_decompress_safe_partial() :
+	The same as LZ4_decompress_safe(), but decoding stops as soon as at least targetOutputSize bytes are decoded.
+	Useful to read the beginning of a block without paying for the rest of it.
+	return : the number of bytes decoded, it is >= targetOutputSize unless the whole block is shorter
+			 Bytes of the destination buffer past the returned size are undefined
+*/
+
+
+int LZ4_compress_fast (const char* source, char* dest, int isize, int maxOutputSize, int acceleration);
+int LZ4_compress_default (const char* source, char* dest, int isize, int maxOutputSize);
+
+/*
+LZ4_compress_fast() :
+	acceleration : 1 is the default, every step above it searches for matches less thoroughly,
+				   trading compression ratio for speed
+	return : the number of bytes written in buffer dest
+			 or 0 if the compressed data does not fit into maxOutputSize bytes
+	note : output is limited by maxOutputSize, LZ4_compressBound() is always enough
+LZ4_compress_default() :
+	LZ4_compress_fast() with acceleration 1.
+*/
+
+
+//****************************
+// Streaming and dictionary
+//****************************
+
+typedef struct LZ4_stream_s LZ4_stream_t;
+
+LZ4_stream_t* LZ4_createStream (void);
+int LZ4_freeStream (LZ4_stream_t* stream);
+void LZ4_resetStream (LZ4_stream_t* stream);
+
+int LZ4_loadDict (LZ4_stream_t* stream, const char* dictionary, int dictSize);
+void LZ4_attach_dictionary (LZ4_stream_t* working, const LZ4_stream_t* dictionaryStream);
+int LZ4_compress_fast_continue (LZ4_stream_t* stream, const char* source, char* dest, int isize, int maxOutputSize, int acceleration);
+int LZ4_saveDict (LZ4_stream_t* stream, char* safeBuffer, int maxDictSize);
+
+/*
+Stream state holds the hash table and the dictionary, blocks of the stream may reference up to 64KB of data before them.
+
+LZ4_loadDict() :
+	Resets the stream and makes the last 64KB of dictionary the history of the next block.
+	return : the number of dictionary bytes used
+LZ4_attach_dictionary() :
+	Makes working stream a copy of dictionaryStream prepared by LZ4_loadDict(), which is much cheaper than loading the dictionary again.
+	The same prepared stream may be attached by any number of threads. A NULL dictionaryStream resets the working stream.
+LZ4_compress_fast_continue() :
+	Compresses the next block, it may reference the dictionary or the previous block, which both have to stay
+	at the same address in memory (or be saved by LZ4_saveDict()).
+	return : the same as LZ4_compress_fast(), stream has to be reset if compression failed
+LZ4_saveDict() :
+	Copies up to maxDictSize last bytes of the stream history into safeBuffer, so the previous block may be released.
+	return : the number of bytes saved
+*/
+
+
+int LZ4_decompress_safe_usingDict (const char* source, char* dest, int isize, int maxOutputSize,
+		const char* dictStart, int dictSize);
+int LZ4_decompress_safe_partial_usingDict (const char* source, char* dest, int isize, int targetOutputSize, int maxOutputSize,
+		const char* dictStart, int dictSize);
+
+/*
+LZ4_decompress_safe_usingDict() :
+	Decodes a block compressed with the dictionary or as the next block of a stream,
+	in the latter case dictStart is the previous decoded block (it may end right where dest starts).
+LZ4_decompress_safe_partial_usingDict() :
+	Both of the above, decoding stops once at least targetOutputSize bytes are decoded.
+*/
+
+
 int LZ4_compressCtx(void** ctx, const char* source,  char* dest, int isize);
 int LZ4_compress64kCtx(void** ctx, const char* source,  char* dest, int isize);
 
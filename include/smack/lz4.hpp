@@ -2,6 +2,7 @@
 #define __LZ4_HPP
 
 #include <algorithm>
+#include <sstream>
 #include <vector>
 
 #include <iosfwd>                       // streamsize
@@ -12,6 +13,7 @@
 #include <smack/lz4.h>
 #include <smack/lz4hc.h>
 #include <smack/base.hpp>
+#include <smack/codec.hpp>
 
 namespace bio = boost::iostreams;
 
@@ -34,6 +36,18 @@ struct header {
 	int32_t		uncompressed_size;
 };
 
+/*
+ * Frame without data which carries only ID of the dictionary the following frames are compressed with.
+ * Other frames are never empty, and older readers fail on it instead of returning garbage.
+ */
+static inline bool dict_frame(const struct header &header)
+{
+	return (header.uncompressed_size == 0) && (header.compressed_size == sizeof(uint32_t));
+}
+
+/* LZ4 only looks 64KB back, so the dictionary is the last 64KB of the trained data at most */
+static const size_t max_dict_size = 64 * 1024;
+
 class decompressor : public bio::multichar_input_filter {
 	public:
 		explicit decompressor(size_t chunk_size = 1024 * 1024) :
@@ -43,6 +57,11 @@ class decompressor : public bio::multichar_input_filter {
 		{
 		}
 
+		void setup(const codec_params &p) {
+			m_dicts = p.dicts;
+			m_dict.reset();
+		}
+
 		template<typename Source>
 		std::streamsize read(Source& src, char *s, std::streamsize n) {
 			std::streamsize total = 0;
@@ -74,19 +93,14 @@ class decompressor : public bio::multichar_input_filter {
 					break;
 				}
 
-				m_dec.resize(header.uncompressed_size);
-				int consumed = LZ4_uncompress(m_chunk.data(), (char *)m_dec.data(), header.uncompressed_size);
-				if (consumed < 0)
-					return -1;
-
-				if (consumed > header.compressed_size) {
-					log(SMACK_LOG_ERROR, "lz4: decompression header: compressed: %d, "
-							"uncompressed: %d, consumed: %d\n",
-							header.compressed_size, header.uncompressed_size, consumed);
-					throw std::runtime_error("lz4: decompression header mismatch");
+				if (dict_frame(header)) {
+					select_dict(m_chunk.data());
+					continue;
 				}
 
-				log(SMACK_LOG_DEBUG, "lz4: decompress: read: %zd, consumed: %d -> %d\n", have, consumed, header.uncompressed_size);
+				m_dec.resize(header.uncompressed_size);
+				if (decompress_frame(m_chunk.data(), have, m_dec.data(), header.uncompressed_size, header.uncompressed_size) < 0)
+					return -1;
 
 				m_dec_offset = 0;
 				s_state = s_have_data;
@@ -102,14 +116,105 @@ class decompressor : public bio::multichar_input_filter {
 		template<typename Source>
 		void close(Source &) {
 			s_state = s_start;
+			m_dict.reset();
+		}
+
+		/*
+		 * Decompresses frames of @data straight into @out until at least @want bytes are there,
+		 * @out is cut right after the last decoded byte.
+		 */
+		void decompress_block(const char *data, size_t size, std::string &out, size_t want = ~(size_t)0) {
+			size_t total = 0;
+			for (size_t pos = 0; (pos < size) && (total < want); ) {
+				struct header header = frame(data, size, pos);
+
+				total += header.uncompressed_size;
+				pos += sizeof(struct header) + header.compressed_size;
+			}
+
+			out.resize(total);
+			m_dict.reset();
+
+			size_t offset = 0;
+			for (size_t pos = 0; (pos < size) && (offset < want); ) {
+				struct header header = frame(data, size, pos);
+				const char *src = data + pos + sizeof(struct header);
+
+				pos += sizeof(struct header) + header.compressed_size;
+
+				if (dict_frame(header)) {
+					select_dict(src);
+					continue;
+				}
+
+				int ret = decompress_frame(src, header.compressed_size, (char *)out.data() + offset,
+						header.uncompressed_size, std::min<size_t>(header.uncompressed_size, want - offset));
+				if (ret < 0)
+					throw std::runtime_error("lz4: corrupted frame");
+
+				offset += ret;
+			}
+
+			out.resize(offset);
+			m_dict.reset();
 		}
 
 	private:
-		int (* m_uncompress_function)(const char* source, char* dest, int osize);
 		state s_state;
 		std::vector<char> m_chunk;
 		std::vector<char> m_dec;
 		std::streamsize m_dec_offset;
+		boost::shared_ptr<const codec_dicts_t> m_dicts;
+		boost::shared_ptr<codec_dict> m_dict;
+
+		static struct header frame(const char *data, size_t size, size_t pos) {
+			struct header header;
+
+			if (pos + sizeof(struct header) > size)
+				throw std::runtime_error("lz4: truncated frame header");
+
+			memcpy(&header, data + pos, sizeof(struct header));
+			if ((header.compressed_size < 0) || (header.uncompressed_size < 0) ||
+					(pos + sizeof(struct header) + header.compressed_size > size))
+				throw std::runtime_error("lz4: invalid frame header");
+
+			return header;
+		}
+
+		void select_dict(const char *data) {
+			uint32_t id;
+			memcpy(&id, data, sizeof(uint32_t));
+
+			codec_dicts_t::const_iterator it;
+			if (!m_dicts || ((it = m_dicts->find(id)) == m_dicts->end())) {
+				std::ostringstream str;
+				str << "lz4: decompress: unknown dictionary: " << id;
+				throw std::runtime_error(str.str());
+			}
+
+			m_dict = it->second;
+		}
+
+		/* decodes at least @target bytes of the frame, returns their number or negative value on corrupted input */
+		int decompress_frame(const char *src, int size, char *dst, int dst_size, int target) {
+			const char *dict = m_dict ? m_dict->data.data() : NULL;
+			int dict_size = m_dict ? m_dict->data.size() : 0;
+			int ret;
+
+			if (target < dst_size)
+				ret = LZ4_decompress_safe_partial_usingDict(src, dst, size, target, dst_size, dict, dict_size);
+			else
+				ret = LZ4_decompress_safe_usingDict(src, dst, size, dst_size, dict, dict_size);
+
+			if ((ret < 0) || ((target == dst_size) && (ret != dst_size))) {
+				log(SMACK_LOG_ERROR, "lz4: decompress: compressed: %d, uncompressed: %d, dict: %u, ret: %d\n",
+						size, dst_size, m_dict ? m_dict->id : 0, ret);
+				return -1;
+			}
+
+			log(SMACK_LOG_DEBUG, "lz4: decompress: %d -> %d/%d, dict: %u\n", size, ret, dst_size, m_dict ? m_dict->id : 0);
+			return ret;
+		}
 
 		std::streamsize copy(char *s, std::streamsize have_space) {
 			std::streamsize sz = std::min<std::streamsize>(have_space, m_dec.size() - m_dec_offset);
@@ -126,19 +231,28 @@ class decompressor : public bio::multichar_input_filter {
 		}
 };
 
+/*
+ * Fast compressor takes codec level as its acceleration and compresses with the store dictionary,
+ * high compression mode has neither.
+ */
 class compressor : public bio::multichar_output_filter {
 	public:
 		explicit compressor(compression_type type, size_t chunk_size = 1024 * 1024) :
-		m_compress_function(NULL),
+		m_type(type),
 		s_state(s_start),
 		m_chunk(chunk_size),
 		m_chunk_size(0),
-		m_compr_offset(0)
+		m_compr_offset(0),
+		m_acceleration(1),
+		m_dict_sent(false)
 		{
-			if (type == lz4_high)
-				m_compress_function = LZ4_compressHC;
-			else
-				m_compress_function = LZ4_compress;
+		}
+
+		void setup(const codec_params &p) {
+			m_acceleration = std::max(p.level, 1);
+			m_dict.reset();
+			if (m_type == lz4_fast)
+				m_dict = p.dict;
 		}
 
 		template<typename Sink>
@@ -182,23 +296,107 @@ class compressor : public bio::multichar_output_filter {
 			}
 
 			s_state = s_start;
+			m_dict_sent = false;
+		}
+
+		/* frames are smaller than the stream chunk, so the stream decompressor reads them too */
+		void compress_block(const char *data, size_t size, std::string &out) {
+			if (m_dict && size)
+				out.append(dict_header());
+
+			while (size) {
+				int frame = std::min(size, m_chunk.size() - 1);
+				size_t pos = out.size();
+
+				out.resize(pos + sizeof(struct header) + LZ4_compressBound(frame));
+				int compressed = compress_frame(data, frame, (char *)out.data() + pos + sizeof(struct header),
+						out.size() - pos - sizeof(struct header));
+
+				struct header header;
+				header.compressed_size = compressed;
+				header.uncompressed_size = frame;
+
+				memcpy((char *)out.data() + pos, &header, sizeof(struct header));
+				out.resize(pos + sizeof(struct header) + compressed);
+
+				data += frame;
+				size -= frame;
+			}
 		}
 
 	private:
-		int (* m_compress_function)(const char* source, char* dest, int isize);
+		compression_type m_type;
 		state s_state;
 		std::vector<char> m_chunk;
 		std::streamsize m_chunk_size;
 		std::string m_compr;
 		std::streamsize m_compr_offset;
+		int m_acceleration;
+		boost::shared_ptr<codec_dict> m_dict;
+		bool m_dict_sent;
+		boost::shared_ptr<LZ4_stream_t> m_stream;
+
+		std::string dict_header() {
+			struct header header;
+			header.compressed_size = sizeof(uint32_t);
+			header.uncompressed_size = 0;
+
+			std::string ret((char *)&header, sizeof(struct header));
+			ret.append((char *)&m_dict->id, sizeof(uint32_t));
+			return ret;
+		}
+
+		/* dictionary is hashed once per process, compressors start from a copy of that stream */
+		const LZ4_stream_t *dict_stream() {
+			boost::mutex::scoped_lock guard(m_dict->lock);
+			if (!m_dict->cstate) {
+				boost::shared_ptr<LZ4_stream_t> st(LZ4_createStream(), LZ4_freeStream);
+				if (!st)
+					throw std::bad_alloc();
+
+				LZ4_loadDict(st.get(), m_dict->data.data(), m_dict->data.size());
+				m_dict->cstate = st;
+			}
+
+			return (const LZ4_stream_t *)m_dict->cstate.get();
+		}
+
+		int compress_frame(const char *src, int size, char *dst, int dst_size) {
+			int compressed;
+
+			if (m_type == lz4_high) {
+				compressed = LZ4_compressHC(src, dst, size);
+			} else if (m_dict) {
+				if (!m_stream) {
+					m_stream.reset(LZ4_createStream(), LZ4_freeStream);
+					if (!m_stream)
+						throw std::bad_alloc();
+				}
+
+				LZ4_attach_dictionary(m_stream.get(), dict_stream());
+				compressed = LZ4_compress_fast_continue(m_stream.get(), src, dst, size, dst_size, m_acceleration);
+			} else {
+				compressed = LZ4_compress_fast(src, dst, size, dst_size, m_acceleration);
+			}
+
+			if (compressed <= 0)
+				throw std::runtime_error("lz4: compression failed");
+
+			log(SMACK_LOG_DEBUG, "lz4: compress: %d -> %d, acceleration: %d, dict: %u\n",
+					size, compressed, m_acceleration, m_dict ? m_dict->id : 0);
+			return compressed;
+		}
 
 		template<typename Sink>
 		void compress(Sink &dst) {
-			m_compr.resize(LZ4_compressBound(m_chunk_size));
-			int compressed = m_compress_function(m_chunk.data(), (char *)m_compr.data(), m_chunk_size);
-			m_compr.resize(compressed);
+			if (m_dict && !m_dict_sent) {
+				std::string dh = dict_header();
+				bio::write(dst, dh.data(), dh.size());
+				m_dict_sent = true;
+			}
 
-			log(SMACK_LOG_DEBUG, "lz4: compress: %zd -> %zd\n", m_chunk_size, m_compr.size());
+			m_compr.resize(LZ4_compressBound(m_chunk_size));
+			m_compr.resize(compress_frame(m_chunk.data(), m_chunk_size, (char *)m_compr.data(), m_compr.size()));
 
 			struct header header;
 
@@ -238,6 +436,91 @@ class fast_compressor : public compressor {
 		fast_compressor(size_t chunk_size = 1024 * 1024) : compressor(lz4_fast, chunk_size) {};
 };
 
+/* derived compressors are listed too, generic templates would be a better match for them than the base class */
+inline void codec_setup(decompressor &d, const codec_params &p)
+{
+	d.setup(p);
+}
+
+inline void codec_setup(high_compressor &c, const codec_params &p)
+{
+	c.setup(p);
+}
+
+inline void codec_setup(fast_compressor &c, const codec_params &p)
+{
+	c.setup(p);
+}
+
+inline bool codec_block(const decompressor *)
+{
+	return true;
+}
+
+inline bool codec_block(const high_compressor *)
+{
+	return true;
+}
+
+inline bool codec_block(const fast_compressor *)
+{
+	return true;
+}
+
+inline void codec_decompress(decompressor &d, const char *data, size_t size, std::string &out)
+{
+	d.decompress_block(data, size, out);
+}
+
+inline void codec_decompress_partial(decompressor &d, const char *data, size_t size, size_t want, std::string &out)
+{
+	d.decompress_block(data, size, out, want);
+}
+
+inline void codec_compress(high_compressor &c, const char *data, size_t size, std::string &out)
+{
+	c.compress_block(data, size, out);
+}
+
+inline void codec_compress(fast_compressor &c, const char *data, size_t size, std::string &out)
+{
+	c.compress_block(data, size, out);
+}
+
+/*
+ * LZ4 dictionary is plain data the first frame bytes may reference, so it is the tail of the samples:
+ * the latest ones are the closest to the frame and the cheapest to reference.
+ */
+inline bool codec_train(const fast_compressor &, const std::vector<std::string> &samples, size_t dict_size, codec_dict &dict)
+{
+	size_t size = std::min(dict_size, max_dict_size);
+	size_t total = 0;
+
+	std::vector<std::string>::const_iterator it = samples.end();
+	while ((it != samples.begin()) && (total < size)) {
+		--it;
+		total += it->size();
+	}
+
+	dict.data.clear();
+	for (; it != samples.end(); ++it)
+		dict.data.append(*it);
+
+	if (dict.data.size() > size)
+		dict.data.erase(0, dict.data.size() - size);
+	if (dict.data.empty())
+		return false;
+
+	/* FNV-1a of the content, IDs only have to differ between dictionaries of the same store */
+	uint32_t id = 2166136261U;
+	for (size_t i = 0; i < dict.data.size(); ++i)
+		id = (id ^ (unsigned char)dict.data[i]) * 16777619U;
+	dict.id = id ? id : 1;
+
+	log(SMACK_LOG_INFO, "lz4: train: samples: %zd -> dict: %u, size: %zd\n", samples.size(), dict.id, dict.data.size());
+	return true;
+}
+
 }}}
 
 #endif /* __LZ4_HPP */
@@ -0,0 +1,240 @@
+#ifndef __SMACK_MANIFEST_HPP
+#define __SMACK_MANIFEST_HPP
+
+#include <map>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <smack/base.hpp>
+
+namespace ioremap { namespace smack {
+
+#define SMACK_MANIFEST_MAGIC		"smack-manifest"
+#define SMACK_MANIFEST_VERSION		2
+
+/* blob receives the upper part of its predecessor, split is restarted if it was interrupted */
+#define SMACK_BLOB_STATE_SPLIT		(1<<0)
+
+struct manifest_header {
+	char			magic[16];
+	int			version;
+	int			num;			/* number of entries which follow the header */
+	uint64_t		timestamp;
+} __attribute__ ((packed));
+
+struct manifest_entry {
+	char			name[32];		/* blob file name without generation suffix */
+	int			gen;			/* active generation, blob data lives in <name>.<gen>.{data,chunk} */
+	int			state;
+	unsigned char		start[SMACK_KEY_SIZE];	/* blob start key */
+
+	/* version 2 */
+	int			start_size;
+} __attribute__ ((packed));
+
+/* size of the entry stored by given manifest version */
+static inline size_t manifest_entry_size(int version)
+{
+	if (version < 2)
+		return offsetof(struct manifest_entry, start_size);
+
+	return sizeof(struct manifest_entry);
+}
+
+/*
+ * List of blobs with their start keys and active generations.
+ * The whole file is rewritten and atomically renamed over the old one on every change,
+ * so it always describes either the old or the new set of files.
+ */
+class manifest {
+	public:
+		manifest(const std::string &dir) :
+		m_path(dir + "/smack.manifest"),
+		m_exists(false)
+		{
+			if (!boost::filesystem::exists(m_path))
+				return;
+
+			int fd = open(m_path.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw_error("open", -errno);
+
+			struct manifest_header h;
+			int err = read_all(fd, &h, sizeof(struct manifest_header));
+			if (!err && (strncmp(h.magic, SMACK_MANIFEST_MAGIC, sizeof(h.magic)) ||
+						(h.version < 1) || (h.version > SMACK_MANIFEST_VERSION)))
+				err = -EINVAL;
+
+			for (int i = 0; !err && (i < h.num); ++i) {
+				struct manifest_entry e;
+				memset(&e, 0, sizeof(struct manifest_entry));
+
+				err = read_all(fd, &e, manifest_entry_size(h.version));
+				if (!err) {
+					e.name[sizeof(e.name) - 1] = '\0';
+					if (!e.start_size)
+						e.start_size = SMACK_KEY_SIZE;
+
+					m_entries[e.name] = e;
+				}
+			}
+
+			close(fd);
+
+			if (err)
+				throw_error("read", err);
+
+			m_exists = true;
+			log(SMACK_LOG_NOTICE, "%s: manifest: blobs: %zd\n", m_path.c_str(), m_entries.size());
+		}
+
+		/* false until the first manifest is written, blobs have to be found by scanning the directory */
+		bool exists() {
+			boost::mutex::scoped_lock guard(m_lock);
+			return m_exists;
+		}
+
+		std::vector<struct manifest_entry> entries() {
+			boost::mutex::scoped_lock guard(m_lock);
+
+			std::vector<struct manifest_entry> ret;
+			for (std::map<std::string, struct manifest_entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+				ret.push_back(it->second);
+
+			return ret;
+		}
+
+		bool find(const std::string &name, struct manifest_entry &e) {
+			boost::mutex::scoped_lock guard(m_lock);
+
+			std::map<std::string, struct manifest_entry>::iterator it = m_entries.find(name);
+			if (it == m_entries.end())
+				return false;
+
+			e = it->second;
+			return true;
+		}
+
+		void update(const std::string &name, int gen, int state, const key_id &start) {
+			struct manifest_entry e;
+			memset(&e, 0, sizeof(struct manifest_entry));
+
+			if (name.size() >= sizeof(e.name))
+				throw std::runtime_error(m_path + ": manifest: too long blob name: " + name);
+
+			snprintf(e.name, sizeof(e.name), "%s", name.c_str());
+			e.gen = gen;
+			e.state = state;
+			memcpy(e.start, start.id(), SMACK_KEY_SIZE);
+			e.start_size = start.size();
+
+			boost::mutex::scoped_lock guard(m_lock);
+			m_entries[name] = e;
+			write();
+		}
+
+		void remove(const std::string &name) {
+			boost::mutex::scoped_lock guard(m_lock);
+			m_entries.erase(name);
+			write();
+		}
+
+	private:
+		boost::mutex m_lock;
+		std::string m_path;
+		bool m_exists;
+		std::map<std::string, struct manifest_entry> m_entries;
+
+		/* new manifest is synced to disk before it replaces the old one */
+		void write() {
+			std::string tmp = m_path + ".tmp";
+
+			int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0)
+				throw_error("open", -errno);
+
+			struct manifest_header h;
+			memset(&h, 0, sizeof(struct manifest_header));
+
+			snprintf(h.magic, sizeof(h.magic), SMACK_MANIFEST_MAGIC);
+			h.version = SMACK_MANIFEST_VERSION;
+			h.num = m_entries.size();
+			h.timestamp = time(NULL);
+
+			int err = write_all(fd, &h, sizeof(struct manifest_header));
+			for (std::map<std::string, struct manifest_entry>::iterator it = m_entries.begin();
+					!err && (it != m_entries.end()); ++it)
+				err = write_all(fd, &it->second, sizeof(struct manifest_entry));
+
+			if (!err && fsync(fd))
+				err = -errno;
+
+			close(fd);
+
+			if (!err && rename(tmp.c_str(), m_path.c_str()))
+				err = -errno;
+
+			if (err)
+				throw_error("write", err);
+
+			/* rename itself is durable only after the directory is synced */
+			std::string dir = boost::filesystem::path(m_path).parent_path().string();
+			fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+			if (fd >= 0) {
+				fsync(fd);
+				close(fd);
+			}
+
+			m_exists = true;
+			log(SMACK_LOG_INFO, "%s: manifest: written: blobs: %zd\n", m_path.c_str(), m_entries.size());
+		}
+
+		int read_all(int fd, void *buf, size_t size) {
+			char *p = (char *)buf;
+
+			while (size) {
+				ssize_t err = read(fd, p, size);
+				if (err < 0) {
+					if (errno == EINTR)
+						continue;
+					return -errno;
+				}
+				if (err == 0)
+					return -EINVAL;
+
+				p += err;
+				size -= err;
+			}
+
+			return 0;
+		}
+
+		int write_all(int fd, const void *buf, size_t size) {
+			const char *p = (const char *)buf;
+
+			while (size) {
+				ssize_t err = ::write(fd, p, size);
+				if (err < 0) {
+					if (errno == EINTR)
+						continue;
+					return -errno;
+				}
+
+				p += err;
+				size -= err;
+			}
+
+			return 0;
+		}
+
+		void throw_error(const char *op, int err) {
+			std::ostringstream str;
+			str << m_path << ": manifest: " << op << " failed: " << strerror(-err) << ": " << err;
+			throw std::runtime_error(str.str());
+		}
+};
+
+}}
+
+#endif /* __SMACK_MANIFEST_HPP */
@@ -19,6 +19,25 @@ struct index {
 	uint32_t		data_size;
 };
 
+/* tombstone: record has no data and hides older copies of the key */
+#define SMACK_INDEX_FLAGS_REMOVED	(1U << 31)
+/* ts is the absolute expiration time (seconds since the Epoch) instead of the write time */
+#define SMACK_INDEX_FLAGS_EXPIRE	(1U << 30)
+/* on-disk only: record data is a pointer to the value stored in the value log */
+#define SMACK_INDEX_FLAGS_VLOG		(1U << 29)
+
+/*
+ * Keys shorter than SMACK_KEY_SIZE keep their size in these flag bits, the rest of id is zero.
+ * Zero size is the full-size key, for example SHA-512 digest of the name.
+ * Short keys are ordered by their bytes, so applications may use natural keys instead of hashes.
+ */
+#define SMACK_INDEX_KEY_SIZE_SHIFT	16
+#define SMACK_INDEX_KEY_SIZE_MASK	(0x7fU << SMACK_INDEX_KEY_SIZE_SHIFT)
+#define SMACK_INDEX_KEY_SIZE(flags)	\
+	(((flags) & SMACK_INDEX_KEY_SIZE_MASK) ? (int)(((flags) & SMACK_INDEX_KEY_SIZE_MASK) >> SMACK_INDEX_KEY_SIZE_SHIFT) : SMACK_KEY_SIZE)
+#define SMACK_INDEX_SET_KEY_SIZE(flags, size)	\
+	(((flags) & ~SMACK_INDEX_KEY_SIZE_MASK) | (((size) < SMACK_KEY_SIZE) ? ((uint32_t)(size) << SMACK_INDEX_KEY_SIZE_SHIFT) : 0))
+
 struct smack_ctl;
 
 struct smack_init_ctl {
@@ -33,6 +52,19 @@ struct smack_init_ctl {
 	int			cache_thread_num;
 
 	char			*type;
+
+	char			*compaction;		/* "leveled" (default) or "tiered" */
+	int			ttl;			/* seconds since record ts after which it expires, 0 - never */
+
+	long long		split_size;		/* blob data size which triggers split, 0 - default */
+	long long		merge_size;		/* adjacent idle blobs smaller than this together are merged, 0 - never */
+	int			vlog_min_size;		/* values of at least this size are stored in the value log, 0 - never */
+	int			lazy_open;		/* blob indexes are read in background or on the first access */
+	int			bloom_bits_per_key;	/* chunk bloom filter bits per record, 0 - default, negative - fixed bloom_size */
+	int			compression_level;	/* codec level for "zstd", acceleration for "lz4_fast", 0 - default */
+	int			compression_min_gain;	/* percent chunk has to shrink not to be stored raw, 0 - default, negative - always compress */
+	int			dict_size;		/* "zstd" and "lz4_fast" dictionary size trained by full compaction (lz4 uses up to 64KB), 0 - no dictionary */
+	char			*key_hash;		/* "sha512" (default) or "fast" non-cryptographic hash used by smack_key() */
 };
 
 struct smack_ctl *smack_init(struct smack_init_ctl *ictl, int *errp);
@@ -46,6 +78,14 @@ long long smack_total_num(struct smack_ctl *ctl);
 void smack_sync(struct smack_ctl *ctl);
 void smack_log_update(struct smack_ctl *ctl, char *log, uint32_t mask);
 
+/*
+ * Sets full-size key of @idx to the hash of the name, other fields are not changed.
+ * All keys of the storage have to be hashed the same way.
+ */
+int smack_key(struct smack_ctl *ctl, const char *name, int size, struct index *idx);
+/* the same as smack_key() for @num names, SHA-512 digests of several names are computed at once */
+int smack_keys(struct smack_ctl *ctl, const char **names, const int *sizes, int num, struct index *idx);
+
 #ifdef __cplusplus
 }
 #endif
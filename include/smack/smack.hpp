@@ -2,99 +2,422 @@
 #define __SMACK_SMACK_HPP
 
 #include <algorithm>
-#include <deque>
+#include <set>
 
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/thread/future.hpp>
 #include <boost/iostreams/filter/zlib.hpp>
 #include <boost/iostreams/filter/bzip2.hpp>
 #include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <smack/base.hpp>
 #include <smack/blob.hpp>
 #include <smack/snappy.hpp>
 #include <smack/lz4.hpp>
 
+/* zstd codec is built when the library is, users of the headers define it themselves and link libzstd */
+#ifdef SMACK_HAVE_ZSTD
+#include <smack/zstd.hpp>
+#endif
+
 namespace ioremap { namespace smack {
 
 namespace fs = boost::filesystem;
 
-template <class fout_t, class fin_t>
-class cache_processor {
+enum job_type {
+	job_flush = 0,
+	job_compact,
+	job_merge,
+	job_type_num,
+};
+
+static inline const char *job_name(int type)
+{
+	static const char *names[] = { "flush", "compaction", "merge" };
+	return names[type];
+}
+
+/*
+ * Background job scheduler.
+ * Every blob is queued at most once per job type and the most urgent blob is served first:
+ * the one with the largest write cache for flushes, the one with the most runs (or pending split) for compactions.
+ * Compactions and merges together may only occupy half of the threads, the rest only serve flushes,
+ * so background work never delays write cache flushes.
+ *
+ * Idle threads are woken one per queued job which may start right away, a thread which completed its job
+ * picks the next one itself. sync() callers wait for their own jobs only.
+ *
+ * @blob_t runs the jobs (flush(), compact(), absorb()) and reports their urgency, see blob.
+ */
+template <class blob_t>
+class job_scheduler {
 	public:
-		cache_processor(int thread_num) : need_exit_(0), processed_(0) {
+		job_scheduler(int thread_num) : need_exit_(false), active_(0), idle_(0) {
+			if (thread_num < 2)
+				thread_num = 2;
+
+			thread_num_ = thread_num;
+			background_limit_ = thread_num / 2;
+
+			for (int i = 0; i < job_type_num; ++i)
+				running_[i] = 0;
+
 			for (int i = 0; i < thread_num; ++i)
-				group_.create_thread(boost::bind(&cache_processor::process, this));
+				group_.create_thread(boost::bind(&job_scheduler::process, this));
 		}
 
-		~cache_processor() {
-			need_exit_ = 1;
-			cond_.notify_all();
+		~job_scheduler() {
+			{
+				boost::mutex::scoped_lock guard(lock_);
+				need_exit_ = true;
+				cond_.notify_all();
+				done_.notify_all();
+			}
 			group_.join_all();
 
-			log(SMACK_LOG_INFO, "cache processor completed\n");
+			/* jobs which never started do not keep their waiters blocked */
+			for (typename jobs_t::iterator it = jobs_.begin(); it != jobs_.end(); ++it) {
+				for (int i = 0; i < job_type_num; ++i)
+					release(it->second.jobs[i].waiters);
+			}
+
+			log(SMACK_LOG_INFO, "job scheduler completed\n");
 		}
 
+		void notify(boost::shared_ptr<blob_t > b, job_type type) {
+			/* queued flush takes the whole write cache when it starts, so repeated notifications are dropped early */
+			if ((type == job_flush) && b->flush_queued())
+				return;
+
+			uint64_t urgency = (type == job_flush) ? b->flush_urgency() : b->compaction_urgency();
 
-		void notify(boost::shared_ptr<blob<fout_t, fin_t> > b) {
 			boost::mutex::scoped_lock guard(lock_);
-			typename std::deque<boost::shared_ptr<blob<fout_t, fin_t> > >::iterator it = std::find(blobs_.begin(), blobs_.end(), b);
-			if (it == blobs_.end())
-				blobs_.push_back(b);
 
-			cond_.notify_all();
+			blob_jobs &bj = jobs_[b.get()];
+			bj.b = b;
+
+			queue(bj, type, urgency, false);
 		}
 
-		void wait_for_all() {
+		/* @dst absorbs the adjacent @src in background, the request is dropped while @dst has a merge pending */
+		void merge(boost::shared_ptr<blob_t > dst, boost::shared_ptr<blob_t > src) {
 			boost::mutex::scoped_lock guard(lock_);
 
-			while ((processed_ || !blobs_.empty()) && !need_exit_) {
-				cond_.wait(guard);
+			blob_jobs &bj = jobs_[dst.get()];
+			bj.b = dst;
+
+			if (bj.merge_src)
+				return;
+
+			if (queue(bj, job_merge, 1, false))
+				bj.merge_src = src;
+		}
+
+		/*
+		 * Queues flushes of @blobs, the future is ready when a flush of every blob which started after this call
+		 * and the jobs queued as its follow-ups are completed.
+		 * Explicit sync does not wait for the backoff of failed flushes.
+		 */
+		boost::shared_future<void> sync(const std::vector<boost::shared_ptr<blob_t > > &blobs) {
+			std::vector<uint64_t> urgency(blobs.size());
+			for (size_t i = 0; i < blobs.size(); ++i)
+				urgency[i] = blobs[i]->flush_urgency();
+
+			waiters_t w(1, boost::shared_ptr<sync_waiter>(new sync_waiter()));
+			boost::shared_future<void> ret(w[0]->done.get_future());
+
+			boost::mutex::scoped_lock guard(lock_);
+
+			for (size_t i = 0; i < blobs.size(); ++i) {
+				blob_jobs &bj = jobs_[blobs[i].get()];
+				bj.b = blobs[i];
+
+				queue(bj, job_flush, urgency[i], true);
+				attach(bj.jobs[job_flush], w);
 			}
+
+			/* the waiter was created with one pending reference, which protects it while the jobs are attached */
+			release(w);
+			return ret;
+		}
+
+		/* waits until there are no queued or running jobs at all */
+		void wait_for_all() {
+			boost::mutex::scoped_lock guard(lock_);
+
+			while (active_ && !need_exit_)
+				done_.wait(guard);
 		}
 
 	private:
+		typedef std::set<std::pair<uint64_t, blob_t *> > ready_t;
+
+		/* completion of the jobs requested by single sync() call */
+		struct sync_waiter {
+			sync_waiter() : pending(1) {}
+
+			int pending;			/* attached jobs, protected by lock_ */
+			boost::promise<void> done;
+		};
+
+		typedef std::vector<boost::shared_ptr<sync_waiter> > waiters_t;
+
+		struct job_state {
+			job_state() : queued(false), running(false), again(false), urgency(0), failures(0), retry(0) {}
+
+			bool queued, running, again;
+			uint64_t urgency;
+
+			/* failed job is not queued by notifications until @retry */
+			int failures;
+			time_t retry;
+
+			/* completed by the next run of the job */
+			waiters_t waiters;
+		};
+
+		struct blob_jobs {
+			boost::shared_ptr<blob_t > b;
+			job_state jobs[job_type_num];
+
+			/* blob absorbed by the pending merge */
+			boost::shared_ptr<blob_t > merge_src;
+		};
+
+		typedef boost::unordered_map<blob_t *, blob_jobs> jobs_t;
+
 		boost::mutex lock_;
-		boost::condition cond_;
-		std::deque<boost::shared_ptr<blob<fout_t, fin_t> > > blobs_;
+		boost::condition cond_, done_;
 		boost::thread_group group_;
-		int need_exit_;
-		int processed_;
+		bool need_exit_;
+
+		jobs_t jobs_;
+		ready_t ready_[job_type_num];
+		int running_[job_type_num];
+
+		/* compactions and merges share background_limit_, which is less than thread_num_ */
+		int thread_num_, background_limit_;
+
+		/* queued and running jobs */
+		int active_;
+
+		/* threads waiting for a job */
+		int idle_;
+
+		/*
+		 * Must be called with lock_ held.
+		 * Returns false if the job was not queued, because its backoff after a failure is not over yet.
+		 */
+		bool queue(blob_jobs &bj, job_type type, uint64_t urgency, bool force) {
+			job_state &st = bj.jobs[type];
+
+			/* running job will be restarted when completed, since the blob could get new data meanwhile */
+			if (st.running) {
+				st.again = true;
+				return true;
+			}
+
+			if (!force && !st.queued && st.failures && (time(NULL) < st.retry))
+				return false;
+
+			bool queued = st.queued;
+			if (queued) {
+				ready_[type].erase(std::make_pair(st.urgency, bj.b.get()));
+			} else {
+				st.queued = true;
+				active_++;
+
+				if (type == job_flush)
+					bj.b->set_flush_queued(true);
+			}
+
+			st.urgency = urgency;
+			ready_[type].insert(std::make_pair(urgency, bj.b.get()));
+
+			/* job which has to wait for a free slot is picked by the thread which frees it */
+			if (!queued && idle_ && slot_free(type))
+				cond_.notify_one();
+
+			return true;
+		}
+
+		/* must be called with lock_ held */
+		bool slot_free(int type) const {
+			if (type == job_flush)
+				return running_[job_flush] < thread_num_;
+
+			return running_[job_compact] + running_[job_merge] < background_limit_;
+		}
+
+		/* must be called with lock_ held, entry is erased if the blob has no queued, running or delayed jobs */
+		void erase_idle(typename jobs_t::iterator it) {
+			const blob_jobs &bj = it->second;
+
+			if (bj.merge_src)
+				return;
+
+			time_t now = time(NULL);
+			for (int i = 0; i < job_type_num; ++i) {
+				const job_state &st = bj.jobs[i];
+
+				if (st.queued || st.running || (st.failures && (now < st.retry)))
+					return;
+			}
+
+			jobs_.erase(it);
+		}
+
+		/* must be called with lock_ held */
+		void attach(job_state &st, const waiters_t &w) {
+			for (size_t i = 0; i < w.size(); ++i) {
+				w[i]->pending++;
+				st.waiters.push_back(w[i]);
+			}
+		}
+
+		/* must be called with lock_ held, or after all threads exited */
+		void release(waiters_t &w) {
+			for (size_t i = 0; i < w.size(); ++i) {
+				if (--w[i]->pending == 0)
+					w[i]->done.set_value();
+			}
+
+			w.clear();
+		}
+
+		/*
+		 * Must be called with lock_ held.
+		 * Merges and compactions are picked first while they are within their shared limit, otherwise
+		 * steady flush load would starve them, the rest of the threads serve flushes.
+		 */
+		bool pick(job_type &type, blob_jobs *&bj) {
+			for (int i = job_type_num - 1; i >= 0; --i) {
+				if (ready_[i].empty() || !slot_free(i))
+					continue;
+
+				typename ready_t::iterator it = --ready_[i].end();
+
+				type = (job_type)i;
+				bj = &jobs_[it->second];
+				ready_[i].erase(it);
+				return true;
+			}
+
+			return false;
+		}
 
 		void process(void) {
-			while (!need_exit_) {
-				boost::shared_ptr<blob<fout_t, fin_t> > b;
+			boost::mutex::scoped_lock guard(lock_);
 
-				{
-					boost::mutex::scoped_lock guard(lock_);
+			while (true) {
+				job_type type;
+				blob_jobs *bj;
 
-					while (blobs_.empty() && !need_exit_) {
-						cond_.wait(guard);
-					}
+				while (!need_exit_ && !pick(type, bj)) {
+					idle_++;
+					cond_.wait(guard);
+					idle_--;
+				}
 
-					if (need_exit_)
-						break;
+				if (need_exit_)
+					break;
 
-					if (blobs_.empty())
-						continue;
+				boost::shared_ptr<blob_t > b = bj->b;
+				job_state &st = bj->jobs[type];
+
+				st.queued = false;
+				st.running = true;
+				running_[type]++;
+
+				if (type == job_flush)
+					b->set_flush_queued(false);
+
+				waiters_t waiters;
+				waiters.swap(st.waiters);
+
+				boost::shared_ptr<blob_t > merge_src;
+				if (type == job_merge)
+					merge_src.swap(bj->merge_src);
 
-					b = blobs_.front();
-					blobs_.pop_front();
+				guard.unlock();
 
-					processed_++;
+				bool want_compact = false, merged = false, failed = false;
+				try {
+					if (type == job_flush)
+						want_compact = b->flush();
+					else if (type == job_compact)
+						b->compact();
+					else if (merge_src)
+						merged = b->absorb(b, merge_src);
+				} catch (const std::exception &e) {
+					log(SMACK_LOG_ERROR, "%s: %s job failed: %s\n", b->start().str(), job_name(type), e.what());
+					failed = true;
 				}
 
-				while (b->write_cache()) ;
-				boost::mutex::scoped_lock guard(lock_);
-				processed_--;
-				cond_.notify_all();
+				/* write cache of the absorbed blob is ours now, copied runs are compacted in */
+				want_compact |= merged;
+
+				bool want_flush = b->want_flush() || merged;
+				uint64_t urgency[job_type_num];
+				urgency[job_flush] = b->flush_urgency();
+				urgency[job_compact] = b->compaction_urgency();
+
+				guard.lock();
+
+				st.running = false;
+				running_[type]--;
+
+				if (failed) {
+					/*
+					 * Failure (like ENOSPC) is likely to repeat, the job is not restarted and notifications
+					 * do not queue it again until the backoff (2 seconds doubled per failure up to about a minute) is over.
+					 * Waiters which asked for its restart while it was running are completed too.
+					 */
+					st.retry = time(NULL) + (2 << std::min(st.failures, 5));
+					st.failures++;
+
+					release(st.waiters);
+					if (type == job_merge)
+						bj->merge_src.reset();
+				} else {
+					st.failures = 0;
+
+					/*
+					 * Follow-up jobs are queued before this one is accounted as done, so wait_for_all() waits for them too,
+					 * waiters of this job are moved to them.
+					 */
+					if (want_flush || ((type == job_flush) && st.again)) {
+						if (queue(*bj, job_flush, urgency[job_flush], false))
+							attach(bj->jobs[job_flush], waiters);
+					}
+					if ((want_compact && urgency[job_compact]) || ((type == job_compact) && st.again)) {
+						if (queue(*bj, job_compact, urgency[job_compact], false))
+							attach(bj->jobs[job_compact], waiters);
+					}
+					if ((type == job_merge) && st.again)
+						queue(*bj, job_merge, 1, false);
+				}
+
+				st.again = false;
+				release(waiters);
+
+				erase_idle(jobs_.find(b.get()));
+
+				if (merged) {
+					typename jobs_t::iterator it = jobs_.find(merge_src.get());
+					if (it != jobs_.end())
+						erase_idle(it);
+				}
+
+				if (--active_ == 0)
+					done_.notify_all();
 			}
 		}
-
 };
 
-
 template <class fout_t, class fin_t>
 class smack {
 	public:
@@ -102,89 +425,95 @@ class smack {
 				int bloom_size = 1024,
 				size_t max_cache_size = 10000,
 				int max_blob_num = 100,
-				int cache_thread_num = 10) :
+				int cache_thread_num = 10,
+				const config &cfg = config()) :
 			m_need_exit(false),
 			path_base_(path), bloom_size_(bloom_size), blob_num_(0),
-			max_cache_size_(max_cache_size), max_blob_num_(max_blob_num), proc_(cache_thread_num) {
+			max_cache_size_(max_cache_size), max_blob_num_(max_blob_num), cfg_(cfg), sched_(cache_thread_num) {
 			if (!fs::exists(path))
 				throw std::runtime_error("Directory " + path + " does not exist");
 
-			std::vector<std::string> blobs;
-
-			fs::directory_iterator end_itr;
-			for (fs::directory_iterator itr(path); itr != end_itr; ++itr) {
-				fs::path p(*itr);
+			manifest_.reset(new manifest(path));
 
-				if (!fs::is_regular_file(p))
-					continue;
+			std::vector<std::string> blobs;
+			if (manifest_->exists()) {
+				std::vector<struct manifest_entry> entries = manifest_->entries();
+				for (size_t i = 0; i < entries.size(); ++i)
+					blobs.push_back(entries[i].name);
+			} else {
+				blobs = scan_blobs(path);
+			}
 
+			for (size_t i = 0; i < blobs.size(); ++i) {
 				int num;
-				if (sscanf(p.filename().c_str(), "smack.%d.", &num) == 1) {
-					std::vector<std::string>::iterator sit;
-					std::string tmp = "smack." + boost::lexical_cast<std::string>(num);
+				if ((sscanf(blobs[i].c_str(), "smack.%d", &num) == 1) && (num > blob_num_))
+					blob_num_ = num;
+			}
 
-					for (sit = blobs.begin(); sit != blobs.end(); ++sit) {
-						if (*sit == tmp)
-							break;
-					}
-					if (sit != blobs.end())
-						continue;
+			/* blobs are opened concurrently, every thread takes the next blob from the list */
+			size_t pos = 0;
+			std::string error;
+			boost::thread_group group;
 
-					blobs.push_back(tmp);
+			for (int i = 1; (i < cache_thread_num) && (i < (int)blobs.size()); ++i)
+				group.create_thread(boost::bind(&smack::open_blobs, this,
+							boost::cref(blobs), boost::ref(pos), boost::ref(error)));
 
-					std::string file = path + "/" + tmp;
-					log(SMACK_LOG_NOTICE, "open: %s\n", file.c_str());
+			open_blobs(blobs, pos, error);
+			group.join_all();
 
-					boost::shared_ptr<blob<fout_t, fin_t> > b(new blob<fout_t, fin_t>(file, bloom_size, max_cache_size));
-					blobs_.insert(std::make_pair(b->start(), b));
+			if (!error.empty())
+				throw std::runtime_error(error);
 
-					if (num > blob_num_)
-						blob_num_ = num;
+			/* blobs found by the directory scan are recorded once, afterwards only the manifest is used */
+			if (!manifest_->exists()) {
+				for (typename std::map<key_id, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp>::iterator it = blobs_.begin();
+						it != blobs_.end(); ++it)
+					it->second->store_manifest();
+			}
 
-					b->set_want_rcache(true);
-					b->set_want_resort(b->have_unsorted_chunks() > 0);
-					proc_.notify(b);
-				}
+			if (blobs_.size() == 0) {
+				boost::shared_ptr<blob<fout_t, fin_t> > b(new blob<fout_t, fin_t>(path + "/smack.0",
+							bloom_size, max_cache_size, cfg, manifest_));
+
+				b->store_manifest();
+				blobs_.insert(std::make_pair(key(), b));
 			}
 
-			if (blobs_.size() == 0)
-				blobs_.insert(std::make_pair(key(),
-						boost::shared_ptr<blob<fout_t, fin_t> >(
-							new blob<fout_t, fin_t>(path + "/smack.0", bloom_size, max_cache_size))));
+			restart_splits();
 
 			m_sync_thread = boost::thread(boost::bind(&smack::run_sync, this));
 		}
 
 		virtual ~smack() {
-			m_need_exit = true;
+			{
+				boost::mutex::scoped_lock guard(m_sync_lock);
+				m_need_exit = true;
+				m_sync_cond.notify_all();
+			}
+			m_sync_thread.join();
+
+			/* background jobs are not interrupted */
 			sync();
+			sched_.wait_for_all();
 		}
 
 		void write(const key &key, const char *data, size_t size) {
 			boost::shared_ptr<blob<fout_t, fin_t> > curb = blob_lookup(key, false);
 
 			if (curb->write(key, data, size)) {
-				boost::mutex::scoped_lock guard(m_blobs_lock);
-
 				size_t data_size, num;
 				bool have_split;
 
+				/* stats may read the index of the lazily opened blob, which must not block other requests */
 				curb->disk_stat(num, data_size, have_split);
 
-				if ((blobs_.size() < max_blob_num_) &&
-						(data_size > 10 * 1024 * 1024) &&
-						!have_split) {
-					blob_num_++;
-					boost::shared_ptr<blob<fout_t, fin_t> >	b(new blob<fout_t, fin_t>(
-								path_base_ + "/smack." + boost::lexical_cast<std::string>(blob_num_),
-								bloom_size_, max_cache_size_));
-
-					curb->set_split_dst(b);
-
-					blobs_.insert(std::make_pair(b->start(), b));
+				if ((data_size > cfg_.split_size) && !have_split) {
+					boost::mutex::scoped_lock guard(m_blobs_lock);
+					split_blob(curb);
 				}
 
-				proc_.notify(curb);
+				sched_.notify(curb, job_flush);
 			}
 		}
 
@@ -195,16 +524,28 @@ class smack {
 		void remove(const key &key) {
 			boost::shared_ptr<blob<fout_t, fin_t> > curb = blob_lookup(key, true);
 			if (curb->remove(key))
-				proc_.notify(curb);
+				sched_.notify(curb, job_flush);
 		}
 
 		void sync(void) {
-			for (typename std::map<key, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp>::iterator it = blobs_.begin();
-					it != blobs_.end(); ++it) {
-				proc_.notify(it->second);
+			sync_async().wait();
+		}
+
+		/*
+		 * Flushes write caches of all blobs in background, the future is ready when data written before this call
+		 * is on disk and compactions triggered by these flushes are completed.
+		 */
+		boost::shared_future<void> sync_async(void) {
+			std::vector<boost::shared_ptr<blob<fout_t, fin_t> > > blobs;
+			{
+				boost::mutex::scoped_lock guard(m_blobs_lock);
+				for (typename std::map<key_id, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp>::iterator it = blobs_.begin();
+						it != blobs_.end(); ++it) {
+					blobs.push_back(it->second);
+				}
 			}
 
-			proc_.wait_for_all();
+			return sched_.sync(blobs);
 		}
 
 		std::string lookup(key &k) {
@@ -216,7 +557,7 @@ class smack {
 			boost::mutex::scoped_lock guard(m_blobs_lock);
 
 			long long total_num = 0;
-			for (typename std::map<key, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp>::iterator it = blobs_.begin();
+			for (typename std::map<key_id, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp>::iterator it = blobs_.begin();
 					it != blobs_.end(); ++it) {
 				size_t num, size;
 				bool have_split;
@@ -229,7 +570,7 @@ class smack {
 		}
 
 	private:
-		std::map<key, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp> blobs_;
+		std::map<key_id, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp> blobs_;
 		bool m_need_exit;
 		boost::mutex m_blobs_lock;
 		std::string path_base_;
@@ -237,8 +578,20 @@ class smack {
 		int blob_num_;
 		size_t max_cache_size_;
 		size_t max_blob_num_;
-		cache_processor<fout_t, fin_t> proc_;
+		config cfg_;
+		job_scheduler<blob<fout_t, fin_t> > sched_;
+		boost::shared_ptr<manifest> manifest_;
 		boost::thread m_sync_thread;
+		boost::mutex m_sync_lock;
+		boost::condition m_sync_cond;
+
+		struct blob_load {
+			boost::shared_ptr<blob<fout_t, fin_t> > b;
+			bool loaded;
+			uint64_t write_rate, read_rate;
+			size_t num, size;
+			bool have_split;
+		};
 
 		boost::shared_ptr<blob<fout_t, fin_t> > blob_lookup(const key &k, bool check_start_key = false) {
 			boost::mutex::scoped_lock guard(m_blobs_lock);
@@ -248,7 +601,7 @@ class smack {
 			
 			boost::shared_ptr<blob<fout_t, fin_t> > b;
 
-			typename std::map<key, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp>::iterator it = blobs_.upper_bound(k);
+			typename std::map<key_id, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp>::iterator it = blobs_.upper_bound(k);
 			if (it == blobs_.end()) {
 				b = blobs_.rbegin()->second;
 			} else if (it == blobs_.begin()) {
@@ -263,19 +616,184 @@ class smack {
 			return b;
 		}
 
-		void run_sync() {
-			int m_sync_timeout = 60;
-
-			while (!m_need_exit) {
-				for (int i = 0; i < m_sync_timeout; ++i) {
-					if (m_need_exit)
+		void open_blobs(const std::vector<std::string> &blobs, size_t &pos, std::string &error) {
+			while (true) {
+				std::string file;
+				{
+					boost::mutex::scoped_lock guard(m_blobs_lock);
+					if ((pos == blobs.size()) || !error.empty())
 						break;
 
-					sleep(1);
+					file = path_base_ + "/" + blobs[pos++];
+				}
+
+				log(SMACK_LOG_NOTICE, "open: %s\n", file.c_str());
+
+				try {
+					boost::shared_ptr<blob<fout_t, fin_t> > b(new blob<fout_t, fin_t>(file, bloom_size_, max_cache_size_, cfg_, manifest_));
+
+					boost::mutex::scoped_lock guard(m_blobs_lock);
+					blobs_.insert(std::make_pair(b->start(), b));
+					sched_.notify(b, job_flush);
+				} catch (const std::exception &e) {
+					boost::mutex::scoped_lock guard(m_blobs_lock);
+					error = file + ": " + e.what();
+				}
+			}
+		}
+
+		/* blob names in the directory which has no manifest yet */
+		std::vector<std::string> scan_blobs(const std::string &path) {
+			std::set<std::string> names;
+
+			fs::directory_iterator end_itr;
+			for (fs::directory_iterator itr(path); itr != end_itr; ++itr) {
+				fs::path p(*itr);
+
+				if (!fs::is_regular_file(p))
+					continue;
+
+				int num;
+				if (sscanf(p.filename().c_str(), "smack.%d.", &num) == 1)
+					names.insert("smack." + boost::lexical_cast<std::string>(num));
+			}
+
+			return std::vector<std::string>(names.begin(), names.end());
+		}
+
+		/* split which was interrupted by restart is started again, its source is the preceding blob */
+		void restart_splits() {
+			boost::shared_ptr<blob<fout_t, fin_t> > prev;
+
+			for (typename std::map<key_id, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp>::iterator it = blobs_.begin();
+					it != blobs_.end(); ++it) {
+				boost::shared_ptr<blob<fout_t, fin_t> > b = it->second;
+
+				if (prev && b->split_incoming()) {
+					if (prev->set_split_dst(b, b->start())) {
+						log(SMACK_LOG_NOTICE, "%s: restarting split\n", b->start().str());
+						sched_.notify(prev, job_compact);
+					} else {
+						log(SMACK_LOG_ERROR, "%s: can not restart split, preceding blob waits for its own split\n",
+								b->start().str());
+					}
+				}
+
+				prev = b;
+			}
+		}
+
+		/* must be called with m_blobs_lock held */
+		void split_blob(boost::shared_ptr<blob<fout_t, fin_t> > curb) {
+			if (blobs_.size() >= max_blob_num_)
+				return;
+
+			key_id k;
+			if (!curb->split_key(k))
+				return;
+
+			boost::shared_ptr<blob<fout_t, fin_t> >	b(new blob<fout_t, fin_t>(
+						path_base_ + "/smack." + boost::lexical_cast<std::string>(blob_num_ + 1),
+						bloom_size_, max_cache_size_, cfg_, manifest_));
+
+			if (!curb->set_split_dst(b, k))
+				return;
+
+			blob_num_++;
+			blobs_.insert(std::make_pair(b->start(), b));
+			sched_.notify(curb, job_compact);
+		}
+
+		/*
+		 * Splits blobs which receive too much load and merges adjacent idle blobs
+		 * whose data fits into merge_size together.
+		 * Stats are collected without the blobs lock, lazily opened blobs which were not loaded yet are skipped.
+		 */
+		void rebalance() {
+			std::vector<blob_load> load;
+			{
+				boost::mutex::scoped_lock guard(m_blobs_lock);
+				typename std::map<key_id, boost::shared_ptr<blob<fout_t, fin_t> >, keycomp>::iterator it = blobs_.begin();
+				while (it != blobs_.end()) {
+					/* merged blob only forwards requests, its range belongs to the preceding blob now */
+					if (it->second->merged()) {
+						blobs_.erase(it++);
+						continue;
+					}
+
+					blob_load l;
+					l.b = it->second;
+					load.push_back(l);
+					++it;
+				}
+			}
+
+			for (size_t i = 0; i < load.size(); ++i) {
+				blob_load &l = load[i];
+
+				l.loaded = l.b->loaded();
+				if (!l.loaded)
+					continue;
+
+				l.b->load_stat(l.write_rate, l.read_rate);
+				l.b->disk_stat(l.num, l.size, l.have_split);
+			}
+
+			for (size_t i = 0; i < load.size(); ++i) {
+				const blob_load &l = load[i];
+
+				if (!l.loaded || l.have_split || (l.size <= 2 * cfg_.merge_size))
+					continue;
+
+				if ((cfg_.split_write_rate && (l.write_rate > cfg_.split_write_rate)) ||
+						(cfg_.split_read_rate && (l.read_rate > cfg_.split_read_rate))) {
+					log(SMACK_LOG_NOTICE, "%s: hot blob: write-rate: %llu, read-rate: %llu\n",
+							l.b->start().str(), (unsigned long long)l.write_rate,
+							(unsigned long long)l.read_rate);
+
+					boost::mutex::scoped_lock guard(m_blobs_lock);
+					split_blob(l.b);
 				}
+			}
+
+			if (!cfg_.merge_size)
+				return;
+
+			for (size_t i = 0; i + 1 < load.size(); ++i) {
+				blob_load &dst = load[i];
+				blob_load &src = load[i + 1];
 
-				if (!m_need_exit)
-					sync();
+				if (!dst.loaded || !src.loaded || dst.have_split || src.have_split || !idle(dst) || !idle(src) ||
+						(dst.size + src.size >= cfg_.merge_size))
+					continue;
+
+				/* data is moved by the scheduler, the source is dropped from the map by the next pass */
+				sched_.merge(dst.b, src.b);
+
+				/* merged blob is not idle anymore, its next neighbour is left for the next pass */
+				++i;
+			}
+		}
+
+		/* load is below half of the split thresholds */
+		bool idle(const blob_load &l) {
+			return (!cfg_.split_write_rate || (l.write_rate * 2 <= cfg_.split_write_rate)) &&
+				(!cfg_.split_read_rate || (l.read_rate * 2 <= cfg_.split_read_rate));
+		}
+
+		void run_sync() {
+			int m_sync_timeout = 60;
+
+			boost::mutex::scoped_lock guard(m_sync_lock);
+			while (!m_need_exit) {
+				m_sync_cond.timed_wait(guard, boost::posix_time::seconds(m_sync_timeout));
+				if (m_need_exit)
+					break;
+
+				guard.unlock();
+				rebalance();
+				sync();
+				guard.lock();
 			}
 		}
 };
@@ -292,12 +810,40 @@ class zlib_max_compression_decompressor : public boost::iostreams::zlib_decompre
 				boost::iostreams::zlib_params(boost::iostreams::zlib::best_compression)) {}
 };
 
+SMACK_CODEC_TRAITS(boost::iostreams::zlib_compressor, SMACK_CODEC_ZLIB);
+SMACK_CODEC_TRAITS(boost::iostreams::zlib_decompressor, SMACK_CODEC_ZLIB);
+SMACK_CODEC_TRAITS(zlib_max_compression_compressor, SMACK_CODEC_ZLIB);
+SMACK_CODEC_TRAITS(zlib_max_compression_decompressor, SMACK_CODEC_ZLIB);
+SMACK_CODEC_TRAITS(boost::iostreams::bzip2_compressor, SMACK_CODEC_BZIP2);
+SMACK_CODEC_TRAITS(boost::iostreams::bzip2_decompressor, SMACK_CODEC_BZIP2);
+SMACK_CODEC_TRAITS(snappy::snappy_compressor, SMACK_CODEC_SNAPPY);
+SMACK_CODEC_TRAITS(snappy::snappy_decompressor, SMACK_CODEC_SNAPPY);
+SMACK_CODEC_TRAITS(lz4::fast_compressor, SMACK_CODEC_LZ4);
+SMACK_CODEC_TRAITS(lz4::high_compressor, SMACK_CODEC_LZ4);
+SMACK_CODEC_TRAITS(lz4::decompressor, SMACK_CODEC_LZ4);
+#ifdef SMACK_HAVE_ZSTD
+SMACK_CODEC_TRAITS(zstd::compressor, SMACK_CODEC_ZSTD);
+SMACK_CODEC_TRAITS(zstd::decompressor, SMACK_CODEC_ZSTD);
+#endif
+
+/* chunks are decoded by the codec which wrote them, so a store may be reopened with another codec */
+static codec_registrar<boost::iostreams::zlib_decompressor> smack_zlib_registrar;
+static codec_registrar<boost::iostreams::bzip2_decompressor> smack_bzip2_registrar;
+static codec_registrar<snappy::snappy_decompressor> smack_snappy_registrar;
+static codec_registrar<lz4::decompressor> smack_lz4_registrar;
+#ifdef SMACK_HAVE_ZSTD
+static codec_registrar<zstd::decompressor> smack_zstd_registrar;
+#endif
+
 typedef smack<zlib_max_compression_compressor, zlib_max_compression_decompressor> smack_zlib_best;
 typedef smack<boost::iostreams::zlib_compressor, boost::iostreams::zlib_decompressor> smack_zlib_default;
 typedef smack<boost::iostreams::bzip2_compressor, boost::iostreams::bzip2_decompressor> smack_bzip2;
 typedef smack<snappy::snappy_compressor, snappy::snappy_decompressor> smack_snappy;
 typedef smack<lz4::fast_compressor, lz4::decompressor> smack_lz4_fast;
 typedef smack<lz4::high_compressor, lz4::decompressor> smack_lz4_high;
+#ifdef SMACK_HAVE_ZSTD
+typedef smack<zstd::compressor, zstd::decompressor> smack_zstd;
+#endif
 
 }}
 
@@ -12,6 +12,7 @@
 #include <snappy.h>
 
 #include <smack/base.hpp>
+#include <smack/codec.hpp>
 
 namespace bio = boost::iostreams;
 
@@ -89,12 +90,56 @@ class snappy_decompressor : public bio::multichar_input_filter {
 			s_state = s_start;
 		}
 
+		/* decompresses all frames of @data straight into @out */
+		void decompress_block(const char *data, size_t size, std::string &out) {
+			size_t total = 0;
+			for (size_t pos = 0; pos < size; ) {
+				struct snappy_header header = frame(data, size, pos);
+				size_t len;
+
+				if (!::snappy::GetUncompressedLength(data + pos + sizeof(struct snappy_header), header.size, &len))
+					throw std::runtime_error("snappy: invalid frame");
+
+				total += len;
+				pos += sizeof(struct snappy_header) + header.size;
+			}
+
+			out.resize(total);
+
+			size_t offset = 0;
+			for (size_t pos = 0; pos < size; ) {
+				struct snappy_header header = frame(data, size, pos);
+				const char *src = data + pos + sizeof(struct snappy_header);
+				size_t len;
+
+				if (!::snappy::GetUncompressedLength(src, header.size, &len) ||
+						!::snappy::RawUncompress(src, header.size, (char *)out.data() + offset))
+					throw std::runtime_error("snappy: corrupted frame");
+
+				offset += len;
+				pos += sizeof(struct snappy_header) + header.size;
+			}
+		}
+
 	private:
 		snappy_state s_state;
 		std::vector<char> m_chunk;
 		std::string m_dec;
 		std::streamsize m_dec_offset;
 
+		static struct snappy_header frame(const char *data, size_t size, size_t pos) {
+			struct snappy_header header;
+
+			if (pos + sizeof(struct snappy_header) > size)
+				throw std::runtime_error("snappy: truncated frame header");
+
+			memcpy(&header, data + pos, sizeof(struct snappy_header));
+			if (header.size > size - pos - sizeof(struct snappy_header))
+				throw std::runtime_error("snappy: invalid frame header");
+
+			return header;
+		}
+
 		std::streamsize copy(char *s, std::streamsize have_space) {
 			std::streamsize sz = std::min<std::streamsize>(have_space, m_dec.size() - m_dec_offset);
 
@@ -163,6 +208,31 @@ class snappy_compressor : public bio::multichar_output_filter {
 			s_state = s_start;
 		}
 
+		/* frames are smaller than the stream chunk, so the stream decompressor reads them too */
+		void compress_block(const char *data, size_t size, std::string &out) {
+			while (size) {
+				size_t frame = std::min(size, m_chunk.size() - 1);
+				size_t pos = out.size();
+
+				out.resize(pos + sizeof(struct snappy_header) + ::snappy::MaxCompressedLength(frame));
+
+				size_t compressed;
+				::snappy::RawCompress(data, frame, (char *)out.data() + pos + sizeof(struct snappy_header), &compressed);
+
+				struct snappy_header header;
+				memset(&header, 0, sizeof(struct snappy_header));
+				header.size = compressed;
+
+				memcpy((char *)out.data() + pos, &header, sizeof(struct snappy_header));
+				out.resize(pos + sizeof(struct snappy_header) + compressed);
+
+				log(SMACK_LOG_DEBUG, "snappy: compress block: %zd -> %zd\n", frame, compressed);
+
+				data += frame;
+				size -= frame;
+			}
+		}
+
 	private:
 		snappy_state s_state;
 		std::vector<char> m_chunk;
@@ -202,6 +272,25 @@ class snappy_compressor : public bio::multichar_output_filter {
 		}
 };
 
+inline bool codec_block(const snappy_decompressor *)
+{
+	return true;
+}
+
+inline bool codec_block(const snappy_compressor *)
+{
+	return true;
+}
+
+inline void codec_decompress(snappy_decompressor &d, const char *data, size_t size, std::string &out)
+{
+	d.decompress_block(data, size, out);
+}
+
+inline void codec_compress(snappy_compressor &c, const char *data, size_t size, std::string &out)
+{
+	c.compress_block(data, size, out);
+}
 
 }}}
 
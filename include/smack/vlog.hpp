@@ -0,0 +1,366 @@
+#ifndef __SMACK_VLOG_HPP
+#define __SMACK_VLOG_HPP
+
+#include <map>
+#include <set>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/stream.hpp>
+
+#include <smack/base.hpp>
+
+namespace ioremap { namespace smack {
+
+namespace bio = boost::iostreams;
+
+/* record with SMACK_INDEX_FLAGS_VLOG flag stores this pointer instead of its data */
+struct vlog_ptr {
+	uint64_t		gen;			/* value log file */
+	uint64_t		offset;			/* offset of the value data within the file */
+	uint64_t		size;			/* value size */
+} __attribute__ ((packed));
+
+/*
+ * Large values kept out of chunks, so compaction only moves small pointers.
+ * Values are appended to files <path>.vlog.<gen> together with their index,
+ * so garbage collection can find the key which owns every value.
+ * Only the newest file is appended, older ones are removed by garbage collection.
+ */
+class value_log {
+	public:
+		value_log(const std::string &path, uint64_t max_file_size) :
+		m_path(path),
+		m_max_file_size(max_file_size),
+		m_gen(1),
+		m_size(0)
+		{
+			namespace fs = boost::filesystem;
+
+			fs::path base(path);
+			std::string prefix = base.filename().string() + ".vlog.";
+
+			fs::path dir = base.parent_path();
+			if (dir.empty())
+				dir = ".";
+
+			fs::directory_iterator end_itr;
+			for (fs::directory_iterator itr(dir); itr != end_itr; ++itr) {
+				std::string name = itr->path().filename().string();
+
+				if (name.compare(0, prefix.size(), prefix) || !fs::is_regular_file(itr->path()))
+					continue;
+
+				uint64_t gen = strtoull(name.c_str() + prefix.size(), NULL, 10);
+				if (!gen)
+					continue;
+
+				m_files[gen] = fs::file_size(itr->path());
+			}
+
+			if (!m_files.empty()) {
+				m_gen = m_files.rbegin()->first;
+				m_size = m_files.rbegin()->second;
+
+				/* appends must not land after the record torn by a crash, readers would stop at it */
+				uint64_t size = complete_size(m_gen, m_size);
+				if (size != m_size) {
+					log(SMACK_LOG_ERROR, "%s: value-log: gen: %zd: truncating torn tail: size: %zd, complete: %zd\n",
+							m_path.c_str(), m_gen, m_size, size);
+
+					fs::resize_file(file(m_gen), size);
+					m_size = size;
+					m_files[m_gen] = size;
+				}
+			}
+
+			log(SMACK_LOG_NOTICE, "%s: value-log: files: %zd, gen: %zd, size: %zd\n",
+					m_path.c_str(), m_files.size(), m_gen, m_size);
+		}
+
+		/* sequential reader of the single value log file */
+		class reader {
+			public:
+				reader(const value_log &vlog, uint64_t gen) :
+				m_path(vlog.file(gen)),
+				m_src(m_path),
+				m_offset(0),
+				m_next(0)
+				{
+				}
+
+				/* false at the end of file, partially written tail record is ignored */
+				bool next() {
+					m_offset = m_next;
+
+					if (bio::read<bio::file_source>(m_src, (char *)&m_idx, sizeof(struct index)) != sizeof(struct index))
+						return false;
+
+					m_data.resize(m_idx.data_size);
+					if (m_idx.data_size &&
+							(bio::read<bio::file_source>(m_src, (char *)m_data.data(), m_data.size()) !=
+							 (std::streamsize)m_data.size()))
+						return false;
+
+					m_next = m_offset + sizeof(struct index) + m_data.size();
+					return true;
+				}
+
+				const struct index *idx() const {
+					return &m_idx;
+				}
+
+				const std::string &data() const {
+					return m_data;
+				}
+
+				/* offset of the value data, the same as stored in vlog_ptr */
+				uint64_t offset() const {
+					return m_offset + sizeof(struct index);
+				}
+
+			private:
+				std::string m_path;
+				bio::file_source m_src;
+				uint64_t m_offset, m_next;
+				struct index m_idx;
+				std::string m_data;
+		};
+
+		/* parses record data of the SMACK_INDEX_FLAGS_VLOG record */
+		static struct vlog_ptr pointer(const std::string &data) {
+			if (data.size() != sizeof(struct vlog_ptr)) {
+				std::ostringstream str;
+				str << "value-log: invalid pointer size: " << data.size();
+				throw std::runtime_error(str.str());
+			}
+
+			struct vlog_ptr ptr;
+			memcpy(&ptr, data.data(), sizeof(struct vlog_ptr));
+			return ptr;
+		}
+
+		struct vlog_ptr append(const struct index &idx, const std::string &data) {
+			boost::mutex::scoped_lock guard(m_lock);
+
+			if (m_size && (m_size + sizeof(struct index) + data.size() > m_max_file_size)) {
+				m_gen++;
+				m_size = 0;
+			}
+
+			struct index tmp = idx;
+			tmp.flags &= ~SMACK_INDEX_FLAGS_VLOG;
+			tmp.data_size = data.size();
+
+			std::string path = file(m_gen);
+			bio::file_sink out(path, std::ios::app);
+			bool ok = (bio::write<bio::file_sink>(out, (char *)&tmp, sizeof(struct index)) == sizeof(struct index)) &&
+				(bio::write<bio::file_sink>(out, data.data(), data.size()) == (std::streamsize)data.size());
+			out.close();
+
+			if (!ok) {
+				/* the next append has to start right after the last complete record */
+				boost::system::error_code ec;
+				boost::filesystem::resize_file(path, m_size, ec);
+
+				std::ostringstream str;
+				str << path << ": value-log: short write: offset: " << m_size << ", size: " << data.size();
+				throw std::runtime_error(str.str());
+			}
+
+			m_dirty.insert(m_gen);
+
+			struct vlog_ptr ptr;
+			ptr.gen = m_gen;
+			ptr.offset = m_size + sizeof(struct index);
+			ptr.size = data.size();
+
+			m_size += sizeof(struct index) + data.size();
+			m_files[m_gen] = m_size;
+
+			return ptr;
+		}
+
+		/* files appended since the previous call are synced to disk */
+		void sync() {
+			std::set<uint64_t> dirty;
+			{
+				boost::mutex::scoped_lock guard(m_lock);
+				dirty.swap(m_dirty);
+			}
+
+			for (std::set<uint64_t>::iterator it = dirty.begin(); it != dirty.end(); ++it) {
+				int fd = open(file(*it).c_str(), O_RDONLY);
+				if (fd < 0)
+					continue;
+
+				int err = fsync(fd);
+				close(fd);
+
+				if (err) {
+					std::ostringstream str;
+					str << file(*it) << ": value-log: sync failed: " << strerror(errno);
+					throw std::runtime_error(str.str());
+				}
+			}
+		}
+
+		void read(const struct vlog_ptr &ptr, std::string &ret) {
+			std::string path = file(ptr.gen);
+			bio::file_source in(path);
+
+			std::streamsize pos = bio::seek<bio::file_source>(in, ptr.offset, std::ios_base::beg);
+			ret.resize(ptr.size);
+			if ((pos != (std::streamsize)ptr.offset) ||
+					(ptr.size && (bio::read<bio::file_source>(in, (char *)ret.data(), ptr.size) != (std::streamsize)ptr.size))) {
+				std::ostringstream str;
+				str << path << ": value-log: short read: offset: " << ptr.offset << ", size: " << ptr.size;
+				throw std::runtime_error(str.str());
+			}
+		}
+
+		/* value of the record which was dropped by compaction becomes garbage */
+		void release(const struct index *idx, const std::string &data) {
+			if (!(idx->flags & SMACK_INDEX_FLAGS_VLOG))
+				return;
+
+			struct vlog_ptr ptr = pointer(data);
+
+			boost::mutex::scoped_lock guard(m_lock);
+			if (m_files.find(ptr.gen) == m_files.end())
+				return;
+
+			m_garbage[ptr.gen] += sizeof(struct index) + ptr.size;
+			m_changed.insert(ptr.gen);
+		}
+
+		/* garbage counters loaded from disk */
+		void set_garbage(const std::map<uint64_t, uint64_t> &garbage) {
+			boost::mutex::scoped_lock guard(m_lock);
+
+			for (std::map<uint64_t, uint64_t>::const_iterator it = garbage.begin(); it != garbage.end(); ++it) {
+				if (m_files.find(it->first) != m_files.end())
+					m_garbage[it->first] = it->second;
+			}
+		}
+
+		/* garbage counters to be stored on disk, all of them or only changed since the previous call */
+		std::map<uint64_t, uint64_t> garbage(bool all) {
+			boost::mutex::scoped_lock guard(m_lock);
+
+			std::map<uint64_t, uint64_t> ret;
+			for (std::map<uint64_t, uint64_t>::iterator it = m_garbage.begin(); it != m_garbage.end(); ++it) {
+				if (all || (m_changed.find(it->first) != m_changed.end()))
+					ret.insert(*it);
+			}
+
+			m_changed.clear();
+			return ret;
+		}
+
+		/* selects the older file with the largest share of garbage if it is at least @ratio percent */
+		bool pick_gc(int ratio, uint64_t &gen) {
+			boost::mutex::scoped_lock guard(m_lock);
+
+			double best = 0;
+			for (std::map<uint64_t, uint64_t>::iterator it = m_garbage.begin(); it != m_garbage.end(); ++it) {
+				if (it->first == m_gen)
+					continue;
+
+				uint64_t size = std::max<uint64_t>(m_files[it->first], 1);
+				double share = (double)it->second / size;
+
+				if ((it->second * 100 >= size * ratio) && (share > best)) {
+					best = share;
+					gen = it->first;
+				}
+			}
+
+			return best > 0;
+		}
+
+		void remove(uint64_t gen) {
+			boost::mutex::scoped_lock guard(m_lock);
+
+			m_files.erase(gen);
+			m_garbage.erase(gen);
+			m_changed.erase(gen);
+			m_dirty.erase(gen);
+
+			boost::filesystem::remove(file(gen));
+		}
+
+		void remove_all() {
+			boost::mutex::scoped_lock guard(m_lock);
+
+			for (std::map<uint64_t, uint64_t>::iterator it = m_files.begin(); it != m_files.end(); ++it)
+				boost::filesystem::remove(file(it->first));
+
+			m_files.clear();
+			m_garbage.clear();
+			m_changed.clear();
+			m_dirty.clear();
+			m_size = 0;
+		}
+
+		bool empty() {
+			boost::mutex::scoped_lock guard(m_lock);
+			return m_files.empty();
+		}
+
+		/* total size of all files */
+		uint64_t size() {
+			boost::mutex::scoped_lock guard(m_lock);
+
+			uint64_t size = 0;
+			for (std::map<uint64_t, uint64_t>::iterator it = m_files.begin(); it != m_files.end(); ++it)
+				size += it->second;
+
+			return size;
+		}
+
+		std::string file(uint64_t gen) const {
+			return m_path + ".vlog." + boost::lexical_cast<std::string>(gen);
+		}
+
+	private:
+		boost::mutex m_lock;
+		std::string m_path;
+		uint64_t m_max_file_size;
+
+		/* file being appended */
+		uint64_t m_gen, m_size;
+
+		/* file sizes and their garbage bytes */
+		std::map<uint64_t, uint64_t> m_files;
+		std::map<uint64_t, uint64_t> m_garbage;
+		std::set<uint64_t> m_changed;
+
+		/* files appended since the last sync() */
+		std::set<uint64_t> m_dirty;
+
+		/* size of the complete records at the start of the file */
+		uint64_t complete_size(uint64_t gen, uint64_t size) {
+			bio::file_source in(file(gen));
+
+			uint64_t offset = 0;
+			while (offset + sizeof(struct index) <= size) {
+				struct index idx;
+				if (bio::read<bio::file_source>(in, (char *)&idx, sizeof(struct index)) != sizeof(struct index))
+					break;
+
+				if (idx.data_size > size - offset - sizeof(struct index))
+					break;
+
+				offset += sizeof(struct index) + idx.data_size;
+				bio::seek<bio::file_source>(in, offset, std::ios_base::beg);
+			}
+
+			return offset;
+		}
+};
+
+}}
+
+#endif /* __SMACK_VLOG_HPP */
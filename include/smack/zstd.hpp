@@ -0,0 +1,413 @@
+#ifndef __SMACK_ZSTD_HPP
+#define __SMACK_ZSTD_HPP
+
+#include <algorithm>
+#include <vector>
+
+#include <iosfwd>                       // streamsize
+#include <boost/iostreams/concepts.hpp> // multichar_input_filter
+#include <boost/iostreams/operations.hpp>
+#include <boost/iostreams/char_traits.hpp>
+
+#include <zstd.h>
+#include <zdict.h>
+
+#include <smack/base.hpp>
+#include <smack/codec.hpp>
+
+namespace bio = boost::iostreams;
+
+namespace ioremap { namespace smack { namespace zstd {
+
+enum state {
+	s_start = 0,
+	s_done,
+	s_have_data,
+};
+
+struct header {
+	int32_t		compressed_size;
+	int32_t		uncompressed_size;
+};
+
+/*
+ * Frames carry ID of the dictionary they were compressed with,
+ * so the decompressor picks it from all dictionaries of the store.
+ */
+class decompressor : public bio::multichar_input_filter {
+	public:
+		explicit decompressor(size_t chunk_size = 1024 * 1024) :
+		s_state(s_start),
+		m_chunk(chunk_size),
+		m_dec_offset(0)
+		{
+		}
+
+		void setup(const codec_params &p) {
+			m_dicts = p.dicts;
+		}
+
+		template<typename Source>
+		std::streamsize read(Source& src, char *s, std::streamsize n) {
+			std::streamsize total = 0;
+			std::streamsize tmp;
+
+			while (total < n) {
+				if (s_state == s_have_data) {
+					tmp = copy(s + total, n);
+					n -= tmp;
+					total += tmp;
+
+					if (n == 0)
+						break;
+				}
+
+				struct header header;
+				std::streamsize h = bio::read(src, (char *)&header, sizeof(struct header));
+				if (h < 0) {
+					if (!total)
+						total = -1;
+					break;
+				}
+
+				m_chunk.resize(header.compressed_size);
+				std::streamsize have = bio::read(src, (char *)m_chunk.data(), header.compressed_size);
+				if (have == -1) {
+					if (!total)
+						total = -1;
+					break;
+				}
+
+				m_dec.resize(header.uncompressed_size);
+				if (!decompress_frame(m_chunk.data(), have, m_dec.data(), header.uncompressed_size))
+					return -1;
+
+				m_dec_offset = 0;
+				s_state = s_have_data;
+
+				tmp = copy(s + total, n);
+				n -= tmp;
+				total += tmp;
+			}
+
+			return total;
+		}
+
+		template<typename Source>
+		void close(Source &) {
+			s_state = s_start;
+		}
+
+		/* decompresses all frames of @data straight into @out */
+		void decompress_block(const char *data, size_t size, std::string &out) {
+			size_t total = 0;
+			for (size_t pos = 0; pos < size; ) {
+				struct header header = frame(data, size, pos);
+
+				total += header.uncompressed_size;
+				pos += sizeof(struct header) + header.compressed_size;
+			}
+
+			out.resize(total);
+
+			size_t offset = 0;
+			for (size_t pos = 0; pos < size; ) {
+				struct header header = frame(data, size, pos);
+
+				if (!decompress_frame(data + pos + sizeof(struct header), header.compressed_size,
+							(char *)out.data() + offset, header.uncompressed_size))
+					throw std::runtime_error("zstd: corrupted frame");
+
+				offset += header.uncompressed_size;
+				pos += sizeof(struct header) + header.compressed_size;
+			}
+		}
+
+	private:
+		state s_state;
+		std::vector<char> m_chunk;
+		std::vector<char> m_dec;
+		std::streamsize m_dec_offset;
+		boost::shared_ptr<ZSTD_DCtx> m_ctx;
+		boost::shared_ptr<const codec_dicts_t> m_dicts;
+
+		static struct header frame(const char *data, size_t size, size_t pos) {
+			struct header header;
+
+			if (pos + sizeof(struct header) > size)
+				throw std::runtime_error("zstd: truncated frame header");
+
+			memcpy(&header, data + pos, sizeof(struct header));
+			if ((header.compressed_size < 0) || (header.uncompressed_size < 0) ||
+					(pos + sizeof(struct header) + header.compressed_size > size))
+				throw std::runtime_error("zstd: invalid frame header");
+
+			return header;
+		}
+
+		bool decompress_frame(const char *src, size_t size, char *dst, size_t dst_size) {
+			if (!m_ctx)
+				m_ctx.reset(ZSTD_createDCtx(), ZSTD_freeDCtx);
+
+			size_t ret;
+			unsigned id = ZSTD_getDictID_fromFrame(src, size);
+			if (id)
+				ret = ZSTD_decompress_usingDDict(m_ctx.get(), dst, dst_size, src, size, ddict(id));
+			else
+				ret = ZSTD_decompressDCtx(m_ctx.get(), dst, dst_size, src, size);
+
+			if (ZSTD_isError(ret) || (ret != dst_size)) {
+				log(SMACK_LOG_ERROR, "zstd: decompress: compressed: %zd, uncompressed: %zd, dict: %u, ret: %zd: %s\n",
+						size, dst_size, id, ret, ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "size mismatch");
+				return false;
+			}
+
+			log(SMACK_LOG_DEBUG, "zstd: decompress: %zd -> %zd, dict: %u\n", size, dst_size, id);
+			return true;
+		}
+
+		const ZSTD_DDict *ddict(unsigned id) {
+			codec_dicts_t::const_iterator it;
+			if (!m_dicts || ((it = m_dicts->find(id)) == m_dicts->end())) {
+				std::ostringstream str;
+				str << "zstd: decompress: unknown dictionary: " << id;
+				throw std::runtime_error(str.str());
+			}
+
+			codec_dict &d = *it->second;
+			boost::mutex::scoped_lock guard(d.lock);
+			if (!d.dstate)
+				d.dstate.reset(ZSTD_createDDict(d.data.data(), d.data.size()), ZSTD_freeDDict);
+
+			return (const ZSTD_DDict *)d.dstate.get();
+		}
+
+		std::streamsize copy(char *s, std::streamsize have_space) {
+			std::streamsize sz = std::min<std::streamsize>(have_space, m_dec.size() - m_dec_offset);
+
+			memcpy(s, m_dec.data() + m_dec_offset, sz);
+			m_dec_offset += sz;
+
+			if (m_dec_offset == (std::streamsize)m_dec.size()) {
+				s_state = s_start;
+				m_dec_offset = 0;
+			}
+
+			return sz;
+		}
+};
+
+class compressor : public bio::multichar_output_filter {
+	public:
+		explicit compressor(size_t chunk_size = 1024 * 1024) :
+		s_state(s_start),
+		m_chunk(chunk_size),
+		m_chunk_size(0),
+		m_compr_offset(0),
+		m_level(ZSTD_CLEVEL_DEFAULT)
+		{
+		}
+
+		void setup(const codec_params &p) {
+			m_level = p.level ? p.level : ZSTD_CLEVEL_DEFAULT;
+			m_dict = p.dict;
+		}
+
+		template<typename Sink>
+		std::streamsize write(Sink& dst, const char* s, std::streamsize n) {
+			std::streamsize consumed = 0;
+			std::streamsize tmp;
+
+			while (consumed < n) {
+				if (s_state == s_start) {
+					if (m_chunk_size + n < (std::streamsize)m_chunk.size()) {
+						memcpy((char *)m_chunk.data() + m_chunk_size, s, n);
+						m_chunk_size += n;
+						consumed += n;
+					} else {
+						compress(dst);
+					}
+				}
+
+				if (s_state == s_have_data) {
+					tmp = copy<Sink>(dst);
+					if (tmp < 0) {
+						if (consumed)
+							return consumed;
+
+						return -1;
+					}
+				}
+			}
+
+			return consumed;
+		}
+
+		template<typename Sink>
+		void close(Sink &dst) {
+			if (s_state == s_have_data)
+				copy<Sink>(dst);
+
+			if ((s_state == s_start) && (m_chunk_size > 0)) {
+				compress(dst);
+				copy<Sink>(dst);
+			}
+
+			s_state = s_start;
+		}
+
+		/* frames are smaller than the stream chunk, so the stream decompressor reads them too */
+		void compress_block(const char *data, size_t size, std::string &out) {
+			while (size) {
+				size_t frame = std::min(size, m_chunk.size() - 1);
+				size_t pos = out.size();
+
+				out.resize(pos + sizeof(struct header) + ZSTD_compressBound(frame));
+				size_t compressed = compress_frame(data, frame, (char *)out.data() + pos + sizeof(struct header),
+						out.size() - pos - sizeof(struct header));
+
+				struct header header;
+				header.compressed_size = compressed;
+				header.uncompressed_size = frame;
+
+				memcpy((char *)out.data() + pos, &header, sizeof(struct header));
+				out.resize(pos + sizeof(struct header) + compressed);
+
+				data += frame;
+				size -= frame;
+			}
+		}
+
+	private:
+		state s_state;
+		std::vector<char> m_chunk;
+		std::streamsize m_chunk_size;
+		std::string m_compr;
+		std::streamsize m_compr_offset;
+		int m_level;
+		boost::shared_ptr<codec_dict> m_dict;
+		boost::shared_ptr<ZSTD_CCtx> m_ctx;
+
+		/* prepared dictionary is shared by all compressors of the process, so they have to use the same level */
+		const ZSTD_CDict *cdict() {
+			boost::mutex::scoped_lock guard(m_dict->lock);
+			if (!m_dict->cstate)
+				m_dict->cstate.reset(ZSTD_createCDict(m_dict->data.data(), m_dict->data.size(), m_level), ZSTD_freeCDict);
+
+			return (const ZSTD_CDict *)m_dict->cstate.get();
+		}
+
+		size_t compress_frame(const char *src, size_t size, char *dst, size_t dst_size) {
+			if (!m_ctx)
+				m_ctx.reset(ZSTD_createCCtx(), ZSTD_freeCCtx);
+
+			size_t compressed;
+			if (m_dict)
+				compressed = ZSTD_compress_usingCDict(m_ctx.get(), dst, dst_size, src, size, cdict());
+			else
+				compressed = ZSTD_compressCCtx(m_ctx.get(), dst, dst_size, src, size, m_level);
+
+			if (ZSTD_isError(compressed))
+				throw std::runtime_error(std::string("zstd: compress: ") + ZSTD_getErrorName(compressed));
+
+			log(SMACK_LOG_DEBUG, "zstd: compress: %zd -> %zd, level: %d, dict: %u\n",
+					size, compressed, m_level, m_dict ? m_dict->id : 0);
+			return compressed;
+		}
+
+		template<typename Sink>
+		void compress(Sink &dst) {
+			m_compr.resize(ZSTD_compressBound(m_chunk_size));
+			m_compr.resize(compress_frame(m_chunk.data(), m_chunk_size, (char *)m_compr.data(), m_compr.size()));
+
+			struct header header;
+
+			header.compressed_size = m_compr.size();
+			header.uncompressed_size = m_chunk_size;
+
+			bio::write(dst, (char *)&header, sizeof(struct header));
+
+			m_compr_offset = 0;
+			s_state = s_have_data;
+			m_chunk_size = 0;
+		}
+
+		template<typename Sink>
+		std::streamsize copy(Sink &dst) {
+			std::streamsize written = bio::write(dst, m_compr.data() + m_compr_offset, m_compr.size() - m_compr_offset);
+			if (written < 0)
+				return written;
+
+			m_compr_offset += written;
+			if (m_compr_offset == (std::streamsize)m_compr.size()) {
+				s_state = s_start;
+				m_compr_offset = 0;
+			}
+
+			return written;
+		}
+};
+
+inline void codec_setup(compressor &c, const codec_params &p)
+{
+	c.setup(p);
+}
+
+inline void codec_setup(decompressor &d, const codec_params &p)
+{
+	d.setup(p);
+}
+
+inline bool codec_block(const compressor *)
+{
+	return true;
+}
+
+inline bool codec_block(const decompressor *)
+{
+	return true;
+}
+
+inline void codec_compress(compressor &c, const char *data, size_t size, std::string &out)
+{
+	c.compress_block(data, size, out);
+}
+
+inline void codec_decompress(decompressor &d, const char *data, size_t size, std::string &out)
+{
+	d.decompress_block(data, size, out);
+}
+
+/* trains dictionary of at most @dict_size bytes, samples should be about a hundred times larger */
+inline bool codec_train(const compressor &, const std::vector<std::string> &samples, size_t dict_size, codec_dict &dict)
+{
+	std::string buf;
+	std::vector<size_t> sizes;
+
+	for (std::vector<std::string>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+		buf.append(*it);
+		sizes.push_back(it->size());
+	}
+
+	if (sizes.empty() || !dict_size)
+		return false;
+
+	dict.data.resize(dict_size);
+	size_t ret = ZDICT_trainFromBuffer((char *)dict.data.data(), dict.data.size(), buf.data(), sizes.data(), sizes.size());
+	if (ZDICT_isError(ret)) {
+		log(SMACK_LOG_ERROR, "zstd: train: samples: %zd, size: %zd: %s\n",
+				sizes.size(), buf.size(), ZDICT_getErrorName(ret));
+		return false;
+	}
+
+	dict.data.resize(ret);
+	dict.id = ZDICT_getDictID(dict.data.data(), dict.data.size());
+
+	log(SMACK_LOG_INFO, "zstd: train: samples: %zd, size: %zd -> dict: %u, size: %zd\n",
+			sizes.size(), buf.size(), dict.id, dict.data.size());
+	return dict.id != 0;
+}
+
+}}}
+
+#endif /* __SMACK_ZSTD_HPP */
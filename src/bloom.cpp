@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include <smack/base.hpp>
 
 using namespace ioremap::smack;
@@ -32,13 +34,22 @@ static unsigned int h2(const char *data, int size)
 }
 #endif
 
-bloom::bloom(const int bloom_size)
+const int bloom::block_size;
+const int bloom::blocked_probes;
+const int bloom::key_tail;
+
+/* lane shifts which take 6 bits of the key for every 64-bit word of the block */
+static const bloom_line_t bloom_lane_shift = { 0, 6, 12, 18, 24, 30, 36, 42 };
+static const bloom_line_t bloom_lane_one = { 1, 1, 1, 1, 1, 1, 1, 1 };
+
+bloom::bloom(const int bloom_size, const int probes, const bool blocked) : m_probes(probes), m_blocked(blocked)
 {
 	add_hashes();
 	m_data.resize(bloom_size);
 }
 
-bloom::bloom(const std::vector<char> &data) : m_data(data)
+bloom::bloom(const std::vector<char> &data, const int probes, const bool blocked) :
+m_data(data.begin(), data.end()), m_probes(probes), m_blocked(blocked)
 {
 	add_hashes();
 }
@@ -47,10 +58,105 @@ bloom::~bloom()
 {
 }
 
+void bloom::reset(const int bloom_size, const int probes, const bool blocked)
+{
+	int size = std::max(bloom_size, 1);
+	if (blocked)
+		size = (size + block_size - 1) / block_size * block_size;
+
+	m_data.assign(size, 0);
+	m_probes = blocked ? blocked_probes : probes;
+	m_blocked = blocked;
+}
+
+/*
+ * 64-bit hash of the whole key, its halves are combined into @m_probes probes (double hashing),
+ * so every probe depends on all key bytes and no extra hash functions are needed
+ */
+uint64_t bloom::hash(const char *data, int size)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+	int i;
+
+	for (i = 0; i + (int)sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t w;
+
+		memcpy(&w, data + i, sizeof(uint64_t));
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+
+	for (; i < size; ++i)
+		h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/*
+ * Full-size keys are SHA-512 digests, so their tail bytes are used without hashing.
+ * Head bytes are not used since keys of one chunk are sorted and share them.
+ * Shorter keys are natural application keys, they are hashed.
+ */
+void bloom::tail(const char *data, int size, char *tail)
+{
+	if (size == SMACK_KEY_SIZE) {
+		memcpy(tail, data + size - key_tail, key_tail);
+		return;
+	}
+
+	uint64_t h = hash(data, size);
+	memcpy(tail, &h, sizeof(uint64_t));
+
+	h = (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+	memcpy(tail + sizeof(uint64_t), &h, sizeof(uint64_t));
+}
+
+/* the last 8 bytes of the tail select the block, 48 bits before them select one bit in every word of the block */
+const char *bloom::blocked_probe(const char *tail, bloom_line_t &mask) const
+{
+	uint64_t bits, sel;
+
+	memcpy(&bits, tail, sizeof(uint64_t));
+	memcpy(&sel, tail + sizeof(uint64_t), sizeof(uint64_t));
+
+	bloom_line_t lanes = { bits, bits, bits, bits, bits, bits, bits, bits };
+	mask = bloom_lane_one << ((lanes >> bloom_lane_shift) & 63);
+
+	uint64_t blocks = m_data.size() / block_size;
+	return &m_data[((sel >> 32) * blocks >> 32) * block_size];
+}
+
 void bloom::add(const char *data, int size)
 {
 	unsigned int h, byte, bit;
 
+	if (m_blocked) {
+		char t[key_tail];
+
+		tail(data, size, t);
+		add_tail(t);
+		return;
+	}
+
+	if (m_probes) {
+		uint64_t bits = m_data.size() * 8;
+		uint64_t hv = hash(data, size);
+		uint64_t h1 = hv & 0xffffffff, h2 = (hv >> 32) | 1;
+
+		for (int i = 0; i < m_probes; ++i) {
+			uint64_t b = (h1 + i * h2) % bits;
+			m_data[b / 8] |= 1 << (b % 8);
+		}
+		return;
+	}
+
 	for (std::vector<bloom_hash_t>::iterator it = m_hashes.begin(); it < m_hashes.end(); ++it) {
 		h = (*it)(data, size) % (m_data.size() * 8);
 		byte = h / 8;
@@ -60,10 +166,56 @@ void bloom::add(const char *data, int size)
 	}
 }
 
+void bloom::add_tail(const char *tail)
+{
+	bloom_line_t mask, line;
+	char *block = (char *)blocked_probe(tail, mask);
+
+	memcpy(&line, block, block_size);
+	line |= mask;
+	memcpy(block, &line, block_size);
+}
+
 bool bloom::check(const char *data, int size)
 {
 	unsigned int h, byte, bit;
 
+	/* meta-only chunk has no filter */
+	if (m_data.empty())
+		return true;
+
+	if (m_blocked) {
+		bloom_line_t mask, line;
+		char t[key_tail];
+
+		tail(data, size, t);
+		const char *block = blocked_probe(t, mask);
+
+		/* the whole block is a single cache line, all probes are checked at once */
+		memcpy(&line, block, block_size);
+		bloom_line_t miss = mask & ~line;
+
+		uint64_t any = 0;
+		for (int i = 0; i < blocked_probes; ++i)
+			any |= miss[i];
+
+		return !any;
+	}
+
+	if (m_probes) {
+		uint64_t bits = m_data.size() * 8;
+		uint64_t hv = hash(data, size);
+		uint64_t h1 = hv & 0xffffffff, h2 = (hv >> 32) | 1;
+
+		for (int i = 0; i < m_probes; ++i) {
+			uint64_t b = (h1 + i * h2) % bits;
+			if (!(m_data[b / 8] & (1 << (b % 8))))
+				return false;
+		}
+
+		return true;
+	}
+
 	for (std::vector<bloom_hash_t>::iterator it = m_hashes.begin(); it < m_hashes.end(); ++it) {
 		h = (*it)(data, size) % (m_data.size() * 8);
 		byte = h / 8;
@@ -76,6 +228,23 @@ bool bloom::check(const char *data, int size)
 	return true;
 }
 
+int bloom::probes() const
+{
+	return m_probes;
+}
+
+bool bloom::blocked() const
+{
+	return m_blocked;
+}
+
+int bloom::optimal_probes(double bits_per_key)
+{
+	int probes = (int)(bits_per_key * 0.69 + 0.5);
+
+	return std::min(std::max(probes, 1), 30);
+}
+
 void bloom::add_hashes(void)
 {
 	m_hashes.push_back(h1);
@@ -84,7 +253,7 @@ void bloom::add_hashes(void)
 #endif
 }
 
-const std::vector<char> &bloom::data() const
+const bloom_data_t &bloom::data() const
 {
 	return m_data;
 }
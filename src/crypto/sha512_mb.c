@@ -0,0 +1,233 @@
+/*
+ * Multi-buffer SHA-512: every 64-bit lane of the vector hashes its own message,
+ * so eight short messages are hashed in about the time of two or three single ones.
+ * AVX-512 keeps all lanes in one register and has native rotates, AVX2 splits them in two.
+ */
+
+#include "sha512.h"
+#include "sha512_mb.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SHA512_MB_SIMD
+#endif
+
+#ifdef SHA512_MB_SIMD
+
+#define SHA512_MB_LANES		8
+#define SHA512_MB_BLOCK		128
+
+typedef uint64_t vu64 __attribute__ ((vector_size (SHA512_MB_LANES * 8)));
+
+static const uint64_t sha512_mb_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+static const uint64_t sha512_mb_init[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (64 - (n))))
+#define SS0(x)		(ROR(x, 28) ^ ROR(x, 34) ^ ROR(x, 39))
+#define SS1(x)		(ROR(x, 14) ^ ROR(x, 18) ^ ROR(x, 41))
+#define S0(x)		(ROR(x, 1) ^ ROR(x, 8) ^ ((x) >> 7))
+#define S1(x)		(ROR(x, 19) ^ ROR(x, 61) ^ ((x) >> 6))
+
+#define M(t)		(w[(t) & 15] += S1(w[((t) - 2) & 15]) + w[((t) - 7) & 15] + S0(w[((t) - 15) & 15]))
+
+#define R(a, b, c, d, e, f, g, h, t)								\
+	do {											\
+		vu64 t1 = h + SS1(e) + (g ^ (e & (f ^ g))) + sha512_mb_k[t] +			\
+			((t) < 16 ? w[(t) & 15] : M(t));						\
+		vu64 t2 = SS0(a) + ((a & b) | (c & (a | b)));					\
+		d += t1;									\
+		h = t1 + t2;									\
+	} while (0)
+
+/* message sorted by the number of its padded blocks */
+struct sha512_mb_msg {
+	size_t		blocks;
+	size_t		pos;
+};
+
+static int sha512_mb_cmp(const void *l, const void *r)
+{
+	const struct sha512_mb_msg *ml = (const struct sha512_mb_msg *)l, *mr = (const struct sha512_mb_msg *)r;
+
+	if (ml->blocks != mr->blocks)
+		return ml->blocks < mr->blocks ? -1 : 1;
+	return ml->pos < mr->pos ? -1 : (ml->pos > mr->pos);
+}
+
+/* big-endian words of the block @b of the padded message */
+static void sha512_mb_block(const char *buf, size_t len, size_t b, uint64_t *w)
+{
+	unsigned char block[SHA512_MB_BLOCK];
+	size_t offset = b * SHA512_MB_BLOCK;
+	size_t last = (len + 17 + SHA512_MB_BLOCK - 1) / SHA512_MB_BLOCK - 1;
+	int i;
+
+	memset(block, 0, sizeof(block));
+
+	if (offset < len)
+		memcpy(block, buf + offset, len - offset < SHA512_MB_BLOCK ? len - offset : SHA512_MB_BLOCK);
+	if ((offset <= len) && (len - offset < SHA512_MB_BLOCK))
+		block[len - offset] = 0x80;
+
+	if (b == last) {
+		uint64_t hi = len >> 61, lo = len << 3;
+
+		for (i = 0; i < 8; ++i) {
+			block[SHA512_MB_BLOCK - 16 + i] = hi >> (56 - 8 * i);
+			block[SHA512_MB_BLOCK - 8 + i] = lo >> (56 - 8 * i);
+		}
+	}
+
+	for (i = 0; i < 16; ++i) {
+		uint64_t v;
+
+		memcpy(&v, block + i * 8, 8);
+		w[i] = __builtin_bswap64(v);
+	}
+}
+
+/*
+ * Hashes up to SHA512_MB_LANES messages of the same group, lanes which have fewer blocks keep their state.
+ * It is inlined into the per-instruction set functions below.
+ */
+static inline __attribute__ ((always_inline)) void
+sha512_mb_group(const char **buffers, const size_t *lens, const struct sha512_mb_msg *msgs, int num, void **resblocks)
+{
+	uint64_t words[SHA512_MB_LANES][16];
+	vu64 state[8], w[16];
+	size_t blocks = 0, b;
+	int lane, i, t;
+
+	for (i = 0; i < 8; ++i)
+		state[i] = (vu64) {} + sha512_mb_init[i];
+
+	for (lane = 0; lane < num; ++lane) {
+		if (msgs[lane].blocks > blocks)
+			blocks = msgs[lane].blocks;
+	}
+
+	for (b = 0; b < blocks; ++b) {
+		vu64 mask, a, bb, c, d, e, f, g, h;
+
+		memset(words, 0, sizeof(words));
+		for (lane = 0; lane < num; ++lane) {
+			if (b < msgs[lane].blocks)
+				sha512_mb_block(buffers[msgs[lane].pos], lens[msgs[lane].pos], b, words[lane]);
+		}
+
+		for (i = 0; i < 16; ++i) {
+			for (lane = 0; lane < SHA512_MB_LANES; ++lane)
+				w[i][lane] = words[lane][i];
+		}
+
+		for (lane = 0; lane < SHA512_MB_LANES; ++lane)
+			mask[lane] = ((lane < num) && (b < msgs[lane].blocks)) ? ~0ULL : 0;
+
+		a = state[0]; bb = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		/* variables are renamed instead of being moved, 8 rounds rotate them back */
+		for (t = 0; t < 80; t += 8) {
+			R(a, bb, c, d, e, f, g, h, t);
+			R(h, a, bb, c, d, e, f, g, t + 1);
+			R(g, h, a, bb, c, d, e, f, t + 2);
+			R(f, g, h, a, bb, c, d, e, t + 3);
+			R(e, f, g, h, a, bb, c, d, t + 4);
+			R(d, e, f, g, h, a, bb, c, t + 5);
+			R(c, d, e, f, g, h, a, bb, t + 6);
+			R(bb, c, d, e, f, g, h, a, t + 7);
+		}
+
+		state[0] += a & mask; state[1] += bb & mask; state[2] += c & mask; state[3] += d & mask;
+		state[4] += e & mask; state[5] += f & mask; state[6] += g & mask; state[7] += h & mask;
+	}
+
+	for (lane = 0; lane < num; ++lane) {
+		unsigned char *res = (unsigned char *)resblocks[msgs[lane].pos];
+
+		for (i = 0; i < 8; ++i) {
+			uint64_t v = __builtin_bswap64(state[i][lane]);
+			memcpy(res + i * 8, &v, 8);
+		}
+	}
+}
+
+static void __attribute__ ((target ("avx512f")))
+sha512_mb_group_avx512(const char **buffers, const size_t *lens, const struct sha512_mb_msg *msgs, int num, void **resblocks)
+{
+	sha512_mb_group(buffers, lens, msgs, num, resblocks);
+}
+
+static void __attribute__ ((target ("avx2")))
+sha512_mb_group_avx2(const char **buffers, const size_t *lens, const struct sha512_mb_msg *msgs, int num, void **resblocks)
+{
+	sha512_mb_group(buffers, lens, msgs, num, resblocks);
+}
+
+#endif /* SHA512_MB_SIMD */
+
+void sha512_buffers(const char **buffers, const size_t *lens, size_t num, void **resblocks)
+{
+	size_t i;
+
+#ifdef SHA512_MB_SIMD
+	int avx512 = __builtin_cpu_supports("avx512f");
+
+	if ((num > 1) && (avx512 || __builtin_cpu_supports("avx2"))) {
+		struct sha512_mb_msg *msgs = (struct sha512_mb_msg *)malloc(num * sizeof(struct sha512_mb_msg));
+
+		if (msgs) {
+			for (i = 0; i < num; ++i) {
+				msgs[i].blocks = (lens[i] + 17 + SHA512_MB_BLOCK - 1) / SHA512_MB_BLOCK;
+				msgs[i].pos = i;
+			}
+
+			/* messages of one group should have the same number of blocks, otherwise lanes idle */
+			qsort(msgs, num, sizeof(struct sha512_mb_msg), sha512_mb_cmp);
+
+			for (i = 0; i < num; i += SHA512_MB_LANES) {
+				int group = num - i < SHA512_MB_LANES ? num - i : SHA512_MB_LANES;
+
+				if (avx512)
+					sha512_mb_group_avx512(buffers, lens, msgs + i, group, resblocks);
+				else
+					sha512_mb_group_avx2(buffers, lens, msgs + i, group, resblocks);
+			}
+
+			free(msgs);
+			return;
+		}
+	}
+#endif
+
+	for (i = 0; i < num; ++i)
+		sha512_buffer(buffers[i], lens[i], resblocks[i]);
+}
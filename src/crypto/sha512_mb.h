@@ -0,0 +1,20 @@
+#ifndef SHA512_MB_H
+#define SHA512_MB_H 1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Computes SHA-512 digests of @num buffers, results are the same as sha512_buffer() ones.
+ * Several buffers are hashed at once in SIMD lanes when the CPU supports AVX2.
+ */
+extern void sha512_buffers(const char **buffers, const size_t *lens, size_t num, void **resblocks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHA512_MB_H */
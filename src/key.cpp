@@ -1,4 +1,5 @@
 #include "crypto/sha512.h"
+#include "crypto/sha512_mb.h"
 
 #include <smack/base.hpp>
 
@@ -14,46 +15,147 @@ key::key(const key &k)
 	idx_ = k.idx_;
 }
 
-key::key(const std::string &name)
+static inline uint64_t fast_hash_mix(uint64_t h)
 {
-	idx_.data_size = 0;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
 
-	sha512_buffer((const char *)name.data(), name.size(), (void *)idx_.id);
+	return h;
+}
+
+static inline uint64_t fast_hash_rol(uint64_t h, int n)
+{
+	return (h << n) | (h >> (64 - n));
+}
+
+/*
+ * Two 64-bit lanes consume the name 16 bytes at a time (murmur3-like),
+ * then every word of the key mixes both lanes with its own counter.
+ */
+static void fast_hash(const char *data, size_t size, unsigned char *id)
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0x9e3779b97f4a7c15ULL ^ size, h2 = 0x6a09e667f3bcc908ULL ^ size;
+	size_t i;
+
+	for (i = 0; i + 16 <= size; i += 16) {
+		uint64_t k1, k2;
+
+		memcpy(&k1, data + i, sizeof(uint64_t));
+		memcpy(&k2, data + i + 8, sizeof(uint64_t));
+
+		h1 ^= fast_hash_rol(k1 * c1, 31) * c2;
+		h1 = (fast_hash_rol(h1, 27) + h2) * 5 + 0x52dce729;
+
+		h2 ^= fast_hash_rol(k2 * c2, 33) * c1;
+		h2 = (fast_hash_rol(h2, 31) + h1) * 5 + 0x38495ab5;
+	}
+
+	uint64_t tail[2] = { 0, 0 };
+	memcpy(tail, data + i, size - i);
+	h1 ^= fast_hash_rol(tail[0] * c1, 31) * c2;
+	h2 ^= fast_hash_rol(tail[1] * c2, 33) * c1;
+
+	h1 += h2;
+	h2 += h1;
+	h1 = fast_hash_mix(h1);
+	h2 = fast_hash_mix(h2);
+
+	for (i = 0; i < SMACK_KEY_SIZE / sizeof(uint64_t); ++i) {
+		uint64_t w = fast_hash_mix(h1 + (i + 1) * 0x9e3779b97f4a7c15ULL) ^ fast_hash_rol(h2, 8 * i + 1);
+		memcpy(id + i * sizeof(uint64_t), &w, sizeof(uint64_t));
+	}
+}
+
+key::key(const std::string &name, enum key_hash hash)
+{
+	memset(&idx_, 0, sizeof(struct index));
+
+	if (hash == key_hash_fast)
+		fast_hash(name.data(), name.size(), idx_.id);
+	else
+		sha512_buffer((const char *)name.data(), name.size(), (void *)idx_.id);
+}
+
+void key::hash_batch(const std::vector<std::string> &names, std::vector<key> &keys, enum key_hash hash)
+{
+	keys.resize(names.size());
+
+	if (hash == key_hash_fast) {
+		for (size_t i = 0; i < names.size(); ++i) {
+			memset(&keys[i].idx_, 0, sizeof(struct index));
+			fast_hash(names[i].data(), names[i].size(), keys[i].idx_.id);
+		}
+
+		return;
+	}
+
+	std::vector<const char *> buffers(names.size());
+	std::vector<size_t> lens(names.size());
+	std::vector<void *> res(names.size());
+
+	for (size_t i = 0; i < names.size(); ++i) {
+		memset(&keys[i].idx_, 0, sizeof(struct index));
+
+		buffers[i] = names[i].data();
+		lens[i] = names[i].size();
+		res[i] = keys[i].idx_.id;
+	}
+
+	if (!names.empty())
+		sha512_buffers(&buffers[0], &lens[0], names.size(), &res[0]);
 }
 
 key::key(const unsigned char *id, int size)
 {
-	idx_.data_size = 0;
+	memset(&idx_, 0, sizeof(struct index));
 
+	/* there are no empty keys, zero size is the full-size zero key */
+	if (size < 1)
+		return;
 	if (size > SMACK_KEY_SIZE)
 		size = SMACK_KEY_SIZE;
 
 	memcpy(idx_.id, id, size);
-	if (size < SMACK_KEY_SIZE) {
-		memset(idx_.id + size, 0, SMACK_KEY_SIZE - size);
-	}
+	idx_.flags = SMACK_INDEX_SET_KEY_SIZE(0, size);
 }
 
 key::key(const struct index *idx)
 {
+	memset(&idx_, 0, sizeof(struct index));
+
 	if (idx)
-		idx_ = *idx;
+		set(idx);
 }
 
 key::~key()
 {
 }
 
-char *key::str(int len) const
+char *ioremap::smack::key_id_str(const unsigned char *id, int len)
 {
+	/* enough for every key printed by a single log message */
+	static __thread char raw_str[8][2 * SMACK_KEY_SIZE + 1];
+	static __thread int pos;
+
 	if (len > SMACK_KEY_SIZE)
 		len = SMACK_KEY_SIZE;
 
-	/* Yes, this is kind of non-constant behaviour */
+	char *ret = raw_str[pos];
+	pos = (pos + 1) % 8;
+
 	for (int i = 0; i < len; ++i)
-		sprintf((char *)&raw_str[2*i], "%02x", idx_.id[i]);
-	((char *)raw_str)[2 * len] = '\0';
-	return (char *)raw_str;
+		sprintf(&ret[2*i], "%02x", id[i]);
+	ret[2 * len] = '\0';
+	return ret;
+}
+
+char *key::str(int len) const
+{
+	return key_id_str(idx_.id, len);
 }
 
 bool key::operator >(const key &k) const
@@ -83,7 +185,7 @@ bool key::operator <=(const key &k) const
 
 key &key::operator =(const key &k)
 {
-	this->set(k.idx());
+	idx_ = k.idx_;
 	return *this;
 }
 
@@ -92,6 +194,11 @@ const unsigned char *key::id(void) const
 	return idx_.id;
 }
 
+int key::size(void) const
+{
+	return SMACK_INDEX_KEY_SIZE(idx_.flags);
+}
+
 const struct index *key::idx(void) const
 {
 	return &idx_;
@@ -99,21 +206,15 @@ const struct index *key::idx(void) const
 
 int key::cmp(const key &k) const
 {
-	const unsigned char *l = idx_.id;
-	const unsigned char *r = k.id();
-
-	for (int i = 0; i < SMACK_KEY_SIZE; ++i) {
-		if (l[i] < r[i])
-			return -1;
-		if (l[i] > r[i])
-			return 1;
-	}
-
-	return 0;
-	return (const int)memcmp(idx_.id, k.id(), SMACK_KEY_SIZE);
+	return key_id_cmp(idx_.id, size(), k.id(), k.size());
 }
 
+/* bytes past the end of the short key are ignored, so equal keys have equal IDs */
 void key::set(const struct index *idx)
 {
 	memcpy(&idx_, idx, sizeof(struct index));
+
+	int size = SMACK_INDEX_KEY_SIZE(idx_.flags);
+	if (size < SMACK_KEY_SIZE)
+		memset(idx_.id + size, 0, SMACK_KEY_SIZE - size);
 }
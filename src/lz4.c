@@ -129,6 +129,14 @@
 #  define expect(expr,value)    (expr)
 #endif
 
+#if defined(__GNUC__)
+#  define FORCE_INLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#  define FORCE_INLINE static __forceinline
+#else
+#  define FORCE_INLINE static inline
+#endif
+
 #define likely(expr)     expect((expr) != 0, 1)
 #define unlikely(expr)   expect((expr) != 0, 0)
 
@@ -637,6 +645,321 @@ int LZ4_compress(const char* source,
 
 
 
+//******************************
+// Fast and streaming compression
+//******************************
+// Streams keep hashed positions as indexes, so the dictionary (loaded one or the previous block)
+// does not have to be contiguous with the next block. Index of the dictionary start is currentOffset - dictSize.
+
+#define LZ4_DICT_SIZE (1 << MAXD_LOG)
+#define LZ4_MAX_INPUT_SIZE 0x7E000000
+#define LZ4_ACCELERATION_MAX 65537
+
+struct LZ4_stream_s
+{
+	U32 hashTable[HASHTABLESIZE];
+	const BYTE* dictionary;
+	U32 dictSize;
+	U32 currentOffset;
+};
+
+FORCE_INLINE int LZ4_count(const BYTE* pIn, const BYTE* pRef, const BYTE* const pInLimit)
+{
+	const BYTE* const pStart = pIn;
+
+	while likely(pIn<pInLimit-(STEPSIZE-1))
+	{
+		UARCH diff = AARCH(pRef) ^ AARCH(pIn);
+		if (!diff) { pIn+=STEPSIZE; pRef+=STEPSIZE; continue; }
+		pIn += LZ4_NbCommonBytes(diff);
+		return (int)(pIn - pStart);
+	}
+	if (LZ4_ARCH64) if ((pIn<(pInLimit-3)) && (A32(pRef) == A32(pIn))) { pIn+=4; pRef+=4; }
+	if ((pIn<(pInLimit-1)) && (A16(pRef) == A16(pIn))) { pIn+=2; pRef+=2; }
+	if ((pIn<pInLimit) && (*pRef == *pIn)) pIn++;
+	return (int)(pIn - pStart);
+}
+
+void LZ4_resetStream(LZ4_stream_t* stream)
+{
+	memset(stream, 0, sizeof(LZ4_stream_t));
+	stream->currentOffset = LZ4_DICT_SIZE;   // zeroed table entries are out of the window
+}
+
+LZ4_stream_t* LZ4_createStream(void)
+{
+	LZ4_stream_t* stream = (LZ4_stream_t*) malloc(sizeof(LZ4_stream_t));
+	if (stream) LZ4_resetStream(stream);
+	return stream;
+}
+
+int LZ4_freeStream(LZ4_stream_t* stream)
+{
+	free(stream);
+	return 0;
+}
+
+int LZ4_loadDict(LZ4_stream_t* stream, const char* dictionary, int dictSize)
+{
+	const BYTE* p = (const BYTE*) dictionary;
+	const BYTE* const dictEnd = p + (dictSize > 0 ? dictSize : 0);
+	U32 base;
+
+	LZ4_resetStream(stream);
+	if (dictEnd - p > LZ4_DICT_SIZE) p = dictEnd - LZ4_DICT_SIZE;
+
+	stream->dictionary = p;
+	stream->dictSize = (U32)(dictEnd - p);
+	base = stream->currentOffset;
+	stream->currentOffset += stream->dictSize;
+
+	while (p + MINMATCH <= dictEnd)
+	{
+		stream->hashTable[LZ4_HASH_VALUE(p)] = base + (U32)(p - stream->dictionary);
+		p += 3;
+	}
+
+	return (int) stream->dictSize;
+}
+
+void LZ4_attach_dictionary(LZ4_stream_t* working, const LZ4_stream_t* dictionaryStream)
+{
+	if (dictionaryStream) memcpy(working, dictionaryStream, sizeof(LZ4_stream_t));
+	else LZ4_resetStream(working);
+}
+
+int LZ4_saveDict(LZ4_stream_t* stream, char* safeBuffer, int maxDictSize)
+{
+	U32 size = stream->dictSize;
+
+	if (maxDictSize < 0) maxDictSize = 0;
+	if (size > (U32)maxDictSize) size = (U32)maxDictSize;
+	if (size) memmove(safeBuffer, stream->dictionary + stream->dictSize - size, size);
+
+	stream->dictionary = (const BYTE*) safeBuffer;
+	stream->dictSize = size;
+	return (int) size;
+}
+
+// Moves indexes down before they overflow, entries older than the dictionary end up out of the window
+static void LZ4_renormStream(LZ4_stream_t* stream)
+{
+	U32 delta = stream->currentOffset - stream->dictSize - LZ4_DICT_SIZE;
+	int i;
+
+	for (i = 0; i < HASHTABLESIZE; i++)
+		stream->hashTable[i] = (stream->hashTable[i] < delta) ? 0 : stream->hashTable[i] - delta;
+	stream->currentOffset -= delta;
+}
+
+FORCE_INLINE int LZ4_compress_generic(LZ4_stream_t* stream,
+				 const char* source,
+				 char* dest,
+				 int isize,
+				 int maxOutputSize,
+				 int acceleration,
+				 const int useDict)
+{
+	U32* const HashTable = stream->hashTable;
+	const BYTE* base;
+	const BYTE* dictionary;
+	const BYTE* dictEnd;
+	U32 srcIdx, dictIdx;
+
+	const BYTE* ip = (const BYTE*) source;
+	const BYTE* anchor = ip;
+	const BYTE* const iend = ip + isize;
+	const BYTE* const mflimit = iend - MFLIMIT;
+
+	BYTE* op = (BYTE*) dest;
+	BYTE* const oend = op + maxOutputSize;
+
+	int len, length;
+	const int skipStrength = SKIPSTRENGTH;
+	U32 forwardH, refIdx, offset;
+	const BYTE* ref;
+
+	if ((isize < 0) || (isize > LZ4_MAX_INPUT_SIZE)) return 0;
+	if (acceleration < 1) acceleration = 1;
+	if (acceleration > LZ4_ACCELERATION_MAX) acceleration = LZ4_ACCELERATION_MAX;
+	if (stream->currentOffset > 0x80000000) LZ4_renormStream(stream);
+
+	dictionary = stream->dictionary;
+	dictEnd = dictionary + stream->dictSize;
+	srcIdx = stream->currentOffset;
+	dictIdx = srcIdx - stream->dictSize;
+	base = (const BYTE*) source - srcIdx;
+
+#define LZ4_IDX(p)			((U32)((p) - base))
+#define LZ4_REF(i)			((useDict && ((i) < srcIdx)) ? dictionary + ((i) - dictIdx) : base + (i))
+	// Candidate is in the window and does not start in the last bytes of the dictionary,
+	// without dictionary the table is fresh and zeroed entries are too far back
+#define LZ4_VALID(i, cur)	(((cur) - (i) - 1 < MAX_DISTANCE) && \
+		(!useDict || (((i) >= dictIdx) && (((i) >= srcIdx) || ((i) + MINMATCH <= srcIdx)))))
+
+	// Init
+	if (isize<MINLENGTH) goto _last_literals;
+
+	// First Byte
+	HashTable[LZ4_HASH_VALUE(ip)] = LZ4_IDX(ip);
+	ip++; forwardH = LZ4_HASH_VALUE(ip);
+
+	// Main Loop
+	for ( ; ; )
+	{
+		int findMatchAttempts = (acceleration << skipStrength) + 3;
+		const BYTE* forwardIp = ip;
+		BYTE* token;
+
+		// Find a match
+		do {
+			U32 h = forwardH;
+			int step = findMatchAttempts++ >> skipStrength;
+			ip = forwardIp;
+			forwardIp = ip + step;
+
+			if unlikely(forwardIp > mflimit) { goto _last_literals; }
+
+			forwardH = LZ4_HASH_VALUE(forwardIp);
+			refIdx = HashTable[h];
+			HashTable[h] = LZ4_IDX(ip);
+
+		} while (!LZ4_VALID(refIdx, LZ4_IDX(ip)) || (A32(ref = LZ4_REF(refIdx)) != A32(ip)));
+
+		// Catch up
+		offset = LZ4_IDX(ip) - refIdx;
+		{
+			const BYTE* const lowRef = (useDict && (refIdx < srcIdx)) ? dictionary : (const BYTE*) source;
+			while ((ip>anchor) && (ref>lowRef) && unlikely(ip[-1]==ref[-1])) { ip--; ref--; }
+		}
+
+		// Encode Literal length
+		length = ip - anchor;
+		token = op++;
+		if unlikely(op + length + (length/255) + (1 + 2 + 1 + LASTLITERALS) > oend) return 0;   // Check output limit
+		if (length>=(int)RUN_MASK) { *token=(RUN_MASK<<ML_BITS); len = length-RUN_MASK; for(; len > 254 ; len-=255) *op++ = 255; *op++ = (BYTE)len; }
+		else *token = (length<<ML_BITS);
+
+		// Copy Literals
+		LZ4_BLINDCOPY(anchor, op, length);
+
+_next_match:
+		// Encode Offset
+		LZ4_WRITE_LITTLEENDIAN_16(op,offset);
+
+		// Start Counting, match in the dictionary may go on at the start of the source
+		if (useDict && (refIdx < srcIdx))
+		{
+			const BYTE* limit = ip + (dictEnd - ref);
+			if (limit > matchlimit) limit = matchlimit;
+			len = LZ4_count(ip+MINMATCH, ref+MINMATCH, limit);
+			if ((ip+MINMATCH+len == limit) && (limit < matchlimit))
+				len += LZ4_count(limit, (const BYTE*) source, matchlimit);
+		}
+		else len = LZ4_count(ip+MINMATCH, ref+MINMATCH, matchlimit);
+		ip += MINMATCH + len;
+
+		// Encode MatchLength
+		if unlikely(op + (len/255) + (1 + LASTLITERALS) > oend) return 0;   // Check output limit
+		if (len>=(int)ML_MASK) { *token+=ML_MASK; len-=ML_MASK; for(; len > 509 ; len-=510) { *op++ = 255; *op++ = 255; } if (len > 254) { len-=255; *op++ = 255; } *op++ = (BYTE)len; }
+		else *token += len;
+
+		// Test end of chunk
+		if (ip > mflimit) { anchor = ip;  break; }
+
+		// Fill table
+		HashTable[LZ4_HASH_VALUE(ip-2)] = LZ4_IDX(ip-2);
+
+		// Test next position
+		{
+			U32 h = LZ4_HASH_VALUE(ip);
+			refIdx = HashTable[h];
+			HashTable[h] = LZ4_IDX(ip);
+		}
+		if (LZ4_VALID(refIdx, LZ4_IDX(ip)) && (A32(ref = LZ4_REF(refIdx)) == A32(ip)))
+		{
+			offset = LZ4_IDX(ip) - refIdx;
+			token = op++; *token=0;
+			goto _next_match;
+		}
+
+		// Prepare next loop
+		anchor = ip++;
+		forwardH = LZ4_HASH_VALUE(ip);
+	}
+
+_last_literals:
+	// Encode Last Literals
+	{
+		int lastRun = iend - anchor;
+		if (op + lastRun + 1 + ((lastRun+255-RUN_MASK)/255) > oend) return 0;   // Check output limit
+		if (lastRun>=(int)RUN_MASK) { *op++=(RUN_MASK<<ML_BITS); lastRun-=RUN_MASK; for(; lastRun > 254 ; lastRun-=255) *op++ = 255; *op++ = (BYTE) lastRun; }
+		else *op++ = (lastRun<<ML_BITS);
+		memcpy(op, anchor, iend - anchor);
+		op += iend-anchor;
+	}
+
+	// Source becomes the dictionary of the next block
+	stream->currentOffset += isize;
+	if (isize > LZ4_DICT_SIZE) { stream->dictionary = iend - LZ4_DICT_SIZE; stream->dictSize = LZ4_DICT_SIZE; }
+	else { stream->dictionary = (const BYTE*) source; stream->dictSize = isize; }
+
+#undef LZ4_IDX
+#undef LZ4_REF
+#undef LZ4_VALID
+
+	// End
+	return (int) (((char*)op)-dest);
+}
+
+
+int LZ4_compress_fast_continue(LZ4_stream_t* stream,
+				 const char* source,
+				 char* dest,
+				 int isize,
+				 int maxOutputSize,
+				 int acceleration)
+{
+	return LZ4_compress_generic(stream, source, dest, isize, maxOutputSize, acceleration, 1);
+}
+
+
+int LZ4_compress_fast(const char* source,
+				 char* dest,
+				 int isize,
+				 int maxOutputSize,
+				 int acceleration)
+{
+	// Output can not overflow, the plain compressor is faster since it does not check it
+	if ((acceleration <= 1) && (maxOutputSize >= LZ4_compressBound(isize)))
+		return LZ4_compress(source, dest, isize);
+
+#if HEAPMODE
+	LZ4_stream_t* stream = LZ4_createStream();
+	int result;
+	if (stream == NULL) return 0;
+	result = LZ4_compress_generic(stream, source, dest, isize, maxOutputSize, acceleration, 0);
+	LZ4_freeStream(stream);
+	return result;
+#else
+	LZ4_stream_t stream;
+	LZ4_resetStream(&stream);
+	return LZ4_compress_generic(&stream, source, dest, isize, maxOutputSize, acceleration, 0);
+#endif
+}
+
+
+int LZ4_compress_default(const char* source,
+				 char* dest,
+				 int isize,
+				 int maxOutputSize)
+{
+	return LZ4_compress_fast(source, dest, isize, maxOutputSize, 1);
+}
+
+
+
+
 //****************************
 // Decompression functions
 //****************************
@@ -645,6 +968,8 @@ int LZ4_compress(const char* source,
 //		are safe against "buffer overflow" attack type.
 //		They will never write nor read outside of the provided output buffers.
 //      LZ4_uncompress_unknownOutputSize() also insures that it will never read outside of the input buffer.
+//      It is the legacy name of LZ4_decompress_safe(), which as well as its partial and dictionary variants
+//      checks every offset and length, so corrupted input can not make it read or write out of bounds.
 //		A corrupted input will produce an error result, a negative int, indicating the position of the error within input stream.
 
 int LZ4_uncompress(const char* source,
@@ -730,61 +1055,112 @@ _output_error:
 }
 
 
-int LZ4_uncompress_unknownOutputSize(
+#if (defined(LZ4_BIG_ENDIAN) && !defined(BIG_ENDIAN_NATIVE_BUT_INCOMPATIBLE))
+#  define LZ4_READ_OFFSET(p) ((size_t) lz4_bswap16(A16(p)))
+#else
+#  define LZ4_READ_OFFSET(p) ((size_t) A16(p))
+#endif
+
+// Bounds-checked decoder, it never reads outside of the input nor writes outside of the output buffer.
+// With @partial it stops once at least @targetOutputSize bytes are decoded.
+// Matches may reach into @dictStart, it may be either right in front of the output or anywhere else.
+FORCE_INLINE int LZ4_decompress_generic(
 				const char* source,
 				char* dest,
 				int isize,
-				int maxOutputSize)
+				int maxOutputSize,
+				int partial,
+				int targetOutputSize,
+				const char* dictStart,
+				int dictSize)
 {
 	// Local Variables
 	const BYTE* restrict ip = (const BYTE*) source;
 	const BYTE* const iend = ip + isize;
-	const BYTE* restrict ref;
+	const BYTE* ref;
 
-	BYTE* restrict op = (BYTE*) dest;
+	BYTE* op = (BYTE*) dest;
 	BYTE* const oend = op + maxOutputSize;
+	BYTE* const otarget = op + ((targetOutputSize < maxOutputSize) ? targetOutputSize : maxOutputSize);
 	BYTE* cpy;
 
+	const BYTE* lowPrefix = (const BYTE*) dest;
+	const BYTE* const dictEnd = (const BYTE*) dictStart + dictSize;
+	size_t extDictSize = dictSize;
+
 	size_t dec[] ={0, 3, 2, 3, 0, 0, 0, 0};
 
 
+	// Dictionary right in front of the output is decoded as its part
+	if ((dictSize > 0) && (dictEnd == lowPrefix)) { lowPrefix = (const BYTE*) dictStart; extDictSize = 0; }
+
+	if ((isize <= 0) || (maxOutputSize < 0) || (dictSize < 0)) return -1;
+	if (maxOutputSize == 0) return ((isize == 1) && (*ip == 0)) ? 0 : -1;
+
 	// Main Loop
 	while (ip<iend)
 	{
 		BYTE token;
-		int length;
+		size_t length, offset;
 
 		// get runlength
 		token = *ip++;
-		if ((length=(token>>ML_BITS)) == RUN_MASK) { int s=255; while ((ip<iend) && (s==255)) { s=*ip++; length += s; } }
+		if ((length=(token>>ML_BITS)) == RUN_MASK)
+		{
+			unsigned s=255;
+			while ((ip<iend) && (s==255)) { s=*ip++; length += s; }
+			if (length > (size_t)maxOutputSize) goto _output_error;   // Error : literal length overflow
+		}
 
 		// copy literals
-		cpy = op+length;
-		if ((cpy>oend-COPYLENGTH) || (ip+length>iend-COPYLENGTH))
+		if ((length + COPYLENGTH > (size_t)(oend - op)) || (length + COPYLENGTH > (size_t)(iend - ip)))
 		{
-			if (cpy > oend) goto _output_error;          // Error : request to write beyond destination buffer
-			if (ip+length > iend) goto _output_error;    // Error : request to read beyond source buffer
+			if (length > (size_t)(oend - op)) goto _output_error;     // Error : request to write beyond destination buffer
+			if (length > (size_t)(iend - ip)) goto _output_error;     // Error : request to read beyond source buffer
 			memcpy(op, ip, length);
 			op += length;
 			ip += length;
 			if (ip<iend) goto _output_error;             // Error : LZ4 format violation
 			break;    // Necessarily EOF, due to parsing restrictions
 		}
+		cpy = op+length;
 		LZ4_WILDCOPY(ip, op, cpy); ip -= (op-cpy); op = cpy;
 
 		// get offset
-		LZ4_READ_LITTLEENDIAN_16(ref,cpy,ip); ip+=2;
-		if (ref < (BYTE* const)dest) goto _output_error;   // Error : offset creates reference outside of destination buffer
+		offset = LZ4_READ_OFFSET(ip); ip+=2;
+		if unlikely((offset == 0) || (offset > (size_t)(op - lowPrefix) + extDictSize)) goto _output_error;   // Error : offset outside of the buffers
+		ref = op - offset;
 
 		// get matchlength
-		if ((length=(token&ML_MASK)) == ML_MASK) { while (ip<iend) { int s = *ip++; length +=s; if (s==255) continue; break; } }
+		if ((length=(token&ML_MASK)) == ML_MASK) { while (ip<iend) { unsigned s = *ip++; length +=s; if (s==255) continue; break; } }
+		if (length > (size_t)(oend - op)) goto _output_error;   // Error : request to write beyond destination buffer
+
+		// match starts in the external dictionary
+		if unlikely(offset > (size_t)(op - lowPrefix))
+		{
+			size_t back = offset - (op - lowPrefix);
+			size_t total = length + MINMATCH;
+
+			if (total > (size_t)(oend - op)) goto _output_error;
+			if (total <= back) { memmove(op, dictEnd - back, total); op += total; }
+			else
+			{
+				memcpy(op, dictEnd - back, back);
+				op += back;
+				total -= back;
+				for (ref = lowPrefix; total; total--) *op++ = *ref++;   // may overlap the output
+			}
+
+			if (partial && (op >= otarget)) break;
+			continue;
+		}
 
 		// copy repeated sequence
-		if unlikely(op-ref<STEPSIZE)
+		if unlikely(offset<STEPSIZE)
 		{
 #if LZ4_ARCH64
 			size_t dec2table[]={0, 0, 0, -1, 0, 1, 2, 3};
-			size_t dec2 = dec2table[op-ref];
+			size_t dec2 = dec2table[offset];
 #else
 			const int dec2 = 0;
 #endif
@@ -792,7 +1168,7 @@ int LZ4_uncompress_unknownOutputSize(
 			*op++ = *ref++;
 			*op++ = *ref++;
 			*op++ = *ref++;
-			ref -= dec[op-ref];
+			ref -= dec[offset];
 			A32(op)=A32(ref); op += STEPSIZE-4;
 			ref -= dec2;
 		} else { LZ4_COPYSTEP(ref,op); }
@@ -804,10 +1180,13 @@ int LZ4_uncompress_unknownOutputSize(
 			while(op<cpy) *op++=*ref++;
 			op=cpy;
 			if (op == oend) break;    // Check EOF (should never happen, since last 5 bytes are supposed to be literals)
+			if (partial && (op >= otarget)) break;
 			continue;
 		}
 		LZ4_SECURECOPY(ref, op, cpy);
 		op=cpy;		// correction
+
+		if (partial && (op >= otarget)) break;
 	}
 
 	// end of decoding
@@ -815,6 +1194,39 @@ int LZ4_uncompress_unknownOutputSize(
 
 	// write overflow error detected
 _output_error:
-	return (int) (-(((char*)ip)-source));
+	return (int) (-(((const char*)ip)-source)) - 1;
+}
+
+
+int LZ4_decompress_safe(const char* source, char* dest, int isize, int maxOutputSize)
+{
+	return LZ4_decompress_generic(source, dest, isize, maxOutputSize, 0, maxOutputSize, NULL, 0);
+}
+
+int LZ4_decompress_safe_partial(const char* source, char* dest, int isize, int targetOutputSize, int maxOutputSize)
+{
+	return LZ4_decompress_generic(source, dest, isize, maxOutputSize, 1, targetOutputSize, NULL, 0);
+}
+
+int LZ4_decompress_safe_usingDict(const char* source, char* dest, int isize, int maxOutputSize,
+				const char* dictStart, int dictSize)
+{
+	return LZ4_decompress_generic(source, dest, isize, maxOutputSize, 0, maxOutputSize, dictStart, dictSize);
+}
+
+int LZ4_decompress_safe_partial_usingDict(const char* source, char* dest, int isize, int targetOutputSize, int maxOutputSize,
+				const char* dictStart, int dictSize)
+{
+	return LZ4_decompress_generic(source, dest, isize, maxOutputSize, 1, targetOutputSize, dictStart, dictSize);
+}
+
+
+int LZ4_uncompress_unknownOutputSize(
+				const char* source,
+				char* dest,
+				int isize,
+				int maxOutputSize)
+{
+	return LZ4_decompress_safe(source, dest, isize, maxOutputSize);
 }
 
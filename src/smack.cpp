@@ -12,6 +12,9 @@ enum smack_storage_type {
 	SMACK_STORAGE_SNAPPY,
 	SMACK_STORAGE_LZ4_FAST,
 	SMACK_STORAGE_LZ4_HIGH,
+#ifdef SMACK_HAVE_ZSTD
+	SMACK_STORAGE_ZSTD,
+#endif
 };
 
 struct smack_ctl {
@@ -22,14 +25,19 @@ struct smack_ctl {
 		smack_snappy		*sms;
 		smack_lz4_fast		*smlf;
 		smack_lz4_high		*smlh;
+#ifdef SMACK_HAVE_ZSTD
+		smack_zstd		*smz;
+#endif
 	} sm;
 
 	smack_storage_type type;
+	enum key_hash key_hash;
 };
 
 struct smack_ctl *smack_init(struct smack_init_ctl *ictl, int *errp)
 {
 	struct smack_ctl *ctl;
+	config cfg;
 	int err;
 
 	ctl = (struct smack_ctl *)malloc(sizeof(struct smack_ctl));
@@ -53,11 +61,66 @@ struct smack_ctl *smack_init(struct smack_init_ctl *ictl, int *errp)
 		ctl->type = SMACK_STORAGE_LZ4_FAST;
 	} else if (!strcmp(ictl->type, "lz4_high")) {
 		ctl->type = SMACK_STORAGE_LZ4_HIGH;
+#ifdef SMACK_HAVE_ZSTD
+	} else if (!strcmp(ictl->type, "zstd")) {
+		ctl->type = SMACK_STORAGE_ZSTD;
+#endif
 	} else {
 		err = -ENOTSUP;
 		goto err_out_free;
 	}
 
+	if (!ictl->compaction || !strcmp(ictl->compaction, "leveled")) {
+		cfg.compaction = compaction_leveled;
+	} else if (!strcmp(ictl->compaction, "tiered")) {
+		cfg.compaction = compaction_tiered;
+	} else {
+		err = -ENOTSUP;
+		goto err_out_free;
+	}
+
+	if (!ictl->key_hash || !strcmp(ictl->key_hash, "sha512")) {
+		ctl->key_hash = key_hash_sha512;
+	} else if (!strcmp(ictl->key_hash, "fast")) {
+		ctl->key_hash = key_hash_fast;
+	} else {
+		err = -ENOTSUP;
+		goto err_out_free;
+	}
+
+	if (ictl->ttl < 0) {
+		err = -EINVAL;
+		goto err_out_free;
+	}
+	cfg.ttl = ictl->ttl;
+
+	if ((ictl->split_size < 0) || (ictl->merge_size < 0)) {
+		err = -EINVAL;
+		goto err_out_free;
+	}
+	if (ictl->split_size)
+		cfg.split_size = ictl->split_size;
+	cfg.merge_size = ictl->merge_size;
+
+	if (ictl->vlog_min_size < 0) {
+		err = -EINVAL;
+		goto err_out_free;
+	}
+	cfg.vlog_min_size = ictl->vlog_min_size;
+	cfg.lazy_open = !!ictl->lazy_open;
+
+	if (ictl->bloom_bits_per_key)
+		cfg.bloom_bits_per_key = std::max(ictl->bloom_bits_per_key, 0);
+
+	if (ictl->dict_size < 0) {
+		err = -EINVAL;
+		goto err_out_free;
+	}
+	cfg.compression_level = ictl->compression_level;
+	if (ictl->compression_min_gain)
+		cfg.compression_min_gain = ictl->compression_min_gain;
+	cfg.dict_size = ictl->dict_size;
+
 	if (ictl->log)
 		logger::instance()->init(ictl->log, ictl->log_level);
 	try {
@@ -65,33 +128,40 @@ struct smack_ctl *smack_init(struct smack_init_ctl *ictl, int *errp)
 			case SMACK_STORAGE_ZLIB_DEFAULT:
 				ctl->sm.smzd = new smack_zlib_default(ictl->path,
 						ictl->bloom_size, ictl->max_cache_size,
-						ictl->max_blob_num, ictl->cache_thread_num);
+						ictl->max_blob_num, ictl->cache_thread_num, cfg);
 				break;
 			case SMACK_STORAGE_ZLIB_BEST_COMPRESSION:
 				ctl->sm.smzb = new smack_zlib_best(ictl->path,
 						ictl->bloom_size, ictl->max_cache_size,
-						ictl->max_blob_num, ictl->cache_thread_num);
+						ictl->max_blob_num, ictl->cache_thread_num, cfg);
 				break;
 			case SMACK_STORAGE_BZIP2:
 				ctl->sm.smb = new smack_bzip2(ictl->path,
 						ictl->bloom_size, ictl->max_cache_size,
-						ictl->max_blob_num, ictl->cache_thread_num);
+						ictl->max_blob_num, ictl->cache_thread_num, cfg);
 				break;
 			case SMACK_STORAGE_SNAPPY:
 				ctl->sm.sms = new smack_snappy(ictl->path,
 						ictl->bloom_size, ictl->max_cache_size,
-						ictl->max_blob_num, ictl->cache_thread_num);
+						ictl->max_blob_num, ictl->cache_thread_num, cfg);
 				break;
 			case SMACK_STORAGE_LZ4_FAST:
 				ctl->sm.smlf = new smack_lz4_fast(ictl->path,
 						ictl->bloom_size, ictl->max_cache_size,
-						ictl->max_blob_num, ictl->cache_thread_num);
+						ictl->max_blob_num, ictl->cache_thread_num, cfg);
 				break;
 			case SMACK_STORAGE_LZ4_HIGH:
 				ctl->sm.smlh = new smack_lz4_high(ictl->path,
 						ictl->bloom_size, ictl->max_cache_size,
-						ictl->max_blob_num, ictl->cache_thread_num);
+						ictl->max_blob_num, ictl->cache_thread_num, cfg);
 				break;
+#ifdef SMACK_HAVE_ZSTD
+			case SMACK_STORAGE_ZSTD:
+				ctl->sm.smz = new smack_zstd(ictl->path,
+						ictl->bloom_size, ictl->max_cache_size,
+						ictl->max_blob_num, ictl->cache_thread_num, cfg);
+				break;
+#endif
 		}
 	} catch (const std::exception &e) {
 		log(SMACK_LOG_ERROR, "could not initialize smack\n");
@@ -137,6 +207,12 @@ void smack_cleanup(struct smack_ctl *ctl)
 			if (ctl->sm.smlh)
 				delete ctl->sm.smlh;
 			break;
+#ifdef SMACK_HAVE_ZSTD
+		case SMACK_STORAGE_ZSTD:
+			if (ctl->sm.smz)
+				delete ctl->sm.smz;
+			break;
+#endif
 	}
 
 	free(ctl);
@@ -168,6 +244,11 @@ int smack_read(struct smack_ctl *ctl, struct index *idx, char **datap)
 			case SMACK_STORAGE_LZ4_HIGH:
 				ret = ctl->sm.smlh->read(k);
 				break;
+#ifdef SMACK_HAVE_ZSTD
+			case SMACK_STORAGE_ZSTD:
+				ret = ctl->sm.smz->read(k);
+				break;
+#endif
 		}
 
 		data = (char *)malloc(ret.size());
@@ -208,6 +289,11 @@ int smack_write(struct smack_ctl *ctl, struct index *idx, const char *data)
 			case SMACK_STORAGE_LZ4_HIGH:
 				ctl->sm.smlh->write(k, data, idx->data_size);
 				break;
+#ifdef SMACK_HAVE_ZSTD
+			case SMACK_STORAGE_ZSTD:
+				ctl->sm.smz->write(k, data, idx->data_size);
+				break;
+#endif
 		}
 		return 0;
 	} catch (const std::exception &e) {
@@ -240,6 +326,11 @@ int smack_remove(struct smack_ctl *ctl, struct index *idx)
 			case SMACK_STORAGE_LZ4_HIGH:
 				ctl->sm.smlh->remove(k);
 				break;
+#ifdef SMACK_HAVE_ZSTD
+			case SMACK_STORAGE_ZSTD:
+				ctl->sm.smz->remove(k);
+				break;
+#endif
 		}
 	} catch (const std::exception &e) {
 		log(SMACK_LOG_ERROR, "%s: could not remove data: %s: %s\n", key(idx).str(), e.what(), strerror(errno));
@@ -273,6 +364,11 @@ int smack_lookup(struct smack_ctl *ctl, struct index *idx, char **pathp)
 			case SMACK_STORAGE_LZ4_HIGH:
 				path = ctl->sm.smlh->lookup(k);
 				break;
+#ifdef SMACK_HAVE_ZSTD
+			case SMACK_STORAGE_ZSTD:
+				path = ctl->sm.smz->lookup(k);
+				break;
+#endif
 		}
 
 		path += ".data";
@@ -315,6 +411,11 @@ long long smack_total_num(struct smack_ctl *ctl)
 			case SMACK_STORAGE_LZ4_HIGH:
 				num = ctl->sm.smlh->total_num();
 				break;
+#ifdef SMACK_HAVE_ZSTD
+			case SMACK_STORAGE_ZSTD:
+				num = ctl->sm.smz->total_num();
+				break;
+#endif
 		}
 
 		return num;
@@ -345,6 +446,11 @@ void smack_sync(struct smack_ctl *ctl)
 			case SMACK_STORAGE_LZ4_HIGH:
 				ctl->sm.smlh->sync();
 				break;
+#ifdef SMACK_HAVE_ZSTD
+			case SMACK_STORAGE_ZSTD:
+				ctl->sm.smz->sync();
+				break;
+#endif
 		}
 	} catch (const std::exception &e) {
 		log(SMACK_LOG_ERROR, "Could not sync: %s\n", e.what());
@@ -355,3 +461,49 @@ void smack_log_update(struct smack_ctl *, char *log, uint32_t mask)
 {
 	logger::instance()->init(log, mask);
 }
+
+static void smack_set_key(struct index *idx, const key &k)
+{
+	memcpy(idx->id, k.id(), SMACK_KEY_SIZE);
+	idx->flags = SMACK_INDEX_SET_KEY_SIZE(idx->flags, SMACK_KEY_SIZE);
+}
+
+int smack_key(struct smack_ctl *ctl, const char *name, int size, struct index *idx)
+{
+	if (size < 0)
+		return -EINVAL;
+
+	try {
+		smack_set_key(idx, key(std::string(name, size), ctl->key_hash));
+	} catch (const std::exception &e) {
+		log(SMACK_LOG_ERROR, "could not hash key name: %s\n", e.what());
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+int smack_keys(struct smack_ctl *ctl, const char **names, const int *sizes, int num, struct index *idx)
+{
+	if (num < 0)
+		return -EINVAL;
+
+	try {
+		std::vector<std::string> n(num);
+		std::vector<key> keys;
+
+		for (int i = 0; i < num; ++i) {
+			if (sizes[i] < 0)
+				return -EINVAL;
+			n[i].assign(names[i], sizes[i]);
+		}
+
+		key::hash_batch(n, keys, ctl->key_hash);
+
+		for (int i = 0; i < num; ++i)
+			smack_set_key(&idx[i], keys[i]);
+	} catch (const std::exception &e) {
+		log(SMACK_LOG_ERROR, "could not hash %d key names: %s\n", num, e.what());
+		return -ENOMEM;
+	}
+	return 0;
+}
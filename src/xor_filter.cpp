@@ -0,0 +1,169 @@
+#include <algorithm>
+
+#include <smack/base.hpp>
+
+using namespace ioremap::smack;
+
+/* number of seeds tried before the filter is given up, construction fails with tiny probability */
+#define XOR_FILTER_MAX_ATTEMPTS		100
+
+static inline uint64_t xor_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static inline uint64_t xor_rotl(uint64_t h, int shift)
+{
+	return (h << shift) | (h >> (64 - shift));
+}
+
+static inline uint32_t xor_reduce(uint32_t h, uint32_t n)
+{
+	return ((uint64_t)h * n) >> 32;
+}
+
+xor_filter::xor_filter() : m_seed(0), m_block_length(0)
+{
+}
+
+xor_filter::xor_filter(uint64_t seed, const std::vector<uint8_t> &fingerprints) :
+m_seed(seed), m_block_length(fingerprints.size() / 3), m_fingerprints(fingerprints)
+{
+}
+
+/*
+ * Full-size keys are SHA-512 digests, one of their words is already a good hash.
+ * Bytes used by chunk bloom filters are skipped, so both filters fail independently.
+ */
+uint64_t xor_filter::hash(const char *data, int size)
+{
+	uint64_t h;
+
+	if (size == SMACK_KEY_SIZE) {
+		memcpy(&h, data + 40, sizeof(uint64_t));
+		return h;
+	}
+
+	return bloom::hash(data, size) ^ 0x5851f42d4c957f2dULL;
+}
+
+void xor_filter::positions(uint64_t h, uint32_t pos[3]) const
+{
+	pos[0] = xor_reduce(h, m_block_length);
+	pos[1] = xor_reduce(xor_rotl(h, 21), m_block_length) + m_block_length;
+	pos[2] = xor_reduce(xor_rotl(h, 42), m_block_length) + 2 * m_block_length;
+}
+
+bool xor_filter::build(std::vector<uint64_t> &keys)
+{
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+	size_t capacity = 32 + 1.23 * keys.size();
+	m_block_length = capacity / 3;
+	capacity = 3 * m_block_length;
+
+	std::vector<uint64_t> xormask(capacity);
+	std::vector<uint32_t> count(capacity);
+	std::vector<uint32_t> queue;
+	std::vector<std::pair<uint64_t, uint32_t> > stack;
+
+	m_seed = 0x9e3779b97f4a7c15ULL;
+	for (int attempt = 0; attempt < XOR_FILTER_MAX_ATTEMPTS; ++attempt, m_seed = xor_mix(m_seed + attempt)) {
+		std::fill(xormask.begin(), xormask.end(), 0);
+		std::fill(count.begin(), count.end(), 0);
+		queue.clear();
+		stack.clear();
+
+		for (size_t i = 0; i < keys.size(); ++i) {
+			uint64_t h = xor_mix(keys[i] + m_seed);
+			uint32_t pos[3];
+
+			positions(h, pos);
+			for (int j = 0; j < 3; ++j) {
+				xormask[pos[j]] ^= h;
+				count[pos[j]]++;
+			}
+		}
+
+		for (size_t i = 0; i < capacity; ++i) {
+			if (count[i] == 1)
+				queue.push_back(i);
+		}
+
+		/* peeling: slot which is hit by the single key is assigned last */
+		while (!queue.empty()) {
+			uint32_t idx = queue.back();
+			queue.pop_back();
+
+			if (count[idx] != 1)
+				continue;
+
+			uint64_t h = xormask[idx];
+			stack.push_back(std::make_pair(h, idx));
+
+			uint32_t pos[3];
+			positions(h, pos);
+			for (int j = 0; j < 3; ++j) {
+				xormask[pos[j]] ^= h;
+				if (--count[pos[j]] == 1)
+					queue.push_back(pos[j]);
+			}
+		}
+
+		if (stack.size() == keys.size())
+			break;
+	}
+
+	if (stack.size() != keys.size()) {
+		m_fingerprints.clear();
+		m_block_length = 0;
+		return false;
+	}
+
+	m_fingerprints.assign(capacity, 0);
+	for (std::vector<std::pair<uint64_t, uint32_t> >::reverse_iterator it = stack.rbegin(); it != stack.rend(); ++it) {
+		uint32_t pos[3];
+		positions(it->first, pos);
+
+		uint8_t fp = it->first ^ (it->first >> 32);
+		for (int j = 0; j < 3; ++j) {
+			if (pos[j] != it->second)
+				fp ^= m_fingerprints[pos[j]];
+		}
+
+		m_fingerprints[it->second] = fp;
+	}
+
+	return true;
+}
+
+bool xor_filter::check(const char *data, int size) const
+{
+	if (!m_block_length)
+		return false;
+
+	uint64_t h = xor_mix(hash(data, size) + m_seed);
+	uint32_t pos[3];
+
+	positions(h, pos);
+	uint8_t fp = h ^ (h >> 32);
+
+	return fp == (m_fingerprints[pos[0]] ^ m_fingerprints[pos[1]] ^ m_fingerprints[pos[2]]);
+}
+
+uint64_t xor_filter::seed() const
+{
+	return m_seed;
+}
+
+const std::vector<uint8_t> &xor_filter::fingerprints() const
+{
+	return m_fingerprints;
+}